@@ -15,6 +15,12 @@ LOCAL_SRC_FILES := \
     mounts.c \
     extendedcommands.c \
     nandroid.c \
+    nandroid_compress.c \
+    nandroid_index.c \
+    nandroid_members.c \
+    nandroid_stream.c \
+    nandroid_tar.c \
+    nandroid_throttle.c \
     reboot.c \
     ../../system/core/toolbox/dynarray.c \
     ../../system/core/toolbox/newfs_msdos.c \
@@ -135,7 +141,7 @@ LOCAL_STATIC_LIBRARIES :=
 
 LOCAL_CFLAGS += -DUSE_EXT4 -DMINIVOLD
 LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include external/fsck_msdos
-LOCAL_C_INCLUDES += system/vold
+LOCAL_C_INCLUDES += system/vold external/openssl/include
 
 LOCAL_STATIC_LIBRARIES += libext4_utils_static libz libsparse_static
 
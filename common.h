@@ -47,6 +47,8 @@ void ui_set_nice(int enabled);
 int ui_was_niced();
 int ui_get_text_cols();
 void ui_increment_frame();
+// How late the progress thread's frames have been lately, in ms.
+int ui_get_frame_latency();
 
 #ifdef ENABLE_LOKI
 extern int loki_support_enabled;
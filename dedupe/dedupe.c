@@ -13,6 +13,7 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <signal.h>
@@ -20,321 +21,3012 @@
 #include <unistd.h>
 #include <paths.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#define DEDUPE_VERSION 5
+// initial size of the gc set of used blobs, grown as needed
+#define DIGEST_SET_CAPACITY 65536
+#define DEDUPE_MAX_THREADS 8
+// how many manifest entries each worker may have in flight
+#define DEDUPE_JOBS_PER_THREAD 64
+// per worker read buffer; files that fit are hashed before anything is written
+#define DEDUPE_BUFFER_SIZE (256 * 1024)
+// sidecar in blob_dir remembering the keys of files from previous runs
+#define DEDUPE_STAT_CACHE_FILE "stat.cache"
+// held while a run merges its entries into the cache
+#define DEDUPE_STAT_CACHE_LOCK_FILE "stat.cache.lock"
+#define DEDUPE_STAT_CACHE_VERSION 2
+#define DEDUPE_STAT_CACHE_BUCKETS 65536
+// files at least this big are split into content-defined chunks
+#define DEDUPE_CHUNK_FILE_SIZE (1024 * 1024)
+#define DEDUPE_CHUNK_MIN_SIZE (16 * 1024)
+#define DEDUPE_CHUNK_MAX_SIZE DEDUPE_BUFFER_SIZE
+// 16 bits of the gear hash, for 64k chunks past the minimum on average
+#define DEDUPE_CHUNK_MASK 0xffff0000
+// blobs smaller than this go into packfiles
+#define DEDUPE_PACK_DIR "packs"
+#define DEDUPE_PACK_MAX_BLOB DEDUPE_CHUNK_MIN_SIZE
+#define DEDUPE_PACK_MAX_SIZE (64 * 1024 * 1024)
+#define DEDUPE_PACK_MAGIC "DEDUPEPK"
+#define DEDUPE_PACK_INDEX_MAGIC "DEDUPEIX"
+// magic and entry count
+#define DEDUPE_PACK_HEADER_SIZE 12
+// digest, offset and length
+#define DEDUPE_PACK_INDEX_ENTRY_SIZE (SHA256_DIGEST_LENGTH + 12)
+
+// Loose blobs may be stored deflated, under their key plus a suffix.
+// They start with a magic and the le64 uncompressed size, followed by a
+// zlib stream. Packed blobs are small and always stored as is.
+#define DEDUPE_COMPRESSED_SUFFIX ".z"
+#define DEDUPE_COMPRESSED_MAGIC "DEDUPEZB"
+#define DEDUPE_COMPRESSED_HEADER_SIZE 16
+#define DEDUPE_COMPRESS_SAMPLE_SIZE (16 * 1024)
+#define DEDUPE_COMPRESS_BUFFER_SIZE (64 * 1024)
+
+// Binary manifests hold a header, fixed size records in walk order, a
+// table of NUL terminated paths and link targets, and an index of record
+// numbers sorted by path.
+//   header: magic, le32 version, le32 count, le64 strings offset,
+//           le32 strings size, 4 unused, le64 index offset
+//   record: type, 3 unused, le32 mode, uid, gid, le64 atime, mtime,
+//           ctime, size, le32 path, le32 link target, 32 byte digest
+#define DEDUPE_BINARY_MAGIC "DEDUPEBM"
+#define DEDUPE_BINARY_HEADER_SIZE 40
+#define DEDUPE_BINARY_RECORD_SIZE (56 + SHA256_DIGEST_LENGTH)
+#define DEDUPE_BINARY_NO_STRING 0xffffffff
+
+// Blobs smaller than DEDUPE_PACK_MAX_BLOB are appended to packfiles in
+// blob_dir/packs instead of getting a file each. A pack holds a sequence
+// of (digest, length, data) records, and once complete gets a sorted
+// .idx of (digest, offset, length) so blobs can be found without
+// scanning it. A pack without an index is unfinished and is removed by gc.
+struct DEDUPE_PACK_ENTRY {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    // index into DEDUPE_PACKS.ids
+    int pack;
+    // of the blob data, past the record header
+    uint64_t offset;
+    uint32_t length;
+};
+
+struct DEDUPE_PACKS {
+    char dir[PATH_MAX];
+    // every indexed pack, by number
+    int count;
+    int *ids;
+    int *fds;
+    // the entries of every indexed pack, sorted by digest
+    struct DEDUPE_PACK_ENTRY *entries;
+    int entry_count;
+
+    // the pack being written by this run, and everything appended by it
+    pthread_mutex_t lock;
+    FILE *out;
+    int out_pack;
+    uint64_t out_size;
+    struct DEDUPE_PACK_ENTRY *new_entries;
+    int new_count;
+    int new_capacity;
+    // open addressed table of new_entries indices, -1 when empty
+    int *new_table;
+    int new_table_size;
+    int error;
+};
+
+// A manifest entry produced by the directory walk.
+// Entries are written out strictly in walk order, so the manifest is the
+// same no matter how many workers hash and copy the files.
+struct DEDUPE_STORE_JOB {
+    struct DEDUPE_STORE_JOB *next;
+    struct DEDUPE_STORE_JOB *next_work;
+    // path printed for progress, and the file to hash if this is a file entry
+    char *path;
+    char type;
+    struct stat st;
+    // target of a link, NULL otherwise
+    char *target;
+    int is_file;
+    // stored as a list of content-defined chunks
+    int chunked;
+    int size;
+    // identity of the file for the stat cache
+    unsigned long mtime;
+    unsigned long ctime;
+    unsigned long ino;
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    int ret;
+    int done;
+};
+
+// Maps a file's absolute path and stat identity to the key it hashed to
+// on a previous run, so unchanged files need not be read again.
+struct DEDUPE_STAT_ENTRY {
+    struct DEDUPE_STAT_ENTRY *next;
+    char *path;
+    long long size;
+    unsigned long mtime;
+    unsigned long ctime;
+    unsigned long ino;
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+};
+
+struct DEDUPE_STAT_CACHE {
+    // absolute path of the directory being stored
+    char root[PATH_MAX];
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char lock_path[PATH_MAX];
+    struct DEDUPE_STAT_ENTRY **buckets;
+    int bucket_count;
+    // the rewritten cache, published over the old one on success
+    FILE *output;
+    // files touched in the same second as the run started may still be
+    // changing without their mtime moving, so they are never cached
+    time_t start_time;
+};
+
+// Builds a binary manifest. Records are written out as they come, while
+// the strings are kept for the string table and the path index.
+struct DEDUPE_BINARY_WRITER {
+    FILE *output;
+    char *strings;
+    uint32_t strings_size;
+    uint32_t strings_capacity;
+    // path offset of each record written so far
+    uint32_t *paths;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+// A loose blob being written to its tmp file.
+struct DEDUPE_BLOB_WRITER {
+    int fd;
+    // 0 when writing the data as is
+    int level;
+    z_stream stream;
+    int stream_ready;
+    unsigned char *out;
+};
+
+typedef struct DEDUPE_STORE_CONTEXT {
+    char blob_dir[PATH_MAX];
+    FILE *output_manifest;
+    // NULL when writing a text manifest
+    struct DEDUPE_BINARY_WRITER *binary;
+    const char** excludes;
+    int exclude_count;
+    // NULL unless the stat cache is enabled
+    struct DEDUPE_STAT_CACHE *stat_cache;
+    struct DEDUPE_PACKS packs;
+    // zlib level for new loose blobs, 0 to store them as is
+    int compress_level;
+
+    pthread_mutex_t lock;
+    // signalled when a file job is queued, or the walk is over
+    pthread_cond_t work_ready;
+    // signalled when a job finishes, is queued already done, or the walk is over
+    pthread_cond_t job_done;
+    // signalled when the writer retires a job
+    pthread_cond_t queue_space;
+    struct DEDUPE_STORE_JOB *head;
+    struct DEDUPE_STORE_JOB *tail;
+    struct DEDUPE_STORE_JOB *work_head;
+    struct DEDUPE_STORE_JOB *work_tail;
+    int queued;
+    int max_queued;
+    int worker_count;
+    int walk_done;
+    int error;
+};
+
+static void usage(char** argv) {
+    fprintf(stderr, "usage: %s c [-s] [-b] [-z level] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory [path...]\n", argv[0]);
+    fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s verify [-f] [-j threads] input_manifest blob_dir\n", argv[0]);
+}
+
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+
+static int write_fully(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// if a hash is abcdefg,
+// the output blob name is abc/defg
+// this is to get around vfat having a 64k directory size limit (usually around 20k files)
+static void sha256_to_key(const unsigned char *sumdata, char *key) {
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
+    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
+
+    memcpy(key, psum, 3);
+    key[3] = '/';
+    strcpy(key + 4, psum + 3);
+}
+
+// Reads until len bytes or end of file, returns the count or -1.
+static int read_fully(int fd, void *buf, int len) {
+    char *p = buf;
+    int total = 0;
+    while (total < len) {
+        ssize_t bytes_read = read(fd, p + total, len - total);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes_read == 0)
+            break;
+        total += bytes_read;
+    }
+    return total;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    int i;
+    for (i = 0; i < 4; i++)
+        p[i] = v >> (i * 8);
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static int key_to_digest(const char *key, unsigned char *digest) {
+    int n = 0;
+    for (; *key != '\0'; key++) {
+        if (*key == '/')
+            continue;
+        int v = hex_value(*key);
+        if (v < 0 || n == SHA256_DIGEST_LENGTH * 2)
+            return -1;
+        if (n & 1)
+            digest[n / 2] |= v;
+        else
+            digest[n / 2] = v << 4;
+        n++;
+    }
+    return n == SHA256_DIGEST_LENGTH * 2 ? 0 : -1;
+}
+
+static int pack_entry_compare(const void *a, const void *b) {
+    return memcmp(((const struct DEDUPE_PACK_ENTRY*)a)->digest, ((const struct DEDUPE_PACK_ENTRY*)b)->digest, SHA256_DIGEST_LENGTH);
+}
+
+static void pack_path(struct DEDUPE_PACKS *packs, int id, const char *ext, char *path) {
+    snprintf(path, PATH_MAX, "%s/%08d.%s", packs->dir, id, ext);
+}
+
+// Appends the index of one pack to the loaded entries.
+static int packs_load_index(struct DEDUPE_PACKS *packs, int id) {
+    char path[PATH_MAX];
+    unsigned char header[DEDUPE_PACK_HEADER_SIZE];
+    unsigned char record[DEDUPE_PACK_INDEX_ENTRY_SIZE];
+
+    pack_path(packs, id, "idx", path);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return 1;
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+            memcmp(header, DEDUPE_PACK_INDEX_MAGIC, 8) != 0) {
+        fclose(f);
+        return 1;
+    }
+    uint32_t count = get_le32(header + 8);
+
+    pack_path(packs, id, "pack", path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fclose(f);
+        return 1;
+    }
+
+    struct DEDUPE_PACK_ENTRY *entries = realloc(packs->entries, sizeof(*entries) * (packs->entry_count + count));
+    int *ids = realloc(packs->ids, sizeof(int) * (packs->count + 1));
+    if (ids != NULL)
+        packs->ids = ids;
+    int *fds = realloc(packs->fds, sizeof(int) * (packs->count + 1));
+    if (fds != NULL)
+        packs->fds = fds;
+    if ((count > 0 && entries == NULL) || ids == NULL || fds == NULL) {
+        close(fd);
+        fclose(f);
+        return ENOMEM;
+    }
+    packs->entries = entries;
+
+    uint32_t i;
+    struct DEDUPE_PACK_ENTRY *e = packs->entries + packs->entry_count;
+    for (i = 0; i < count; i++, e++) {
+        if (fread(record, 1, sizeof(record), f) != sizeof(record)) {
+            close(fd);
+            fclose(f);
+            return 1;
+        }
+        memcpy(e->digest, record, SHA256_DIGEST_LENGTH);
+        e->pack = packs->count;
+        e->offset = get_le64(record + SHA256_DIGEST_LENGTH);
+        e->length = get_le32(record + SHA256_DIGEST_LENGTH + 8);
+    }
+    fclose(f);
+
+    packs->entry_count += count;
+    packs->ids[packs->count] = id;
+    packs->fds[packs->count] = fd;
+    packs->count++;
+    return 0;
+}
+
+// Loads the indices of all packs in blob_dir. Missing packs are fine.
+static int packs_open(struct DEDUPE_PACKS *packs, const char *blob_dir) {
+    memset(packs, 0, sizeof(*packs));
+    pthread_mutex_init(&packs->lock, NULL);
+    packs->out_pack = -1;
+    snprintf(packs->dir, sizeof(packs->dir), "%s/%s", blob_dir, DEDUPE_PACK_DIR);
+
+    DIR *dp = opendir(packs->dir);
+    if (dp == NULL)
+        return 0;
+    struct dirent *ep;
+    int ret = 0;
+    while ((ep = readdir(dp))) {
+        int id;
+        char ext[8];
+        if (sscanf(ep->d_name, "%d.%7s", &id, ext) != 2 || strcmp(ext, "idx") != 0)
+            continue;
+        if (packs_load_index(packs, id)) {
+            fprintf(stderr, "Unable to load pack index %s/%s\n", packs->dir, ep->d_name);
+            ret = 1;
+            break;
+        }
+    }
+    closedir(dp);
+    qsort(packs->entries, packs->entry_count, sizeof(*packs->entries), pack_entry_compare);
+    return ret;
+}
+
+static const struct DEDUPE_PACK_ENTRY* packs_find_indexed(struct DEDUPE_PACKS *packs, const unsigned char *digest) {
+    struct DEDUPE_PACK_ENTRY needle;
+    memcpy(needle.digest, digest, SHA256_DIGEST_LENGTH);
+    return bsearch(&needle, packs->entries, packs->entry_count, sizeof(needle), pack_entry_compare);
+}
+
+// Must hold packs->lock.
+static int* packs_new_slot(struct DEDUPE_PACKS *packs, const unsigned char *digest) {
+    uint32_t slot = get_le32(digest) & (packs->new_table_size - 1);
+    for (;;) {
+        int i = packs->new_table[slot];
+        if (i < 0 || memcmp(packs->new_entries[i].digest, digest, SHA256_DIGEST_LENGTH) == 0)
+            return &packs->new_table[slot];
+        slot = (slot + 1) & (packs->new_table_size - 1);
+    }
+}
+
+// Whether a blob is in a pack, either indexed or appended by this run.
+static int packs_contain(struct DEDUPE_PACKS *packs, const unsigned char *digest) {
+    if (packs_find_indexed(packs, digest) != NULL)
+        return 1;
+    int found = 0;
+    pthread_mutex_lock(&packs->lock);
+    if (packs->new_table != NULL)
+        found = *packs_new_slot(packs, digest) >= 0;
+    pthread_mutex_unlock(&packs->lock);
+    return found;
+}
+
+// Writes the index of the pack being written and closes it.
+// Must hold packs->lock.
+static int packs_finish_locked(struct DEDUPE_PACKS *packs) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    unsigned char header[DEDUPE_PACK_HEADER_SIZE];
+    unsigned char record[DEDUPE_PACK_INDEX_ENTRY_SIZE];
+    int i, count = 0;
+    int ret = 0;
+
+    if (packs->out == NULL)
+        return packs->error;
+    if (fclose(packs->out))
+        ret = 5;
+    packs->out = NULL;
+    if (ret || packs->error)
+        return packs->error = ret ? ret : packs->error;
+
+    struct DEDUPE_PACK_ENTRY *entries = malloc(sizeof(*entries) * (packs->new_count + 1));
+    if (entries == NULL)
+        return packs->error = ENOMEM;
+    for (i = 0; i < packs->new_count; i++) {
+        if (packs->new_entries[i].pack == packs->out_pack)
+            entries[count++] = packs->new_entries[i];
+    }
+    qsort(entries, count, sizeof(*entries), pack_entry_compare);
+
+    pack_path(packs, packs->out_pack, "idx.tmp", tmp_path);
+    pack_path(packs, packs->out_pack, "idx", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        free(entries);
+        return packs->error = 4;
+    }
+    memcpy(header, DEDUPE_PACK_INDEX_MAGIC, 8);
+    put_le32(header + 8, count);
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header))
+        ret = 5;
+    for (i = 0; i < count && !ret; i++) {
+        memcpy(record, entries[i].digest, SHA256_DIGEST_LENGTH);
+        put_le64(record + SHA256_DIGEST_LENGTH, entries[i].offset);
+        put_le32(record + SHA256_DIGEST_LENGTH + 8, entries[i].length);
+        if (fwrite(record, 1, sizeof(record), f) != sizeof(record))
+            ret = 5;
+    }
+    free(entries);
+    if (fclose(f) && !ret)
+        ret = 5;
+    if (!ret && rename(tmp_path, path))
+        ret = errno;
+    if (ret) {
+        unlink(tmp_path);
+        packs->error = ret;
+    }
+    return ret;
+}
+
+static int packs_finish(struct DEDUPE_PACKS *packs) {
+    pthread_mutex_lock(&packs->lock);
+    int ret = packs_finish_locked(packs);
+    pthread_mutex_unlock(&packs->lock);
+    return ret;
+}
+
+// Starts a new pack numbered after every existing one. Must hold packs->lock,
+// which only covers this process, so a number another run took in the
+// meantime is skipped.
+static int packs_start_locked(struct DEDUPE_PACKS *packs) {
+    char path[PATH_MAX];
+    int id = 0;
+    int fd;
+
+    mkdir(packs->dir, S_IRWXU | S_IRWXG | S_IRWXO);
+    DIR *dp = opendir(packs->dir);
+    if (dp != NULL) {
+        struct dirent *ep;
+        while ((ep = readdir(dp))) {
+            int existing;
+            if (sscanf(ep->d_name, "%d.", &existing) == 1 && existing >= id)
+                id = existing + 1;
+        }
+        closedir(dp);
+    }
+
+    pack_path(packs, id, "pack", path);
+    while ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0 && errno == EEXIST)
+        pack_path(packs, ++id, "pack", path);
+    if (fd < 0 || (packs->out = fdopen(fd, "wb")) == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return packs->error = 4;
+    }
+    setvbuf(packs->out, NULL, _IOFBF, DEDUPE_BUFFER_SIZE);
+    if (fwrite(DEDUPE_PACK_MAGIC, 1, 8, packs->out) != 8)
+        return packs->error = 5;
+    packs->out_pack = id;
+    packs->out_size = 8;
+    return 0;
+}
+
+// Appends a blob to the current pack unless this run already added it.
+static int packs_append(struct DEDUPE_PACKS *packs, const unsigned char *digest, const void *buf, int len) {
+    unsigned char header[SHA256_DIGEST_LENGTH + 4];
+    int ret = 0;
+
+    pthread_mutex_lock(&packs->lock);
+    if (packs->error) {
+        ret = packs->error;
+        goto out;
+    }
+    if (packs->new_count * 2 >= packs->new_table_size) {
+        // grow the table and the entries together
+        int size = packs->new_table_size ? packs->new_table_size * 2 : 4096;
+        int *table = malloc(sizeof(int) * size);
+        struct DEDUPE_PACK_ENTRY *entries = realloc(packs->new_entries, sizeof(*entries) * size / 2);
+        if (entries != NULL)
+            packs->new_entries = entries;
+        if (table == NULL || entries == NULL) {
+            free(table);
+            ret = packs->error = ENOMEM;
+            goto out;
+        }
+        free(packs->new_table);
+        packs->new_table = table;
+        packs->new_table_size = size;
+        packs->new_capacity = size / 2;
+        memset(table, 0xff, sizeof(int) * size);
+        int i;
+        for (i = 0; i < packs->new_count; i++)
+            *packs_new_slot(packs, packs->new_entries[i].digest) = i;
+    }
+    int *slot = packs_new_slot(packs, digest);
+    if (*slot >= 0)
+        goto out;
+
+    if (packs->out != NULL && packs->out_size + sizeof(header) + len > DEDUPE_PACK_MAX_SIZE) {
+        if (ret = packs_finish_locked(packs))
+            goto out;
+    }
+    if (packs->out == NULL && (ret = packs_start_locked(packs)))
+        goto out;
+
+    memcpy(header, digest, SHA256_DIGEST_LENGTH);
+    put_le32(header + SHA256_DIGEST_LENGTH, len);
+    if (fwrite(header, 1, sizeof(header), packs->out) != sizeof(header) ||
+            fwrite(buf, 1, len, packs->out) != (size_t)len) {
+        ret = packs->error = 5;
+        goto out;
+    }
+
+    struct DEDUPE_PACK_ENTRY *e = &packs->new_entries[packs->new_count];
+    memcpy(e->digest, digest, SHA256_DIGEST_LENGTH);
+    e->pack = packs->out_pack;
+    e->offset = packs->out_size + sizeof(header);
+    e->length = len;
+    *slot = packs->new_count++;
+    packs->out_size += sizeof(header) + len;
+
+out:
+    pthread_mutex_unlock(&packs->lock);
+    return ret;
+}
+
+// Appends a blob to the current pack unless some pack already has it.
+static int packs_store(struct DEDUPE_PACKS *packs, const unsigned char *digest, const void *buf, int len) {
+    if (packs_find_indexed(packs, digest) != NULL)
+        return 0;
+    return packs_append(packs, digest, buf, len);
+}
+
+static void packs_close(struct DEDUPE_PACKS *packs) {
+    int i;
+    packs_finish(packs);
+    for (i = 0; i < packs->count; i++)
+        close(packs->fds[i]);
+    free(packs->ids);
+    free(packs->fds);
+    free(packs->entries);
+    free(packs->new_entries);
+    free(packs->new_table);
+    pthread_mutex_destroy(&packs->lock);
+}
+
+// Reads a packed blob into buf, which must hold entry->length bytes.
+// Uses pread so several threads may read from the same pack.
+static int packs_read(struct DEDUPE_PACKS *packs, const struct DEDUPE_PACK_ENTRY *entry, void *buf) {
+    char *p = buf;
+    uint32_t done = 0;
+    while (done < entry->length) {
+        ssize_t bytes_read = pread(packs->fds[entry->pack], p + done, entry->length - done, entry->offset + done);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            return 3;
+        done += bytes_read;
+    }
+    return 0;
+}
+
+// don't copy the file if it exists? not quite sure how I feel about this.
+static void compressed_blob_path(const char *blob_dir, const char *key, char *path) {
+    snprintf(path, PATH_MAX, "%s/%s" DEDUPE_COMPRESSED_SUFFIX, blob_dir, key);
+}
+
+// Reads the uncompressed size from the header of a compressed blob.
+static int read_compressed_header(int fd, uint64_t *size) {
+    unsigned char header[DEDUPE_COMPRESSED_HEADER_SIZE];
+    if (read_fully(fd, header, sizeof(header)) != sizeof(header) ||
+            memcmp(header, DEDUPE_COMPRESSED_MAGIC, 8) != 0)
+        return 1;
+    *size = get_le64(header + 8);
+    return 0;
+}
+
+// Deflates a sample from the middle of the buffer, where headers are
+// least likely to skew the result, and only asks for compression if it
+// shrinks by at least an eighth. This keeps APKs, images and other
+// already compressed content from being deflated for nothing.
+static int should_compress(struct DEDUPE_STORE_CONTEXT *context, const void *buf, int len) {
+    unsigned char sample[DEDUPE_COMPRESS_SAMPLE_SIZE];
+    if (context->compress_level == 0)
+        return 0;
+    int sample_len = len < DEDUPE_COMPRESS_SAMPLE_SIZE ? len : DEDUPE_COMPRESS_SAMPLE_SIZE;
+    const unsigned char *start = (const unsigned char*)buf + (len - sample_len) / 2;
+    // anything that does not fit in seven eighths of the sample fails
+    uLongf out_len = sample_len - sample_len / 8;
+    if (compress2(sample, &out_len, start, sample_len, context->compress_level) != Z_OK)
+        return 0;
+    return context->compress_level;
+}
+
+static void blob_writer_init(struct DEDUPE_BLOB_WRITER *writer) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+}
+
+// Opens a tmp blob for writing. A non-zero level deflates everything
+// written, behind a header that is filled in on close.
+static int blob_writer_open(struct DEDUPE_BLOB_WRITER *writer, const char *path, int level) {
+    writer->level = level;
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    // tmp names carry the pid, so one that is already there was left
+    // behind by a dead process that had the same
+    if (writer->fd < 0 && errno == EEXIST && unlink(path) == 0)
+        writer->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (writer->fd < 0)
+        return 4;
+    if (level == 0)
+        return 0;
+
+    if ((writer->out = malloc(DEDUPE_COMPRESS_BUFFER_SIZE)) == NULL)
+        return ENOMEM;
+    if (deflateInit(&writer->stream, level) != Z_OK)
+        return ENOMEM;
+    writer->stream_ready = 1;
+    unsigned char header[DEDUPE_COMPRESSED_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    return write_fully(writer->fd, header, sizeof(header)) ? 5 : 0;
+}
+
+static int blob_writer_deflate(struct DEDUPE_BLOB_WRITER *writer, int flush) {
+    int status;
+    do {
+        writer->stream.next_out = writer->out;
+        writer->stream.avail_out = DEDUPE_COMPRESS_BUFFER_SIZE;
+        status = deflate(&writer->stream, flush);
+        if (status == Z_STREAM_ERROR)
+            return 5;
+        if (write_fully(writer->fd, writer->out, DEDUPE_COMPRESS_BUFFER_SIZE - writer->stream.avail_out))
+            return 5;
+    } while (writer->stream.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    return 0;
+}
+
+static int blob_writer_write(struct DEDUPE_BLOB_WRITER *writer, const void *buf, int len) {
+    if (writer->level == 0)
+        return write_fully(writer->fd, buf, len) ? 5 : 0;
+    writer->stream.next_in = (Bytef*)buf;
+    writer->stream.avail_in = len;
+    return blob_writer_deflate(writer, Z_NO_FLUSH);
+}
+
+// Finishes the blob and closes it. size is the uncompressed size.
+static int blob_writer_close(struct DEDUPE_BLOB_WRITER *writer, uint64_t size) {
+    int ret = 0;
+    if (writer->level != 0) {
+        unsigned char header[DEDUPE_COMPRESSED_HEADER_SIZE];
+        memcpy(header, DEDUPE_COMPRESSED_MAGIC, 8);
+        put_le64(header + 8, size);
+        writer->stream.next_in = NULL;
+        writer->stream.avail_in = 0;
+        if ((ret = blob_writer_deflate(writer, Z_FINISH)) == 0 &&
+                pwrite(writer->fd, header, sizeof(header), 0) != sizeof(header))
+            ret = 5;
+    }
+    if (close(writer->fd) && !ret)
+        ret = 5;
+    writer->fd = -1;
+    return ret;
+}
+
+static void blob_writer_free(struct DEDUPE_BLOB_WRITER *writer) {
+    if (writer->fd >= 0)
+        close(writer->fd);
+    if (writer->stream_ready)
+        deflateEnd(&writer->stream);
+    free(writer->out);
+    blob_writer_init(writer);
+}
+
+static int blob_exists(struct DEDUPE_STORE_CONTEXT *context, const char *key, int size) {
+    char out_blob[PATH_MAX];
+    struct stat file_info;
+    snprintf(out_blob, sizeof(out_blob), "%s/%s", context->blob_dir, key);
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    if (key_to_digest(key, digest) == 0 && packs_contain(&context->packs, digest))
+        return 1;
+    // verify the file exists and is of the same size, if one is given
+    if (stat(out_blob, &file_info) == 0)
+        return size < 0 || (int)file_info.st_size == size;
+
+    compressed_blob_path(context->blob_dir, key, out_blob);
+    int fd = open(out_blob, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    uint64_t blob_size;
+    int ret = read_compressed_header(fd, &blob_size) == 0 && (size < 0 || blob_size == (uint64_t)size);
+    close(fd);
+    return ret;
+}
+
+// Moves a fully written tmp blob to its final name, or drops it if an
+// identical blob is already in the store.
+static int publish_blob(struct DEDUPE_STORE_CONTEXT *context, const char *tmp_out_blob, const char *key, int size, int compressed) {
+    char out_dir[PATH_MAX];
+    char out_blob[PATH_MAX];
+    if (blob_exists(context, key, size)) {
+        unlink(tmp_out_blob);
+        return 0;
+    }
+    snprintf(out_dir, sizeof(out_dir), "%s/%.3s", context->blob_dir, key);
+    if (compressed)
+        compressed_blob_path(context->blob_dir, key, out_blob);
+    else
+        snprintf(out_blob, sizeof(out_blob), "%s/%s", context->blob_dir, key);
+    mkdir(out_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (rename(tmp_out_blob, out_blob)) {
+        unlink(tmp_out_blob);
+        return errno;
+    }
+    return 0;
+}
+
+// Stores an in-memory blob under its key, unless it is already there.
+static int store_buffer(struct DEDUPE_STORE_CONTEXT *context, const char *tmp_out_blob, const void *buf, int len, char *key) {
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    SHA256_CTX c;
+    SHA256_Init(&c);
+    SHA256_Update(&c, buf, len);
+    SHA256_Final(sumdata, &c);
+    sha256_to_key(sumdata, key);
+    if (len < DEDUPE_PACK_MAX_BLOB)
+        return packs_store(&context->packs, sumdata, buf, len);
+    if (blob_exists(context, key, len))
+        return 0;
+
+    struct DEDUPE_BLOB_WRITER writer;
+    int ret;
+    blob_writer_init(&writer);
+    if ((ret = blob_writer_open(&writer, tmp_out_blob, should_compress(context, buf, len))) == 0 &&
+            (ret = blob_writer_write(&writer, buf, len)) == 0)
+        ret = blob_writer_close(&writer, len);
+    int compressed = writer.level != 0;
+    blob_writer_free(&writer);
+    if (ret) {
+        unlink(tmp_out_blob);
+        return ret;
+    }
+    return publish_blob(context, tmp_out_blob, key, len, compressed);
+}
+
+static unsigned int chunk_gear[256];
+
+// The gear table only has to be random looking and the same on every
+// run, so it is generated instead of spelled out.
+static void chunk_init_gear() {
+    unsigned int seed = 0x2545f491;
+    int i;
+    for (i = 0; i < 256; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        chunk_gear[i] = seed;
+    }
+}
+
+// Returns the length of the next content-defined chunk in buf. Each byte
+// shifts one bit out of the gear hash, so a boundary only depends on the
+// last 32 bytes and an edit only moves the boundaries next to it.
+static int find_chunk_boundary(const unsigned char *buf, int len) {
+    unsigned int hash = 0;
+    int i;
+    if (len <= DEDUPE_CHUNK_MIN_SIZE)
+        return len;
+    if (len > DEDUPE_CHUNK_MAX_SIZE)
+        len = DEDUPE_CHUNK_MAX_SIZE;
+    for (i = DEDUPE_CHUNK_MIN_SIZE; i < len; i++) {
+        hash = (hash << 1) + chunk_gear[buf[i]];
+        if (!(hash & DEDUPE_CHUNK_MASK))
+            return i + 1;
+    }
+    return len;
+}
+
+static int use_chunks(const struct stat *st) {
+    return st->st_size >= DEDUPE_CHUNK_FILE_SIZE;
+}
+
+// Splits a large file into chunks, each stored as its own blob. The file's
+// key is that of a chunk list blob holding a "key\tsize\n" line per chunk.
+static int store_chunks(struct DEDUPE_STORE_CONTEXT *context, struct DEDUPE_STORE_JOB *job, int srcfd, const char *tmp_out_blob, char *buf) {
+    char *list = NULL;
+    int list_len = 0;
+    int list_capacity = 0;
+    int fill = 0;
+    int eof = 0;
+    int ret = 0;
+
+    for (;;) {
+        if (!eof) {
+            int bytes_read = read_fully(srcfd, buf + fill, DEDUPE_BUFFER_SIZE - fill);
+            if (bytes_read < 0) {
+                ret = 2;
+                break;
+            }
+            fill += bytes_read;
+            eof = fill < DEDUPE_BUFFER_SIZE;
+        }
+        if (fill == 0)
+            break;
+
+        int len = find_chunk_boundary((unsigned char*)buf, fill);
+        char key[SHA256_DIGEST_LENGTH * 2 + 2];
+        if (ret = store_buffer(context, tmp_out_blob, buf, len, key))
+            break;
+
+        if (list_len + (int)sizeof(key) + 16 > list_capacity) {
+            list_capacity = list_capacity ? list_capacity * 2 : 4096;
+            char *grown = realloc(list, list_capacity);
+            if (grown == NULL) {
+                ret = ENOMEM;
+                break;
+            }
+            list = grown;
+        }
+        list_len += sprintf(list + list_len, "%s\t%d\n", key, len);
+
+        fill -= len;
+        memmove(buf, buf + len, fill);
+    }
+
+    if (!ret)
+        ret = store_buffer(context, tmp_out_blob, list == NULL ? "" : list, list_len, job->key);
+    free(list);
+    return ret;
+}
+
+// Runs on a worker thread. Only touches the job itself and the blob
+// store, which is safe to share since blobs are published by rename.
+// Each file is read exactly once: small files are hashed from memory and
+// only written out if new, larger ones are hashed while being copied to a
+// tmp blob that is kept or dropped once the key is known.
+static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct DEDUPE_STORE_JOB *job, int worker, char *buf) {
+    const char *f = job->path;
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    SHA256_CTX c;
+    struct DEDUPE_BLOB_WRITER writer;
+    int ret = 0;
+    int srcfd;
+    int bytes_read;
+    int total_read = 0;
+
+    blob_writer_init(&writer);
+    srcfd = open(f, O_RDONLY);
+    if (srcfd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", f);
+        return 1;
+    }
+
+    // two workers, of this run or another one on the same store, may be
+    // storing identical content at once, so the tmp file must be private
+    // to the worker
+    char tmp_out_blob[PATH_MAX];
+    snprintf(tmp_out_blob, sizeof(tmp_out_blob), "%s/%d.%d.tmp", context->blob_dir, (int)getpid(), worker);
+
+    if (job->chunked) {
+        ret = store_chunks(context, job, srcfd, tmp_out_blob, buf);
+        goto out;
+    }
+
+    // a file that grew past the buffer since lstat is still noticed and
+    // streamed instead of truncated
+    if ((total_read = read_fully(srcfd, buf, DEDUPE_BUFFER_SIZE)) < 0) {
+        ret = 2;
+        goto out;
+    }
+    if (total_read < DEDUPE_BUFFER_SIZE) {
+        ret = store_buffer(context, tmp_out_blob, buf, total_read, job->key);
+        goto out;
+    }
+
+    // the first buffer stands in for the whole file when deciding
+    // whether it is worth compressing
+    SHA256_Init(&c);
+    if (ret = blob_writer_open(&writer, tmp_out_blob, should_compress(context, buf, total_read)))
+        goto out;
+    SHA256_Update(&c, buf, total_read);
+    if (ret = blob_writer_write(&writer, buf, total_read))
+        goto out;
+    while ((bytes_read = read_fully(srcfd, buf, DEDUPE_BUFFER_SIZE)) > 0) {
+        SHA256_Update(&c, buf, bytes_read);
+        if (ret = blob_writer_write(&writer, buf, bytes_read))
+            goto out;
+        total_read += bytes_read;
+    }
+    if (bytes_read < 0) {
+        ret = 2;
+        goto out;
+    }
+    SHA256_Final(sumdata, &c);
+    sha256_to_key(sumdata, job->key);
+
+    if (ret = blob_writer_close(&writer, total_read))
+        goto out;
+    ret = publish_blob(context, tmp_out_blob, job->key, total_read, writer.level != 0);
+
+out:
+    blob_writer_free(&writer);
+    close(srcfd);
+    if (ret) {
+        unlink(tmp_out_blob);
+        fprintf(stderr, "Error copying blob %s\n", f);
+    }
+    return ret;
+}
+
+static unsigned int stat_cache_hash(const char *path) {
+    unsigned int hash = 2166136261u;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void stat_cache_insert(struct DEDUPE_STAT_CACHE *cache, struct DEDUPE_STAT_ENTRY *entry) {
+    unsigned int bucket = stat_cache_hash(entry->path) % cache->bucket_count;
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+}
+
+// Reads the cache as it is now. Entries under the root are loaded, or
+// if merge is set, the others are copied to the output as they are.
+static void stat_cache_read(struct DEDUPE_STAT_CACHE *cache, int merge) {
+    FILE *input = fopen(cache->path, "rb");
+    if (input == NULL)
+        return;
+
+    char line[PATH_MAX * 2];
+    int version = 0;
+    if (fgets(line, sizeof(line), input) == NULL ||
+            sscanf(line, "dedupe-stat\t%d", &version) != 1 ||
+            version != DEDUPE_STAT_CACHE_VERSION) {
+        fclose(input);
+        return;
+    }
+
+    size_t root_len = strlen(cache->root);
+    while (fgets(line, sizeof(line), input)) {
+        struct DEDUPE_STAT_ENTRY entry;
+        int path_offset;
+        if (sscanf(line, "%65s\t%lld\t%lu\t%lu\t%lu\t%n", entry.key, &entry.size, &entry.mtime, &entry.ctime, &entry.ino, &path_offset) != 5)
+            continue;
+        char *path = line + path_offset;
+        size_t len = strlen(path);
+        if (len == 0 || path[len - 1] != '\n')
+            continue;
+        path[len - 1] = '\0';
+
+        int own = strncmp(path, cache->root, root_len) == 0 && path[root_len] == '/';
+        if (merge) {
+            if (!own) {
+                fputs(line, cache->output);
+                // fputs stopped at the path terminator
+                fputc('\n', cache->output);
+            }
+            continue;
+        }
+        if (!own)
+            continue;
+
+        struct DEDUPE_STAT_ENTRY *e = malloc(sizeof(*e));
+        if (e == NULL)
+            break;
+        *e = entry;
+        if ((e->path = strdup(path)) == NULL) {
+            free(e);
+            break;
+        }
+        stat_cache_insert(cache, e);
+    }
+    fclose(input);
+}
+
+// Loads the cache of a previous run and starts writing the new one.
+// Runs on other input directories may share the blob_dir, so their
+// entries are only merged in when this one is published.
+// A missing or unreadable cache only means everything gets hashed.
+static struct DEDUPE_STAT_CACHE* stat_cache_open(const char *blob_dir, const char *root) {
+    struct DEDUPE_STAT_CACHE *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+    cache->bucket_count = DEDUPE_STAT_CACHE_BUCKETS;
+    cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+    if (cache->buckets == NULL) {
+        free(cache);
+        return NULL;
+    }
+    strcpy(cache->root, root);
+    snprintf(cache->path, sizeof(cache->path), "%s/%s", blob_dir, DEDUPE_STAT_CACHE_FILE);
+    snprintf(cache->tmp_path, sizeof(cache->tmp_path), "%s.%d.tmp", cache->path, (int)getpid());
+    snprintf(cache->lock_path, sizeof(cache->lock_path), "%s/%s", blob_dir, DEDUPE_STAT_CACHE_LOCK_FILE);
+    cache->start_time = time(NULL);
+
+    cache->output = fopen(cache->tmp_path, "wb");
+    if (cache->output == NULL) {
+        fprintf(stderr, "Unable to write stat cache %s\n", cache->tmp_path);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+    fprintf(cache->output, "dedupe-stat\t%d\n", DEDUPE_STAT_CACHE_VERSION);
+    stat_cache_read(cache, 0);
+    return cache;
+}
+
+// Only called on worker threads once loading is done, so no locking.
+static const struct DEDUPE_STAT_ENTRY* stat_cache_lookup(struct DEDUPE_STAT_CACHE *cache, const char *path) {
+    const struct DEDUPE_STAT_ENTRY *e;
+    for (e = cache->buckets[stat_cache_hash(path) % cache->bucket_count]; e != NULL; e = e->next) {
+        if (strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+// Called by the writer for every stored file, in walk order.
+static void stat_cache_record(struct DEDUPE_STAT_CACHE *cache, struct DEDUPE_STORE_JOB *job) {
+    if ((time_t)job->mtime >= cache->start_time || (time_t)job->ctime >= cache->start_time)
+        return;
+    fprintf(cache->output, "%s\t%lld\t%lu\t%lu\t%lu\t%s/%s\n", job->key, (long long)job->size, job->mtime, job->ctime, job->ino, cache->root, job->path);
+}
+
+// Publishes the new cache if the backup succeeded, and frees everything.
+// The lock keeps another run from publishing between the merge and the
+// rename, which would lose its entries.
+static void stat_cache_close(struct DEDUPE_STAT_CACHE *cache, int success) {
+    int i;
+    int lock = -1;
+    if (success) {
+        lock = open(cache->lock_path, O_RDWR | O_CREAT, 0666);
+        if (lock < 0 || flock(lock, LOCK_EX)) {
+            fprintf(stderr, "Unable to lock stat cache %s\n", cache->lock_path);
+            success = 0;
+        }
+    }
+    if (success)
+        stat_cache_read(cache, 1);
+    if (fclose(cache->output))
+        success = 0;
+    if (!success || rename(cache->tmp_path, cache->path))
+        unlink(cache->tmp_path);
+    if (lock >= 0)
+        close(lock);
+    for (i = 0; i < cache->bucket_count; i++) {
+        struct DEDUPE_STAT_ENTRY *e = cache->buckets[i];
+        while (e != NULL) {
+            struct DEDUPE_STAT_ENTRY *next = e->next;
+            free(e->path);
+            free(e);
+            e = next;
+        }
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+// Fills in the job's key without reading the file if the stat cache says
+// it has not changed and its blob is still in the store.
+static int stat_cache_hit(struct DEDUPE_STORE_CONTEXT *context, struct DEDUPE_STORE_JOB *job) {
+    char path[PATH_MAX];
+    if (context->stat_cache == NULL)
+        return 0;
+    snprintf(path, sizeof(path), "%s/%s", context->stat_cache->root, job->path);
+    const struct DEDUPE_STAT_ENTRY *e = stat_cache_lookup(context->stat_cache, path);
+    if (e == NULL || e->size != job->size || e->mtime != job->mtime ||
+            e->ctime != job->ctime || e->ino != job->ino)
+        return 0;
+    // gc may have removed the blob since. the size of a chunk list
+    // blob is not the size of the file.
+    if (!blob_exists(context, e->key, job->chunked ? -1 : job->size))
+        return 0;
+    strcpy(job->key, e->key);
+    return 1;
+}
+
+static void* store_worker(void *cookie) {
+    struct DEDUPE_STORE_CONTEXT *context = cookie;
+    struct DEDUPE_STORE_JOB *job;
+
+    char *buf = malloc(DEDUPE_BUFFER_SIZE);
+
+    pthread_mutex_lock(&context->lock);
+    int worker = context->worker_count++;
+    for (;;) {
+        while (context->work_head == NULL && !context->walk_done)
+            pthread_cond_wait(&context->work_ready, &context->lock);
+        if ((job = context->work_head) == NULL)
+            break;
+        context->work_head = job->next_work;
+        if (context->work_head == NULL)
+            context->work_tail = NULL;
+
+        if (context->error) {
+            // don't bother with the rest once the backup is going to fail
+            job->ret = context->error;
+        }
+        else if (buf == NULL) {
+            job->ret = ENOMEM;
+        }
+        else {
+            pthread_mutex_unlock(&context->lock);
+            if (!stat_cache_hit(context, job))
+                job->ret = store_file(context, job, worker, buf);
+            pthread_mutex_lock(&context->lock);
+        }
+        job->done = 1;
+        pthread_cond_broadcast(&context->job_done);
+    }
+    pthread_mutex_unlock(&context->lock);
+    free(buf);
+    return NULL;
+}
+
+// Adds a NUL terminated string to the string table and returns its offset.
+static int binary_add_string(struct DEDUPE_BINARY_WRITER *writer, const char *s, uint32_t *offset) {
+    size_t len = strlen(s) + 1;
+    if (writer->strings_size + len > writer->strings_capacity) {
+        uint32_t capacity = writer->strings_capacity ? writer->strings_capacity : 65536;
+        while (writer->strings_size + len > capacity)
+            capacity *= 2;
+        char *strings = realloc(writer->strings, capacity);
+        if (strings == NULL)
+            return ENOMEM;
+        writer->strings = strings;
+        writer->strings_capacity = capacity;
+    }
+    memcpy(writer->strings + writer->strings_size, s, len);
+    *offset = writer->strings_size;
+    writer->strings_size += len;
+    return 0;
+}
+
+static struct DEDUPE_BINARY_WRITER* binary_open(FILE *output) {
+    struct DEDUPE_BINARY_WRITER *writer = calloc(1, sizeof(*writer));
+    if (writer == NULL)
+        return NULL;
+    writer->output = output;
+    // the header is rewritten with the real offsets once everything is in
+    unsigned char header[DEDUPE_BINARY_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    if (fwrite(header, sizeof(header), 1, output) != 1) {
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+static int binary_write_entry(struct DEDUPE_BINARY_WRITER *writer, const struct DEDUPE_STORE_JOB *job) {
+    unsigned char record[DEDUPE_BINARY_RECORD_SIZE];
+    uint32_t path;
+    uint32_t target = DEDUPE_BINARY_NO_STRING;
+    int ret;
+
+    if (writer->count == writer->capacity) {
+        uint32_t capacity = writer->capacity ? writer->capacity * 2 : 4096;
+        uint32_t *paths = realloc(writer->paths, capacity * sizeof(*paths));
+        if (paths == NULL)
+            return ENOMEM;
+        writer->paths = paths;
+        writer->capacity = capacity;
+    }
+    if (ret = binary_add_string(writer, job->path, &path))
+        return ret;
+    if (job->target != NULL && (ret = binary_add_string(writer, job->target, &target)))
+        return ret;
+
+    memset(record, 0, sizeof(record));
+    record[0] = job->type;
+    put_le32(record + 4, job->st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID));
+    put_le32(record + 8, job->st.st_uid);
+    put_le32(record + 12, job->st.st_gid);
+    put_le64(record + 16, job->st.st_atime);
+    put_le64(record + 24, job->st.st_mtime);
+    put_le64(record + 32, job->st.st_ctime);
+    put_le32(record + 48, path);
+    put_le32(record + 52, target);
+    if (job->is_file) {
+        put_le64(record + 40, job->size);
+        if (key_to_digest(job->key, record + 56))
+            return 1;
+    }
+    if (fwrite(record, sizeof(record), 1, writer->output) != 1)
+        return 5;
+    writer->paths[writer->count++] = path;
+    return 0;
+}
+
+struct DEDUPE_BINARY_INDEX_ENTRY {
+    const char *path;
+    uint32_t record;
+};
+
+static int binary_index_compare(const void *a, const void *b) {
+    return strcmp(((const struct DEDUPE_BINARY_INDEX_ENTRY*)a)->path,
+            ((const struct DEDUPE_BINARY_INDEX_ENTRY*)b)->path);
+}
+
+// Writes the string table and the path index after the records, then
+// fills in the header. Frees the writer but leaves the file open.
+static int binary_finish(struct DEDUPE_BINARY_WRITER *writer) {
+    int ret = 0;
+    uint32_t i;
+    uint32_t empty;
+    // an empty table still needs a terminator to be valid
+    if (writer->strings_size == 0 && (ret = binary_add_string(writer, "", &empty)))
+        goto out;
+
+    uint64_t strings_offset = DEDUPE_BINARY_HEADER_SIZE + (uint64_t)writer->count * DEDUPE_BINARY_RECORD_SIZE;
+    uint64_t index_offset = strings_offset + writer->strings_size;
+    if (fwrite(writer->strings, writer->strings_size, 1, writer->output) != 1) {
+        ret = 5;
+        goto out;
+    }
+
+    struct DEDUPE_BINARY_INDEX_ENTRY *index = malloc((writer->count + 1) * sizeof(*index));
+    if (index == NULL) {
+        ret = ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < writer->count; i++) {
+        index[i].path = writer->strings + writer->paths[i];
+        index[i].record = i;
+    }
+    qsort(index, writer->count, sizeof(*index), binary_index_compare);
+    for (i = 0; i < writer->count && !ret; i++) {
+        unsigned char record[4];
+        put_le32(record, index[i].record);
+        if (fwrite(record, sizeof(record), 1, writer->output) != 1)
+            ret = 5;
+    }
+    free(index);
+    if (ret)
+        goto out;
+
+    unsigned char header[DEDUPE_BINARY_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, DEDUPE_BINARY_MAGIC, 8);
+    put_le32(header + 8, DEDUPE_VERSION);
+    put_le32(header + 12, writer->count);
+    put_le64(header + 16, strings_offset);
+    put_le32(header + 24, writer->strings_size);
+    put_le64(header + 32, index_offset);
+    if (fseek(writer->output, 0, SEEK_SET) ||
+            fwrite(header, sizeof(header), 1, writer->output) != 1)
+        ret = 5;
+
+out:
+    free(writer->strings);
+    free(writer->paths);
+    free(writer);
+    return ret;
+}
+
+static void print_stat(FILE *output, char type, const struct stat *st, const char *f, const char *extra) {
+    fprintf(output, "%c\t%o\t%d\t%d\t%lu\t%lu\t%lu\t%s\t%s", type, st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st->st_uid, st->st_gid, st->st_atime, st->st_mtime, st->st_ctime, f, extra);
+}
+
+static int write_entry(struct DEDUPE_STORE_CONTEXT *context, const struct DEDUPE_STORE_JOB *job) {
+    char extra[PATH_MAX + 128];
+    if (context->binary != NULL)
+        return binary_write_entry(context->binary, job);
+
+    if (job->is_file)
+        snprintf(extra, sizeof(extra), "%s\t%d\t\n", job->key, job->size);
+    else if (job->target != NULL)
+        snprintf(extra, sizeof(extra), "%s\t\n", job->target);
+    else
+        strcpy(extra, "\n");
+    print_stat(context->output_manifest, job->type, &job->st, job->path, extra);
+    return 0;
+}
+
+static void* store_writer(void *cookie) {
+    struct DEDUPE_STORE_CONTEXT *context = cookie;
+    struct DEDUPE_STORE_JOB *job;
+
+    pthread_mutex_lock(&context->lock);
+    for (;;) {
+        while ((context->head == NULL && !context->walk_done) ||
+                (context->head != NULL && !context->head->done))
+            pthread_cond_wait(&context->job_done, &context->lock);
+        if ((job = context->head) == NULL)
+            break;
+        context->head = job->next;
+        if (context->head == NULL)
+            context->tail = NULL;
+        context->queued--;
+        pthread_cond_signal(&context->queue_space);
+        if (job->ret && !context->error) {
+            fprintf(stderr, "Error storing: %s\n", job->path);
+            context->error = job->ret;
+        }
+        int error = context->error;
+        pthread_mutex_unlock(&context->lock);
+
+        if (!error) {
+            printf("%s\n", job->path);
+            if (error = write_entry(context, job)) {
+                fprintf(stderr, "Error writing manifest entry: %s\n", job->path);
+                pthread_mutex_lock(&context->lock);
+                if (!context->error)
+                    context->error = error;
+                pthread_cond_broadcast(&context->queue_space);
+                pthread_mutex_unlock(&context->lock);
+            }
+            else if (job->is_file && context->stat_cache != NULL)
+                stat_cache_record(context->stat_cache, job);
+        }
+        free(job->path);
+        free(job->target);
+        free(job);
+
+        pthread_mutex_lock(&context->lock);
+    }
+    pthread_mutex_unlock(&context->lock);
+    return NULL;
+}
+
+// Called by the walker. Hands the entry to the writer, and to the
+// workers if it is a file. Blocks while too many entries are in flight.
+// target is only given for links.
+static int queue_entry(struct DEDUPE_STORE_CONTEXT *context, char type, const char *path, const struct stat *st, const char *target) {
+    struct DEDUPE_STORE_JOB *job = calloc(1, sizeof(*job));
+    if (job == NULL || (job->path = strdup(path)) == NULL ||
+            (target != NULL && (job->target = strdup(target)) == NULL)) {
+        if (job != NULL)
+            free(job->path);
+        free(job);
+        return ENOMEM;
+    }
+    int is_file = type == 'f' || type == 'c';
+    job->type = type;
+    job->st = *st;
+    job->is_file = is_file;
+    if (is_file) {
+        job->size = (int)st->st_size;
+        job->chunked = type == 'c';
+        job->mtime = st->st_mtime;
+        job->ctime = st->st_ctime;
+        job->ino = st->st_ino;
+    }
+    job->done = !is_file;
+
+    pthread_mutex_lock(&context->lock);
+    while (context->queued >= context->max_queued && !context->error)
+        pthread_cond_wait(&context->queue_space, &context->lock);
+    int error = context->error;
+    if (error) {
+        pthread_mutex_unlock(&context->lock);
+        free(job->path);
+        free(job->target);
+        free(job);
+        return error;
+    }
+    if (context->tail != NULL)
+        context->tail->next = job;
+    else
+        context->head = job;
+    context->tail = job;
+    context->queued++;
+    if (is_file) {
+        if (context->work_tail != NULL)
+            context->work_tail->next_work = job;
+        else
+            context->work_head = job;
+        context->work_tail = job;
+        pthread_cond_signal(&context->work_ready);
+    }
+    else {
+        pthread_cond_signal(&context->job_done);
+    }
+    pthread_mutex_unlock(&context->lock);
+    return 0;
+}
+
+static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
+    char full_path[PATH_MAX];
+    DIR *dp = opendir(d);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", d);
+        return 1;
+    }
+    struct dirent *ep;
+    while (ep = readdir(dp)) {
+        if (strcmp(ep->d_name, ".") == 0)
+            continue;
+        if (strcmp(ep->d_name, "..") == 0)
+            continue;
+        struct stat cst;
+        int ret;
+        sprintf(full_path, "%s/%s", d, ep->d_name);
+        int i;
+        for (i = 0; i < context->exclude_count; i++) {
+            if (!strcmp(context->excludes[i], full_path))
+                break;
+        }
+        if (i != context->exclude_count)
+            continue;
+        if (0 != (ret = lstat(full_path, &cst))) {
+            fprintf(stderr, "Error opening: %s\n", full_path);
+            closedir(dp);
+            return ret;
+        }
+
+        if (ret = store_st(context, cst, full_path)) {
+            fprintf(stderr, "Error storing: %s\n", full_path);
+            closedir(dp);
+            return ret;
+        }
+    }
+    closedir(dp);
+    return 0;
+}
+
+static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
+    char link[PATH_MAX];
+    int ret = readlink(l, link, PATH_MAX - 1);
+    if (ret < 0) {
+        fprintf(stderr, "Error reading symlink\n");
+        return errno;
+    }
+    link[ret] = '\0';
+    return queue_entry(context, 'l', l, &st, link);
+}
+
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
+    int ret;
+    if (S_ISREG(st.st_mode)) {
+        return queue_entry(context, use_chunks(&st) ? 'c' : 'f', s, &st, NULL);
+    }
+    else if (S_ISDIR(st.st_mode)) {
+        if (ret = queue_entry(context, 'd', s, &st, NULL))
+            return ret;
+        return store_dir(context, st, s);
+    }
+    else if (S_ISLNK(st.st_mode)) {
+        return store_link(context, st, s);
+    }
+    else {
+        fprintf(stderr, "Skipping special: %s\n", s);
+        return 0;
+    }
+}
+
+static int store_tree(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > DEDUPE_MAX_THREADS)
+        thread_count = DEDUPE_MAX_THREADS;
+
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->work_ready, NULL);
+    pthread_cond_init(&context->job_done, NULL);
+    pthread_cond_init(&context->queue_space, NULL);
+    context->head = context->tail = NULL;
+    context->work_head = context->work_tail = NULL;
+    context->queued = 0;
+    context->worker_count = 0;
+    context->max_queued = thread_count * DEDUPE_JOBS_PER_THREAD;
+    context->walk_done = 0;
+    context->error = 0;
+
+    pthread_t writer;
+    pthread_t workers[DEDUPE_MAX_THREADS];
+    int i;
+    if (pthread_create(&writer, NULL, store_writer, context)) {
+        fprintf(stderr, "Unable to start writer thread\n");
+        return 1;
+    }
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i], NULL, store_worker, context))
+            break;
+    }
+    // we can still make progress as long as one worker started
+    if (i == 0)
+        context->error = 1;
+    thread_count = i;
+
+    // the root directory is never written to the manifest
+    printf("%s\n", d);
+    int ret = context->error ? context->error : store_dir(context, st, d);
+
+    pthread_mutex_lock(&context->lock);
+    context->walk_done = 1;
+    if (ret && !context->error)
+        context->error = ret;
+    pthread_cond_broadcast(&context->work_ready);
+    pthread_cond_broadcast(&context->job_done);
+    pthread_mutex_unlock(&context->lock);
+
+    for (i = 0; i < thread_count; i++)
+        pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+
+    return context->error;
+}
+
+static const char* tokenize(char *out, size_t size, const char* line, const char sep) {
+    while (*line != sep) {
+        if (*line == '\0' || size-- <= 1) {
+            return NULL;
+        }
+
+        *out = *line;
+        out++;
+        line++;
+    }
 
-#define DEDUPE_VERSION 2
-#define ARRAY_CAPACITY 1000
+    *out = '\0';
+    // resume at the next char
+    return ++line;
+}
 
-static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
-    if (src == NULL)
-        return 1;
-    if (dst == NULL)
-        return 2;
+static int dec_to_oct(int dec) {
+    int ret = 0;
+    int mult = 1;
+    while (dec != 0) {
+        int rem = dec % 10;
+        ret += (rem * mult);
+        dec /= 10;
+        mult *= 8;
+    }
+
+    return ret;
+}
+
+// Open addressing set of blob digests, used by gc to remember which
+// blobs are referenced. Digests are uniformly distributed already, so
+// their first bytes serve as the hash. The all-zero digest marks an
+// empty slot, and is tracked on the side.
+struct DIGEST_SET {
+    unsigned char *slots;
+    // always a power of two
+    size_t capacity;
+    size_t count;
+    int has_zero;
+};
+
+static const unsigned char zero_digest[SHA256_DIGEST_LENGTH];
+
+static int digest_set_init(struct DIGEST_SET *set, size_t capacity) {
+    set->slots = calloc(capacity, SHA256_DIGEST_LENGTH);
+    set->capacity = capacity;
+    set->count = 0;
+    set->has_zero = 0;
+    return set->slots == NULL ? ENOMEM : 0;
+}
+
+static void digest_set_free(struct DIGEST_SET *set) {
+    free(set->slots);
+    set->slots = NULL;
+}
+
+static unsigned char* digest_set_slot(struct DIGEST_SET *set, const unsigned char *digest) {
+    size_t slot = get_le32(digest) & (set->capacity - 1);
+    for (;;) {
+        unsigned char *p = set->slots + slot * SHA256_DIGEST_LENGTH;
+        if (memcmp(p, zero_digest, SHA256_DIGEST_LENGTH) == 0 ||
+                memcmp(p, digest, SHA256_DIGEST_LENGTH) == 0)
+            return p;
+        slot = (slot + 1) & (set->capacity - 1);
+    }
+}
+
+static int digest_set_contains(struct DIGEST_SET *set, const unsigned char *digest) {
+    if (memcmp(digest, zero_digest, SHA256_DIGEST_LENGTH) == 0)
+        return set->has_zero;
+    return memcmp(digest_set_slot(set, digest), digest, SHA256_DIGEST_LENGTH) == 0;
+}
+
+static int digest_set_add(struct DIGEST_SET *set, const unsigned char *digest) {
+    if (memcmp(digest, zero_digest, SHA256_DIGEST_LENGTH) == 0) {
+        set->has_zero = 1;
+        return 0;
+    }
+    if ((set->count + 1) * 2 > set->capacity) {
+        struct DIGEST_SET grown;
+        size_t i;
+        if (digest_set_init(&grown, set->capacity * 2))
+            return ENOMEM;
+        for (i = 0; i < set->capacity; i++) {
+            unsigned char *p = set->slots + i * SHA256_DIGEST_LENGTH;
+            if (memcmp(p, zero_digest, SHA256_DIGEST_LENGTH) != 0)
+                memcpy(digest_set_slot(&grown, p), p, SHA256_DIGEST_LENGTH);
+        }
+        grown.count = set->count;
+        grown.has_zero = set->has_zero;
+        free(set->slots);
+        *set = grown;
+    }
+    unsigned char *p = digest_set_slot(set, digest);
+    if (memcmp(p, digest, SHA256_DIGEST_LENGTH) != 0) {
+        memcpy(p, digest, SHA256_DIGEST_LENGTH);
+        set->count++;
+    }
+    return 0;
+}
+
+// Walks the loose blobs once, deleting every one that is not referenced,
+// or that is also packed and so redundant.
+static void gc_sweep_dir(const char *d, const char *blob_dir, struct DEDUPE_PACKS *packs, struct DIGEST_SET *used) {
+    DIR *dp = opendir(d);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", d);
+        return;
+    }
+    int top = strcmp(d, blob_dir) == 0;
+    struct dirent *ep;
+    while ((ep = readdir(dp))) {
+        if (strcmp(ep->d_name, ".") == 0)
+            continue;
+        if (strcmp(ep->d_name, "..") == 0)
+            continue;
+        // not a blob, and never referenced by a manifest
+        if (top && (strcmp(ep->d_name, DEDUPE_STAT_CACHE_FILE) == 0 || strcmp(ep->d_name, DEDUPE_STAT_CACHE_LOCK_FILE) == 0))
+            continue;
+        // packed blobs are collected separately
+        if (top && strcmp(ep->d_name, DEDUPE_PACK_DIR) == 0)
+            continue;
+        char blob[PATH_MAX];
+        snprintf(blob, sizeof(blob), "%s/%s", d, ep->d_name);
+
+        int is_dir;
+        if (ep->d_type != DT_UNKNOWN) {
+            is_dir = ep->d_type == DT_DIR;
+        }
+        else {
+            struct stat cst;
+            if (lstat(blob, &cst)) {
+                fprintf(stderr, "Error opening: %s\n", ep->d_name);
+                continue;
+            }
+            is_dir = S_ISDIR(cst.st_mode);
+        }
+
+        if (is_dir) {
+            gc_sweep_dir(blob, blob_dir, packs, used);
+            continue;
+        }
+
+        char key[PATH_MAX];
+        strcpy(key, blob + strlen(blob_dir) + 1);
+        size_t key_len = strlen(key);
+        size_t suffix_len = strlen(DEDUPE_COMPRESSED_SUFFIX);
+        if (key_len > suffix_len && strcmp(key + key_len - suffix_len, DEDUPE_COMPRESSED_SUFFIX) == 0)
+            key[key_len - suffix_len] = '\0';
+
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        if (key_to_digest(key, digest) == 0 &&
+                digest_set_contains(used, digest) &&
+                packs_find_indexed(packs, digest) == NULL)
+            continue;
+
+        if (remove(blob)) {
+            fprintf(stderr, "Error removing: %s\n", blob);
+        }
+        printf("Delete: %s\n", blob);
+    }
+    closedir(dp);
+}
+
+// Copies the rest of srcfd to dstfd. The kernel is asked to do the copy
+// first, which lets filesystems that can share extents reflink instead,
+// and falls back to a plain read/write loop through buf.
+static int copy_fd(int srcfd, int dstfd, char *buf) {
+    ssize_t copied;
+#ifdef __NR_copy_file_range
+    while ((copied = syscall(__NR_copy_file_range, srcfd, NULL, dstfd, NULL, DEDUPE_BUFFER_SIZE * 16, 0)) != 0) {
+        if (copied > 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+            break;
+        return 5;
+    }
+    if (copied == 0)
+        return 0;
+#endif
+    while ((copied = sendfile(dstfd, srcfd, NULL, DEDUPE_BUFFER_SIZE * 16)) != 0) {
+        if (copied > 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        if (errno == ENOSYS || errno == EINVAL)
+            break;
+        return 5;
+    }
+    if (copied == 0)
+        return 0;
+
+    // whatever was copied so far moved both offsets along
+    int bytes_read;
+    while ((bytes_read = read_fully(srcfd, buf, DEDUPE_BUFFER_SIZE)) > 0) {
+        if (write_fully(dstfd, buf, bytes_read))
+            return 5;
+    }
+    return bytes_read < 0 ? 3 : 0;
+}
+
+// Opens a loose blob, which may have been stored compressed.
+static int open_blob(const char *blob_dir, const char *key, int *compressed) {
+    char blob_file[PATH_MAX];
+    snprintf(blob_file, sizeof(blob_file), "%s/%s", blob_dir, key);
+    int fd = open(blob_file, O_RDONLY);
+    *compressed = fd < 0;
+    if (fd >= 0)
+        return fd;
+    compressed_blob_path(blob_dir, key, blob_file);
+    return open(blob_file, O_RDONLY);
+}
+
+// Inflates a compressed blob onto dstfd, using the two halves of buf
+// for input and output. dstfd may be -1 when the data is only hashed.
+static int inflate_blob(int srcfd, int dstfd, char *buf, SHA256_CTX *sha) {
+    const int half = DEDUPE_BUFFER_SIZE / 2;
+    uint64_t size;
+    uint64_t total = 0;
+    z_stream stream;
+    int status = Z_OK;
+    int ret = 0;
+
+    if (read_compressed_header(srcfd, &size))
+        return 3;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK)
+        return ENOMEM;
+    while (status != Z_STREAM_END) {
+        if (stream.avail_in == 0) {
+            int bytes_read = read_fully(srcfd, buf, half);
+            if (bytes_read <= 0) {
+                ret = 3;
+                break;
+            }
+            stream.next_in = (Bytef*)buf;
+            stream.avail_in = bytes_read;
+        }
+        stream.next_out = (Bytef*)buf + half;
+        stream.avail_out = half;
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) {
+            ret = 3;
+            break;
+        }
+        if (sha != NULL)
+            SHA256_Update(sha, buf + half, half - stream.avail_out);
+        if (dstfd >= 0 && write_fully(dstfd, buf + half, half - stream.avail_out)) {
+            ret = 5;
+            break;
+        }
+        total += half - stream.avail_out;
+    }
+    inflateEnd(&stream);
+    if (!ret && total != size)
+        ret = 3;
+    return ret;
+}
+
+// Appends the contents of a blob, packed or loose, to an open file.
+// buf must hold DEDUPE_BUFFER_SIZE bytes.
+static int append_blob(struct DEDUPE_PACKS *packs, const char *blob_dir, const char *key, int dstfd, char *buf) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    const struct DEDUPE_PACK_ENTRY *entry = NULL;
+    if (key_to_digest(key, digest) == 0)
+        entry = packs_find_indexed(packs, digest);
+    if (entry != NULL) {
+        // packed blobs are always smaller than the buffer
+        if (packs_read(packs, entry, buf))
+            return 3;
+        return write_fully(dstfd, buf, entry->length) ? 5 : 0;
+    }
 
-    srcfd = open(src, O_RDONLY);
+    int compressed;
+    int srcfd = open_blob(blob_dir, key, &compressed);
     if (srcfd < 0)
         return 3;
+    int ret = compressed ? inflate_blob(srcfd, dstfd, buf, NULL) : copy_fd(srcfd, dstfd, buf);
+    close(srcfd);
+    return ret;
+}
+
+static int read_compressed_blob(int fd, char **out, int *len) {
+    uint64_t size;
+    struct stat st;
+    if (read_compressed_header(fd, &size) || fstat(fd, &st) ||
+            size >= INT_MAX || st.st_size < DEDUPE_COMPRESSED_HEADER_SIZE)
+        return 3;
+    int in_len = st.st_size - DEDUPE_COMPRESSED_HEADER_SIZE;
+    char *in = malloc(in_len);
+    if (in == NULL || (*out = malloc(size + 1)) == NULL) {
+        free(in);
+        return ENOMEM;
+    }
+    uLongf out_len = size;
+    if (read_fully(fd, in, in_len) != in_len ||
+            uncompress((Bytef*)*out, &out_len, (Bytef*)in, in_len) != Z_OK ||
+            out_len != size) {
+        free(in);
+        free(*out);
+        return 3;
+    }
+    free(in);
+    *len = size;
+    (*out)[*len] = '\0';
+    return 0;
+}
+
+// Reads a whole blob, packed or loose, into a malloc'd buffer.
+static int read_blob(struct DEDUPE_PACKS *packs, const char *blob_dir, const char *key, char **out, int *len) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    const struct DEDUPE_PACK_ENTRY *entry = NULL;
+    if (key_to_digest(key, digest) == 0)
+        entry = packs_find_indexed(packs, digest);
+    if (entry != NULL) {
+        if ((*out = malloc(entry->length + 1)) == NULL)
+            return ENOMEM;
+        if (packs_read(packs, entry, *out)) {
+            free(*out);
+            return 3;
+        }
+        *len = entry->length;
+        (*out)[*len] = '\0';
+        return 0;
+    }
+
+    struct stat st;
+    int compressed;
+    int fd = open_blob(blob_dir, key, &compressed);
+    if (fd < 0)
+        return 3;
+    if (compressed) {
+        int ret = read_compressed_blob(fd, out, len);
+        close(fd);
+        return ret;
+    }
+    if (fstat(fd, &st) || (*out = malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return ENOMEM;
+    }
+    *len = read_fully(fd, *out, st.st_size);
+    close(fd);
+    if (*len != st.st_size) {
+        free(*out);
+        return 3;
+    }
+    (*out)[*len] = '\0';
+    return 0;
+}
+
+static int restore_blob(struct DEDUPE_PACKS *packs, const char *blob_dir, const char *key, const char *dst, char *buf) {
+    int dstfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0)
+        return 4;
+    int ret = append_blob(packs, blob_dir, key, dstfd, buf);
+    if (close(dstfd) && !ret)
+        ret = 5;
+    return ret;
+}
+
+// Rebuilds a chunked file from the chunks named in its chunk list blob.
+static int restore_chunks(struct DEDUPE_PACKS *packs, const char *blob_dir, const char *list_key, const char *dst, char *buf) {
+    char *list;
+    int list_len;
+    int ret;
+    if (ret = read_blob(packs, blob_dir, list_key, &list, &list_len))
+        return ret;
 
-    dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    int dstfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (dstfd < 0) {
-        close(srcfd);
+        free(list);
         return 4;
     }
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
+    char *line = list;
+    while (*line != '\0') {
+        char key[SHA256_DIGEST_LENGTH * 2 + 2];
+        int size;
+        if (sscanf(line, "%65s\t%d", key, &size) != 2) {
+            ret = 6;
+            break;
+        }
+        if (ret = append_blob(packs, blob_dir, key, dstfd, buf))
+            break;
+        if ((line = strchr(line, '\n')) == NULL)
+            break;
+        line++;
     }
 
-    close(dstfd);
-    close(srcfd);
+    if (close(dstfd) && !ret)
+        ret = 5;
+    free(list);
+    return ret;
+}
+
+// One entry of a manifest.
+struct DEDUPE_ENTRY {
+    char type;
+    int mode;
+    int uid;
+    int gid;
+    // only set for version 2 and later
+    int has_times;
+    long atime;
+    long mtime;
+    const char *filename;
+    // blob key of a file, or target of a link
+    const char *target;
+    // size of a file, or -1 if the manifest does not say
+    long long size;
+};
+
+// A manifest opened for reading. Text manifests are streamed a line at a
+// time, binary ones are mapped and walked in place.
+struct DEDUPE_MANIFEST {
+    const char *name;
+    int version;
+
+    FILE *file;
+    long entries_start;
+    char line[PATH_MAX * 2];
+    char filename[PATH_MAX];
+    char target[PATH_MAX];
+
+    // NULL for text manifests
+    const unsigned char *map;
+    size_t map_size;
+    uint32_t count;
+    const unsigned char *records;
+    const char *strings;
+    uint32_t strings_size;
+    const unsigned char *index;
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+
+    uint32_t next;
+    // a partial restore only visits entries at or below these paths
+    const char **paths;
+    int path_count;
+    // for binary manifests the matching records are found up front
+    // through the path index, and kept in manifest order
+    uint32_t *selected;
+    uint32_t selected_count;
+};
+
+static int parse_entry(struct DEDUPE_MANIFEST *manifest, struct DEDUPE_ENTRY *entry) {
+    char type[4];
+    char mode[8];
+    char uid[32];
+    char gid[32];
+    char at[32];
+    char mt[32];
+    char ct[32];
+
+    const char *token = manifest->line;
+    if (strlen(manifest->line) >= PATH_MAX * 2 - 1)
+        return 1;
+    if ((token = tokenize(type, sizeof(type), token, '\t')) == NULL ||
+            (token = tokenize(mode, sizeof(mode), token, '\t')) == NULL ||
+            (token = tokenize(uid, sizeof(uid), token, '\t')) == NULL ||
+            (token = tokenize(gid, sizeof(gid), token, '\t')) == NULL)
+        return 1;
+    entry->has_times = manifest->version >= 2;
+    if (entry->has_times) {
+        if ((token = tokenize(at, sizeof(at), token, '\t')) == NULL ||
+                (token = tokenize(mt, sizeof(mt), token, '\t')) == NULL ||
+                (token = tokenize(ct, sizeof(ct), token, '\t')) == NULL)
+            return 1;
+        entry->atime = atol(at);
+        entry->mtime = atol(mt);
+    }
+    if ((token = tokenize(manifest->filename, sizeof(manifest->filename), token, '\t')) == NULL)
+        return 1;
 
+    entry->type = type[0];
+    entry->mode = dec_to_oct(atoi(mode));
+    entry->uid = atoi(uid);
+    entry->gid = atoi(gid);
+    entry->filename = manifest->filename;
+    entry->target = manifest->target;
+    entry->size = -1;
+    manifest->target[0] = '\0';
+    if (entry->type != 'd' && (token = tokenize(manifest->target, sizeof(manifest->target), token, '\t')) == NULL)
+        return 1;
+    if ((entry->type == 'f' || entry->type == 'c') && *token >= '0' && *token <= '9')
+        entry->size = atoll(token);
     return 0;
 }
 
-typedef struct DEDUPE_STORE_CONTEXT {
+static const char* binary_string(struct DEDUPE_MANIFEST *manifest, uint32_t offset) {
+    if (offset >= manifest->strings_size)
+        return NULL;
+    return manifest->strings + offset;
+}
+
+static const char* binary_index_path(struct DEDUPE_MANIFEST *manifest, uint32_t i) {
+    uint32_t record = get_le32(manifest->index + i * 4);
+    if (record >= manifest->count)
+        return NULL;
+    return binary_string(manifest, get_le32(manifest->records + (size_t)record * DEDUPE_BINARY_RECORD_SIZE + 48));
+}
+
+static int binary_entry(struct DEDUPE_MANIFEST *manifest, uint32_t i, struct DEDUPE_ENTRY *entry) {
+    const unsigned char *record = manifest->records + (size_t)i * DEDUPE_BINARY_RECORD_SIZE;
+    entry->type = record[0];
+    entry->mode = get_le32(record + 4);
+    entry->uid = get_le32(record + 8);
+    entry->gid = get_le32(record + 12);
+    entry->has_times = 1;
+    entry->atime = get_le64(record + 16);
+    entry->mtime = get_le64(record + 24);
+    if ((entry->filename = binary_string(manifest, get_le32(record + 48))) == NULL)
+        return 1;
+    entry->target = "";
+    entry->size = -1;
+    if (entry->type == 'l') {
+        if ((entry->target = binary_string(manifest, get_le32(record + 52))) == NULL)
+            return 1;
+    }
+    else if (entry->type == 'f' || entry->type == 'c') {
+        sha256_to_key(record + 56, manifest->key);
+        entry->target = manifest->key;
+        entry->size = get_le64(record + 40);
+    }
+    return 0;
+}
+
+static int binary_open_manifest(struct DEDUPE_MANIFEST *manifest, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < DEDUPE_BINARY_HEADER_SIZE)
+        return 1;
+    manifest->map_size = st.st_size;
+    void *map = mmap(NULL, manifest->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return 1;
+    manifest->map = map;
+
+    const unsigned char *header = manifest->map;
+    manifest->version = get_le32(header + 8);
+    manifest->count = get_le32(header + 12);
+    uint64_t strings_offset = get_le64(header + 16);
+    manifest->strings_size = get_le32(header + 24);
+    uint64_t index_offset = get_le64(header + 32);
+    uint64_t records_end = DEDUPE_BINARY_HEADER_SIZE + (uint64_t)manifest->count * DEDUPE_BINARY_RECORD_SIZE;
+    if (records_end > strings_offset ||
+            manifest->strings_size == 0 ||
+            strings_offset + manifest->strings_size > index_offset ||
+            index_offset + (uint64_t)manifest->count * 4 > manifest->map_size)
+        return 1;
+    manifest->records = manifest->map + DEDUPE_BINARY_HEADER_SIZE;
+    manifest->strings = (const char*)manifest->map + strings_offset;
+    manifest->index = manifest->map + index_offset;
+    // every string ends before the end of the table
+    if (manifest->strings[manifest->strings_size - 1] != '\0')
+        return 1;
+    return 0;
+}
+
+static void manifest_close(struct DEDUPE_MANIFEST *manifest) {
+    if (manifest->file != NULL)
+        fclose(manifest->file);
+    if (manifest->map != NULL)
+        munmap((void*)manifest->map, manifest->map_size);
+    free(manifest->selected);
+}
+
+// Opens a text or binary manifest and checks its version. what names
+// the operation for the error message.
+static int manifest_open(struct DEDUPE_MANIFEST *manifest, const char *name, const char *what) {
+    memset(manifest, 0, sizeof(*manifest));
+    manifest->name = name;
+    manifest->file = fopen(name, "rb");
+    if (manifest->file == NULL) {
+        fprintf(stderr, "Unable to open input manifest %s\n", name);
+        return 1;
+    }
+
+    char magic[8];
+    if (fread(magic, sizeof(magic), 1, manifest->file) == 1 &&
+            memcmp(magic, DEDUPE_BINARY_MAGIC, sizeof(magic)) == 0) {
+        int ret = binary_open_manifest(manifest, fileno(manifest->file));
+        fclose(manifest->file);
+        manifest->file = NULL;
+        if (ret) {
+            fprintf(stderr, "Invalid manifest %s\n", name);
+            manifest_close(manifest);
+            return 1;
+        }
+    }
+    else {
+        fseek(manifest->file, 0, SEEK_SET);
+        manifest->version = 1;
+        if (fgets(manifest->line, sizeof(manifest->line), manifest->file) == NULL ||
+                sscanf(manifest->line, "dedupe\t%d", &manifest->version) != 1) {
+            fseek(manifest->file, 0, SEEK_SET);
+        }
+        manifest->entries_start = ftell(manifest->file);
+    }
+
+    if (manifest->version > DEDUPE_VERSION) {
+        fprintf(stderr, "Attempting to %s newer dedupe file: %s\n", what, name);
+        manifest_close(manifest);
+        return 1;
+    }
+    return 0;
+}
+
+// Whether path is want, or somewhere below it.
+static int path_matches(const char *path, const char *want) {
+    size_t len = strlen(want);
+    return strncmp(path, want, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Finds the first position in the path index that does not sort before path.
+static uint32_t binary_lower_bound(struct DEDUPE_MANIFEST *manifest, const char *path) {
+    uint32_t low = 0;
+    uint32_t high = manifest->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const char *p = binary_index_path(manifest, mid);
+        if (p != NULL && strcmp(p, path) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static int record_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Adds the records for want and everything below it. Those form two runs
+// in the path index: want itself, and the paths starting with "want/".
+static int binary_select(struct DEDUPE_MANIFEST *manifest, const char *want) {
+    char prefix[PATH_MAX + 1];
+    snprintf(prefix, sizeof(prefix), "%s/", want);
+    uint32_t i = binary_lower_bound(manifest, want);
+    uint32_t start = binary_lower_bound(manifest, prefix);
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        const char *p;
+        for (; i < manifest->count && (p = binary_index_path(manifest, i)) != NULL; i++) {
+            if (pass == 0 ? strcmp(p, want) != 0 : strncmp(p, prefix, strlen(prefix)) != 0)
+                break;
+            if ((manifest->selected_count & 1023) == 0) {
+                uint32_t *selected = realloc(manifest->selected, (manifest->selected_count + 1024) * sizeof(*selected));
+                if (selected == NULL)
+                    return ENOMEM;
+                manifest->selected = selected;
+            }
+            manifest->selected[manifest->selected_count++] = get_le32(manifest->index + i * 4);
+        }
+        i = start;
+    }
+    return 0;
+}
+
+// Limits iteration to the given paths and whatever is below them.
+// Binary manifests look them up in the path index instead of scanning.
+static int manifest_select(struct DEDUPE_MANIFEST *manifest, const char **paths, int path_count) {
+    manifest->paths = paths;
+    manifest->path_count = path_count;
+    if (manifest->map == NULL)
+        return 0;
+
+    int i;
+    int ret;
+    for (i = 0; i < path_count; i++) {
+        if (ret = binary_select(manifest, paths[i]))
+            return ret;
+    }
+    // overlapping paths select some records twice
+    qsort(manifest->selected, manifest->selected_count, sizeof(*manifest->selected), record_compare);
+    uint32_t j, count = 0;
+    for (j = 0; j < manifest->selected_count; j++) {
+        if (count == 0 || manifest->selected[count - 1] != manifest->selected[j])
+            manifest->selected[count++] = manifest->selected[j];
+    }
+    manifest->selected_count = count;
+    return 0;
+}
+
+static void manifest_rewind(struct DEDUPE_MANIFEST *manifest) {
+    manifest->next = 0;
+    if (manifest->file != NULL)
+        fseek(manifest->file, manifest->entries_start, SEEK_SET);
+}
+
+// Reads the next entry. Returns 1 for an entry, 0 at the end, and -1 for
+// a corrupt manifest.
+static int manifest_next(struct DEDUPE_MANIFEST *manifest, struct DEDUPE_ENTRY *entry) {
+    if (manifest->map != NULL) {
+        uint32_t i;
+        if (manifest->path_count > 0) {
+            if (manifest->next >= manifest->selected_count)
+                return 0;
+            i = manifest->selected[manifest->next++];
+            if (i >= manifest->count)
+                goto invalid;
+        }
+        else {
+            if (manifest->next >= manifest->count)
+                return 0;
+            i = manifest->next++;
+        }
+        if (binary_entry(manifest, i, entry))
+            goto invalid;
+        return 1;
+    }
+
+    while (fgets(manifest->line, sizeof(manifest->line), manifest->file)) {
+        if (parse_entry(manifest, entry))
+            goto invalid;
+        if (manifest->path_count == 0)
+            return 1;
+        int i;
+        for (i = 0; i < manifest->path_count; i++) {
+            if (path_matches(entry->filename, manifest->paths[i]))
+                return 1;
+        }
+    }
+    return 0;
+
+invalid:
+    fprintf(stderr, "Invalid manifest entry in %s\n", manifest->name);
+    return -1;
+}
+
+struct DEDUPE_RESTORE_JOB {
+    struct DEDUPE_RESTORE_JOB *next;
+    char *filename;
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    int chunked;
+};
+
+struct DEDUPE_RESTORE_CONTEXT {
     char blob_dir[PATH_MAX];
-    FILE *output_manifest;
-    const char** excludes;
-    int exclude_count;
+    struct DEDUPE_PACKS packs;
+
+    pthread_mutex_t lock;
+    // signalled when a job is queued, or the manifest is exhausted
+    pthread_cond_t work_ready;
+    // signalled when a worker takes a job
+    pthread_cond_t queue_space;
+    struct DEDUPE_RESTORE_JOB *head;
+    struct DEDUPE_RESTORE_JOB *tail;
+    int queued;
+    int max_queued;
+    int parse_done;
+    int error;
 };
 
-static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
-    fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
+static void* restore_worker(void *cookie) {
+    struct DEDUPE_RESTORE_CONTEXT *context = cookie;
+    struct DEDUPE_RESTORE_JOB *job;
+    char *buf = malloc(DEDUPE_BUFFER_SIZE);
+
+    pthread_mutex_lock(&context->lock);
+    for (;;) {
+        while (context->head == NULL && !context->parse_done)
+            pthread_cond_wait(&context->work_ready, &context->lock);
+        if ((job = context->head) == NULL)
+            break;
+        context->head = job->next;
+        if (context->head == NULL)
+            context->tail = NULL;
+        context->queued--;
+        pthread_cond_signal(&context->queue_space);
+
+        int ret = context->error;
+        if (!ret && buf == NULL)
+            ret = ENOMEM;
+        if (!ret) {
+            pthread_mutex_unlock(&context->lock);
+            if (job->chunked)
+                ret = restore_chunks(&context->packs, context->blob_dir, job->key, job->filename, buf);
+            else
+                ret = restore_blob(&context->packs, context->blob_dir, job->key, job->filename, buf);
+            if (ret)
+                fprintf(stderr, "Unable to copy file %s\n", job->filename);
+            else
+                printf("%s\n", job->filename);
+            pthread_mutex_lock(&context->lock);
+            if (ret && !context->error)
+                context->error = ret;
+        }
+        free(job->filename);
+        free(job);
+    }
+    pthread_mutex_unlock(&context->lock);
+    free(buf);
+    return NULL;
 }
 
-static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
-    char rdata[BUFSIZ];
-    int rsize;
-    SHA256_CTX c;
+static int queue_restore(struct DEDUPE_RESTORE_CONTEXT *context, const struct DEDUPE_ENTRY *entry) {
+    struct DEDUPE_RESTORE_JOB *job = calloc(1, sizeof(*job));
+    if (job == NULL || (job->filename = strdup(entry->filename)) == NULL) {
+        free(job);
+        return ENOMEM;
+    }
+    strncpy(job->key, entry->target, sizeof(job->key) - 1);
+    job->chunked = entry->type == 'c';
+
+    pthread_mutex_lock(&context->lock);
+    while (context->queued >= context->max_queued && !context->error)
+        pthread_cond_wait(&context->queue_space, &context->lock);
+    int error = context->error;
+    if (error) {
+        pthread_mutex_unlock(&context->lock);
+        free(job->filename);
+        free(job);
+        return error;
+    }
+    if (context->tail != NULL)
+        context->tail->next = job;
+    else
+        context->head = job;
+    context->tail = job;
+    context->queued++;
+    pthread_cond_signal(&context->work_ready);
+    pthread_mutex_unlock(&context->lock);
+    return 0;
+}
 
-    SHA256_Init(&c);
-    while(!feof(mfile)) {
-        rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
-        if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
+// Creates the directories leading up to a path picked for a partial
+// restore, which are not part of the selection themselves.
+static void make_parents(struct DEDUPE_MANIFEST *manifest, const char *path) {
+    int i;
+    for (i = 0; i < manifest->path_count; i++) {
+        if (strcmp(path, manifest->paths[i]) == 0)
+            break;
+    }
+    if (i == manifest->path_count)
+        return;
+
+    char parent[PATH_MAX];
+    strncpy(parent, path, sizeof(parent) - 1);
+    parent[sizeof(parent) - 1] = '\0';
+    char *slash = parent;
+    while ((slash = strchr(slash + 1, '/')) != NULL) {
+        *slash = '\0';
+        mkdir(parent, S_IRWXU | S_IRWXG | S_IRWXO);
+        *slash = '/';
+    }
+}
+
+// Creates directories and links as they come up in the manifest, and
+// hands files to a pool of workers. Directories come before their
+// contents in a manifest, so a file's parent always exists by the time
+// it is queued.
+static int restore_entries(struct DEDUPE_RESTORE_CONTEXT *context, struct DEDUPE_MANIFEST *manifest) {
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > DEDUPE_MAX_THREADS)
+        thread_count = DEDUPE_MAX_THREADS;
+
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->work_ready, NULL);
+    pthread_cond_init(&context->queue_space, NULL);
+    context->head = context->tail = NULL;
+    context->queued = 0;
+    context->max_queued = thread_count * DEDUPE_JOBS_PER_THREAD;
+    context->parse_done = 0;
+    context->error = 0;
+
+    pthread_t workers[DEDUPE_MAX_THREADS];
+    int i;
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i], NULL, restore_worker, context))
+            break;
+    }
+    thread_count = i;
+    int ret = thread_count == 0;
+
+    struct DEDUPE_ENTRY entry;
+    int more;
+    while (!ret && (more = manifest_next(manifest, &entry)) != 0) {
+        if (more < 0) {
+            ret = 1;
+            break;
+        }
+        if (manifest->path_count > 0)
+            make_parents(manifest, entry.filename);
+        if (entry.type == 'f' || entry.type == 'c') {
+            ret = queue_restore(context, &entry);
+        }
+        else if (entry.type == 'l') {
+            printf("%s\n", entry.filename);
+            symlink(entry.target, entry.filename);
+        }
+        else if (entry.type == 'd') {
+            printf("%s\n", entry.filename);
+            // the real mode is applied once everything inside is restored
+            mkdir(entry.filename, S_IRWXU);
+        }
+        else {
+            fprintf(stderr, "Unknown type %c\n", entry.type);
+            ret = 1;
         }
     }
 
-    SHA256_Final(rptr, &c);
+    pthread_mutex_lock(&context->lock);
+    context->parse_done = 1;
+    if (ret && !context->error)
+        context->error = ret;
+    pthread_cond_broadcast(&context->work_ready);
+    pthread_mutex_unlock(&context->lock);
+
+    for (i = 0; i < thread_count; i++)
+        pthread_join(workers[i], NULL);
+
+    return context->error;
 }
 
-static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file: %s\n", filename);
-        return 1;
+// Applies ownership, modes and times once all the data is in place, so
+// that creating files does not disturb the times of their directories
+// and read-only directories can still be filled.
+static int restore_metadata(struct DEDUPE_MANIFEST *manifest) {
+    struct DEDUPE_ENTRY entry;
+    int more;
+    while ((more = manifest_next(manifest, &entry)) != 0) {
+        if (more < 0)
+            return 1;
+        if (entry.type == 'l') {
+            // Android has no lchmod, and chmod and utimes follow symlinks
+            lchown(entry.filename, entry.uid, entry.gid);
+            continue;
+        }
+
+        chown(entry.filename, entry.uid, entry.gid);
+        chmod(entry.filename, entry.mode);
+        if (entry.has_times) {
+            struct timeval times[2];
+            times[0].tv_sec = entry.atime;
+            times[0].tv_usec = 0;
+            times[1].tv_sec = entry.mtime;
+            times[1].tv_usec = 0;
+            utimes(entry.filename, times);
+        }
     }
-    do_sha256sum(f, rptr);
-    fclose(f);
     return 0;
 }
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+// Marks every chunk named in a chunk list blob as used.
+static int mark_chunks(struct DEDUPE_PACKS *packs, const char *blob_dir, const char *list_key, struct DIGEST_SET *used) {
+    char *list;
+    int list_len;
+    int ret = 0;
+    if (read_blob(packs, blob_dir, list_key, &list, &list_len))
+        return 1;
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%d\t%d\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, st.st_atime, st.st_mtime, st.st_ctime, f);
+    char *line = list;
+    while (*line != '\0') {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        char key[SHA256_DIGEST_LENGTH * 2 + 2];
+        if (sscanf(line, "%65s", key) == 1 && key_to_digest(key, digest) == 0) {
+            if (ret = digest_set_add(used, digest))
+                break;
+        }
+        if ((line = strchr(line, '\n')) == NULL)
+            break;
+        line++;
+    }
+    free(list);
+    return ret;
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+// Marks a file's blob, and its chunks if it is chunked, as used.
+static int gc_mark_file(char type, const unsigned char *digest, const char *key, struct DEDUPE_PACKS *packs, const char *blob_dir, struct DIGEST_SET *used) {
     int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
+    if (ret = digest_set_add(used, digest))
         return ret;
+    if (type == 'c' && mark_chunks(packs, blob_dir, key, used)) {
+        // deleting chunks that may still be in use is far
+        // worse than keeping a few unused ones around
+        fprintf(stderr, "Unable to read chunk list %s\n", key);
+        return 1;
     }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
-
-    // if a hash is abcdefg,
-    // the output blob name is abc/defg
-    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
-    char out_blob[PATH_MAX];
-    char tmp_out_blob[PATH_MAX];
-    char key[SHA256_DIGEST_LENGTH * 2 + 2];
-    // int i = 0;
-    // int keyIndex = 0;
-    // while (psum[i]) {
-    //     key[keyIndex] = psum[i];
-    //     i++;
-    //     keyIndex++;
-    //     if (i % 2 == 0 && psum[i]) {
-    //         key[keyIndex] = '/';
-    //         keyIndex++;
-    //     }
-    // }
-    strcpy(key, psum);
-    key[3] = '/';
-    key[4] = NULL;
-    strcat(key, psum + 3);
-    sprintf(out_blob, "%s/%s", context->blob_dir, key);
-    sprintf(tmp_out_blob, "%s.tmp", out_blob);
-    mkdir(dirname(out_blob), S_IRWXU | S_IRWXG | S_IRWXO);
-
-    // don't copy the file if it exists? not quite sure how I feel about this.
-    int size = (int)st.st_size;
-    struct stat file_info;
-    // verify the file exists and is of the same size
-    int file_ok = stat(out_blob, &file_info) == 0;
-    if (file_ok) {
-        int existing_size = file_info.st_size;
-        if (existing_size != size)
-            file_ok = 0;
-    }
-    if (!file_ok) {
-        // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
-            fprintf(stderr, "Error copying blob %s\n", f);
-            return ret;
-        }
-    }
-
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
     return 0;
 }
 
-static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
-    char full_path[PATH_MAX];
-    printf("%s\n", d);
-    DIR *dp = opendir(d);
-    if (dp == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", d);
+// Marks every blob referenced by a manifest as used. Text manifests are
+// streamed a line at a time and only the keys are looked at. Binary ones
+// already hold raw digests.
+static int gc_mark_manifest(const char *name, struct DEDUPE_PACKS *packs, const char *blob_dir, struct DIGEST_SET *used) {
+    struct DEDUPE_MANIFEST manifest;
+    if (manifest_open(&manifest, name, "gc"))
         return 1;
+
+    int ret = 0;
+    if (manifest.map != NULL) {
+        uint32_t i;
+        for (i = 0; i < manifest.count && !ret; i++) {
+            const unsigned char *record = manifest.records + (size_t)i * DEDUPE_BINARY_RECORD_SIZE;
+            if (record[0] != 'f' && record[0] != 'c')
+                continue;
+            sha256_to_key(record + 56, manifest.key);
+            ret = gc_mark_file(record[0], record + 56, manifest.key, packs, blob_dir, used);
+        }
+        manifest_close(&manifest);
+        return ret;
     }
-    struct dirent *ep;
-    while (ep = readdir(dp)) {
-        if (strcmp(ep->d_name, ".") == 0)
-            continue;
-        if (strcmp(ep->d_name, "..") == 0)
+
+    // type, mode, uid, gid, [atime, mtime, ctime,] filename, key
+    int key_field = manifest.version >= 2 ? 8 : 5;
+    char *line = manifest.line;
+    int partial = 0;
+    while (!ret && fgets(line, sizeof(manifest.line), manifest.file)) {
+        // skip the rest of anything too long to be a file entry
+        int was_partial = partial;
+        size_t len = strlen(line);
+        partial = len > 0 && line[len - 1] != '\n';
+        if (was_partial || (line[0] != 'f' && line[0] != 'c') || line[1] != '\t')
             continue;
-        struct stat cst;
-        int ret;
-        sprintf(full_path, "%s/%s", d, ep->d_name);
+
+        char *field = line;
         int i;
-        for (i = 0; i < context->exclude_count; i++) {
-            if (!strcmp(context->excludes[i], full_path))
-                break;
+        for (i = 0; i < key_field && field != NULL; i++) {
+            if ((field = strchr(field, '\t')) != NULL)
+                field++;
         }
-        if (i != context->exclude_count)
+        char *end;
+        if (field == NULL || (end = strchr(field, '\t')) == NULL)
             continue;
-        if (0 != (ret = lstat(full_path, &cst))) {
-            fprintf(stderr, "Error opening: %s\n", full_path);
-            closedir(dp);
-            return ret;
-        }
+        *end = '\0';
 
-        if (ret = store_st(context, cst, full_path)) {
-            fprintf(stderr, "Error storing: %s\n", full_path);
-            closedir(dp);
-            return ret;
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        if (key_to_digest(field, digest) != 0) {
+            fprintf(stderr, "Invalid key %s in %s\n", field, name);
+            ret = 1;
+            break;
         }
+        ret = gc_mark_file(line[0], digest, field, packs, blob_dir, used);
     }
-    closedir(dp);
-    return 0;
+    manifest_close(&manifest);
+    return ret;
 }
 
-static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
-    printf("%s\n", l);
-    char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
-    if (ret < 0) {
-        fprintf(stderr, "Error reading symlink\n");
-        return errno;
+// Drops unreferenced blobs from the packs. Packs with nothing left are
+// deleted, and packs where more than a quarter of the bytes are dead are
+// compacted by copying their live blobs into a new pack. Old packs are
+// only removed once the new pack's index is safely written.
+static int packs_gc(struct DEDUPE_PACKS *packs, struct DIGEST_SET *used) {
+    char path[PATH_MAX];
+    int i;
+    int ret = 0;
+
+    // packs left behind by an interrupted run never got an index
+    DIR *dp = opendir(packs->dir);
+    if (dp != NULL) {
+        struct dirent *ep;
+        while ((ep = readdir(dp))) {
+            int id;
+            char ext[16];
+            if (sscanf(ep->d_name, "%d.%15s", &id, ext) != 2)
+                continue;
+            int indexed = 0;
+            for (i = 0; i < packs->count; i++) {
+                if (packs->ids[i] == id)
+                    indexed = 1;
+            }
+            if (!indexed || strcmp(ext, "idx.tmp") == 0) {
+                snprintf(path, sizeof(path), "%s/%s", packs->dir, ep->d_name);
+                printf("Delete: %s\n", path);
+                if (remove(path))
+                    fprintf(stderr, "Error removing: %s\n", path);
+            }
+        }
+        closedir(dp);
     }
-    link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
-}
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
-    if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, s);
-        return store_file(context, st, s);
+    if (packs->count == 0)
+        return 0;
+
+    uint64_t *live_bytes = calloc(packs->count, sizeof(uint64_t));
+    uint64_t *total_bytes = calloc(packs->count, sizeof(uint64_t));
+    char *live = malloc(packs->entry_count + 1);
+    char *compact = calloc(packs->count, 1);
+    if (live_bytes == NULL || total_bytes == NULL || live == NULL || compact == NULL) {
+        ret = ENOMEM;
+        goto out;
     }
-    else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, s);
-        fprintf(context->output_manifest, "\n");
-        return store_dir(context, st, s);
+
+    for (i = 0; i < packs->entry_count; i++) {
+        const struct DEDUPE_PACK_ENTRY *e = &packs->entries[i];
+        live[i] = digest_set_contains(used, e->digest);
+        total_bytes[e->pack] += e->length;
+        if (live[i])
+            live_bytes[e->pack] += e->length;
     }
-    else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, s);
-        return store_link(context, st, s);
+
+    char buf[DEDUPE_PACK_MAX_BLOB];
+    for (i = 0; i < packs->entry_count && !ret; i++) {
+        const struct DEDUPE_PACK_ENTRY *e = &packs->entries[i];
+        uint64_t dead = total_bytes[e->pack] - live_bytes[e->pack];
+        if (!live[i] || live_bytes[e->pack] == 0 || dead * 4 <= total_bytes[e->pack])
+            continue;
+        compact[e->pack] = 1;
+        if (!(ret = packs_read(packs, e, buf)))
+            ret = packs_append(packs, e->digest, buf, e->length);
     }
-    else {
-        fprintf(stderr, "Skipping special: %s\n", s);
-        return 0;
+    if (!ret)
+        ret = packs_finish(packs);
+    if (ret) {
+        fprintf(stderr, "Error compacting packs\n");
+        goto out;
     }
-}
-
-static char* tokenize(char *out, const char* line, const char sep) {
-    while (*line != sep) {
-        if (*line == '\0') {
-            return NULL;
-        }
 
-        *out = *line;
-        out++;
-        line++;
+    for (i = 0; i < packs->count; i++) {
+        if (live_bytes[i] != 0 && !compact[i])
+            continue;
+        printf("Delete: %s/%08d.pack\n", packs->dir, packs->ids[i]);
+        // the index goes first, so a crash leaves an unindexed pack
+        // behind rather than an index into a missing one
+        pack_path(packs, packs->ids[i], "idx", path);
+        if (remove(path))
+            fprintf(stderr, "Error removing: %s\n", path);
+        pack_path(packs, packs->ids[i], "pack", path);
+        if (remove(path))
+            fprintf(stderr, "Error removing: %s\n", path);
     }
 
-    *out = '\0';
-    // resume at the next char
-    return ++line;
+out:
+    free(live_bytes);
+    free(total_bytes);
+    free(live);
+    free(compact);
+    return ret;
 }
 
-static int dec_to_oct(int dec) {
-    int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
+#define VERIFY_OK 0
+#define VERIFY_MISSING 1
+#define VERIFY_BAD_SIZE 2
+#define VERIFY_CORRUPT 3
+
+struct DEDUPE_VERIFY_JOB {
+    struct DEDUPE_VERIFY_JOB *next;
+    char *filename;
+    char key[SHA256_DIGEST_LENGTH * 2 + 2];
+    long long size;
+    int chunked;
+};
+
+struct DEDUPE_VERIFY_CONTEXT {
+    char blob_dir[PATH_MAX];
+    struct DEDUPE_PACKS packs;
+    // only check that blobs exist with the right size
+    int fast;
+
+    pthread_mutex_t lock;
+    // signalled when a job is queued, or the manifest is exhausted
+    pthread_cond_t work_ready;
+    // signalled when a worker takes a job
+    pthread_cond_t queue_space;
+    struct DEDUPE_VERIFY_JOB *head;
+    struct DEDUPE_VERIFY_JOB *tail;
+    int queued;
+    int max_queued;
+    int parse_done;
+    // blobs already checked, since files and chunks are shared
+    struct DIGEST_SET checked;
+    int blob_count;
+    int missing;
+    int corrupt;
+    int error;
+};
+
+// Checks one blob. size is the expected uncompressed size, or -1 if it
+// is not known. buf must hold DEDUPE_BUFFER_SIZE bytes.
+static int verify_blob(struct DEDUPE_VERIFY_CONTEXT *context, const char *key, long long size, char *buf) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    SHA256_CTX c;
+    if (key_to_digest(key, digest))
+        return VERIFY_CORRUPT;
+
+    SHA256_Init(&c);
+    const struct DEDUPE_PACK_ENTRY *entry = packs_find_indexed(&context->packs, digest);
+    if (entry != NULL) {
+        if (size >= 0 && entry->length != size)
+            return VERIFY_BAD_SIZE;
+        if (context->fast)
+            return VERIFY_OK;
+        if (packs_read(&context->packs, entry, buf))
+            return VERIFY_CORRUPT;
+        SHA256_Update(&c, buf, entry->length);
     }
+    else {
+        int compressed;
+        int fd = open_blob(context->blob_dir, key, &compressed);
+        if (fd < 0)
+            return VERIFY_MISSING;
 
-    return ret;
+        int ret = VERIFY_OK;
+        uint64_t blob_size;
+        struct stat st;
+        if (compressed) {
+            if (read_compressed_header(fd, &blob_size))
+                ret = VERIFY_CORRUPT;
+        }
+        else if (fstat(fd, &st)) {
+            ret = VERIFY_CORRUPT;
+        }
+        else {
+            blob_size = st.st_size;
+        }
+        if (!ret && size >= 0 && blob_size != (uint64_t)size)
+            ret = VERIFY_BAD_SIZE;
+
+        if (!ret && !context->fast) {
+            if (compressed) {
+                // inflate_blob reads the header again
+                if (lseek(fd, 0, SEEK_SET) != 0 || inflate_blob(fd, -1, buf, &c))
+                    ret = VERIFY_CORRUPT;
+            }
+            else {
+                int bytes_read;
+                while ((bytes_read = read_fully(fd, buf, DEDUPE_BUFFER_SIZE)) > 0)
+                    SHA256_Update(&c, buf, bytes_read);
+                if (bytes_read < 0)
+                    ret = VERIFY_CORRUPT;
+            }
+        }
+        close(fd);
+        if (ret || context->fast)
+            return ret;
+    }
+
+    SHA256_Final(sumdata, &c);
+    return memcmp(sumdata, digest, SHA256_DIGEST_LENGTH) == 0 ? VERIFY_OK : VERIFY_CORRUPT;
 }
 
-struct array {
-    void** data;
-    int size;
-    int capacity;
-};
+// Claims a blob for checking. Returns 0 if it was already checked, 1 if
+// the caller should check it, and -1 on failure.
+static int verify_claim(struct DEDUPE_VERIFY_CONTEXT *context, const char *key) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int ret = 1;
+    // a malformed key is reported as corrupt by verify_blob
+    if (key_to_digest(key, digest))
+        return 1;
+    pthread_mutex_lock(&context->lock);
+    if (digest_set_contains(&context->checked, digest))
+        ret = 0;
+    else if (digest_set_add(&context->checked, digest))
+        ret = -1;
+    else
+        context->blob_count++;
+    pthread_mutex_unlock(&context->lock);
+    return ret;
+}
 
-static void array_init(struct array* arr, int capacity) {
-    arr->data = malloc(sizeof(void*) * capacity);
-    assert(arr->data != NULL);
-    arr->size = 0;
-    arr->capacity = capacity;
+static void verify_report(struct DEDUPE_VERIFY_CONTEXT *context, const char *filename, const char *key, int status) {
+    if (status == VERIFY_OK)
+        return;
+    pthread_mutex_lock(&context->lock);
+    if (status == VERIFY_MISSING) {
+        fprintf(stderr, "Missing blob %s for %s\n", key, filename);
+        context->missing++;
+    }
+    else {
+        fprintf(stderr, "%s blob %s for %s\n", status == VERIFY_BAD_SIZE ? "Wrong size" : "Corrupt", key, filename);
+        context->corrupt++;
+    }
+    pthread_mutex_unlock(&context->lock);
 }
 
-static void array_free(struct array* arr, int free_members) {
-    if (free_members) {
-        int i;
-        for (i = 0; i < arr->size; i++) {
-            free(arr->data[i]);
-        }
+// Checks a file's blob, and for chunked files the chunk list and every
+// chunk it names.
+static int verify_file(struct DEDUPE_VERIFY_CONTEXT *context, struct DEDUPE_VERIFY_JOB *job, char *buf) {
+    int claim = verify_claim(context, job->key);
+    if (claim < 0)
+        return ENOMEM;
+    if (!job->chunked) {
+        if (claim)
+            verify_report(context, job->filename, job->key, verify_blob(context, job->key, job->size, buf));
+        return 0;
+    }
+
+    // the chunk list blob is as big as the list, not the file
+    int status = VERIFY_OK;
+    if (claim && (status = verify_blob(context, job->key, -1, buf)) != VERIFY_OK) {
+        verify_report(context, job->filename, job->key, status);
+        return 0;
+    }
+    char *list;
+    int list_len;
+    if (read_blob(&context->packs, context->blob_dir, job->key, &list, &list_len)) {
+        verify_report(context, job->filename, job->key, claim ? VERIFY_CORRUPT : VERIFY_OK);
+        return 0;
     }
 
-    if (arr->data != NULL) {
-        free(arr->data);
-        arr->data = NULL;
+    long long total = 0;
+    char *line = list;
+    while (*line != '\0') {
+        char key[SHA256_DIGEST_LENGTH * 2 + 2];
+        int size;
+        if (sscanf(line, "%65s\t%d", key, &size) != 2) {
+            status = VERIFY_CORRUPT;
+            break;
+        }
+        total += size;
+        if ((claim = verify_claim(context, key)) < 0) {
+            free(list);
+            return ENOMEM;
+        }
+        if (claim)
+            verify_report(context, job->filename, key, verify_blob(context, key, size, buf));
+        if ((line = strchr(line, '\n')) == NULL)
+            break;
+        line++;
     }
-    arr->size = 0;
-    arr->capacity = 0;
+    free(list);
+    if (status == VERIFY_OK && job->size >= 0 && total != job->size)
+        status = VERIFY_BAD_SIZE;
+    verify_report(context, job->filename, job->key, status);
+    return 0;
 }
 
-static void array_add(struct array* arr, void* val) {
-    if (arr->size == arr->capacity) {
-        // Expand array
-        arr->capacity *= 2;
-        arr->data = realloc(arr->data, sizeof(void*) * arr->capacity);
-        assert(arr->data != NULL);
+static void* verify_worker(void *cookie) {
+    struct DEDUPE_VERIFY_CONTEXT *context = cookie;
+    struct DEDUPE_VERIFY_JOB *job;
+    char *buf = malloc(DEDUPE_BUFFER_SIZE);
+
+    pthread_mutex_lock(&context->lock);
+    if (buf == NULL)
+        context->error = ENOMEM;
+    for (;;) {
+        while (context->head == NULL && !context->parse_done)
+            pthread_cond_wait(&context->work_ready, &context->lock);
+        if ((job = context->head) == NULL)
+            break;
+        context->head = job->next;
+        if (context->head == NULL)
+            context->tail = NULL;
+        context->queued--;
+        pthread_cond_signal(&context->queue_space);
+
+        if (!context->error) {
+            pthread_mutex_unlock(&context->lock);
+            int ret = verify_file(context, job, buf);
+            pthread_mutex_lock(&context->lock);
+            if (ret && !context->error)
+                context->error = ret;
+        }
+        free(job->filename);
+        free(job);
     }
-    arr->data[arr->size++] = val;
+    pthread_mutex_unlock(&context->lock);
+    free(buf);
+    return NULL;
 }
 
-static int string_compare(const void* a, const void* b) {
-    return strcmp(*(char**) a, *(char **) b);
+static int queue_verify(struct DEDUPE_VERIFY_CONTEXT *context, const struct DEDUPE_ENTRY *entry) {
+    struct DEDUPE_VERIFY_JOB *job = calloc(1, sizeof(*job));
+    if (job == NULL || (job->filename = strdup(entry->filename)) == NULL) {
+        free(job);
+        return ENOMEM;
+    }
+    strncpy(job->key, entry->target, sizeof(job->key) - 1);
+    job->size = entry->size;
+    job->chunked = entry->type == 'c';
+
+    pthread_mutex_lock(&context->lock);
+    while (context->queued >= context->max_queued && !context->error)
+        pthread_cond_wait(&context->queue_space, &context->lock);
+    int error = context->error;
+    if (error) {
+        pthread_mutex_unlock(&context->lock);
+        free(job->filename);
+        free(job);
+        return error;
+    }
+    if (context->tail != NULL)
+        context->tail->next = job;
+    else
+        context->head = job;
+    context->tail = job;
+    context->queued++;
+    pthread_cond_signal(&context->work_ready);
+    pthread_mutex_unlock(&context->lock);
+    return 0;
 }
 
-static void recursive_list_dir(char* d, struct array *arr) {
-    DIR *dp = opendir(d);
-    if (dp == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", d);
-        return;
+// Checks every blob a manifest references, spread over thread_count
+// workers. Returns non-zero if anything is missing or corrupt.
+static int verify_manifest(struct DEDUPE_VERIFY_CONTEXT *context, struct DEDUPE_MANIFEST *manifest, int thread_count) {
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->work_ready, NULL);
+    pthread_cond_init(&context->queue_space, NULL);
+    context->head = context->tail = NULL;
+    context->queued = 0;
+    context->max_queued = thread_count * DEDUPE_JOBS_PER_THREAD;
+    context->parse_done = 0;
+    context->blob_count = 0;
+    context->missing = 0;
+    context->corrupt = 0;
+    context->error = 0;
+
+    pthread_t workers[DEDUPE_MAX_THREADS];
+    int i;
+    for (i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i], NULL, verify_worker, context))
+            break;
+    }
+    thread_count = i;
+    int ret = thread_count == 0;
+
+    struct DEDUPE_ENTRY entry;
+    int more;
+    while (!ret && (more = manifest_next(manifest, &entry)) != 0) {
+        if (more < 0)
+            ret = 1;
+        else if (entry.type == 'f' || entry.type == 'c')
+            ret = queue_verify(context, &entry);
     }
-    struct dirent *ep;
-    while ((ep = readdir(dp))) {
-        if (strcmp(ep->d_name, ".") == 0)
-            continue;
-        if (strcmp(ep->d_name, "..") == 0)
-            continue;
-        struct stat cst;
-        int ret;
-        char blob[PATH_MAX];
-        sprintf(blob, "%s/%s", d, ep->d_name);
-        if ((ret = lstat(blob, &cst))) {
-            fprintf(stderr, "Error opening: %s\n", ep->d_name);
-            continue;
-        }
 
-        if (S_ISDIR(cst.st_mode)) {
-            recursive_list_dir(blob, arr);
-            continue;
-        }
+    pthread_mutex_lock(&context->lock);
+    context->parse_done = 1;
+    if (ret && !context->error)
+        context->error = ret;
+    pthread_cond_broadcast(&context->work_ready);
+    pthread_mutex_unlock(&context->lock);
 
-        array_add(arr, strdup(blob));
+    for (i = 0; i < thread_count; i++)
+        pthread_join(workers[i], NULL);
+
+    if (context->error) {
+        fprintf(stderr, "Unable to verify %s\n", manifest->name);
+        return context->error;
     }
-    closedir(dp);
+    printf("Checked %d blobs: %d missing, %d corrupt\n", context->blob_count, context->missing, context->corrupt);
+    return context->missing || context->corrupt;
 }
 
 static int check_file(const char* f) {
@@ -349,154 +3041,165 @@ int dedupe_main(int argc, char** argv) {
     }
 
     if (strcmp(argv[1], "c") == 0) {
-        if (argc < 5) {
+        int arg = 2;
+        int use_stat_cache = 0;
+        int binary = 0;
+        int compress_level = 0;
+        for (; argc > arg; arg++) {
+            if (strcmp(argv[arg], "-s") == 0)
+                use_stat_cache = 1;
+            else if (strcmp(argv[arg], "-b") == 0)
+                binary = 1;
+            else if (strcmp(argv[arg], "-z") == 0 && argc > arg + 1) {
+                compress_level = atoi(argv[++arg]);
+                if (compress_level < 0 || compress_level > 9) {
+                    usage(argv);
+                    return 1;
+                }
+            }
+            else
+                break;
+        }
+        if (argc < arg + 3) {
             usage(argv);
             return 1;
         }
+        const char *input_dir = argv[arg];
+        const char *blob_dir = argv[arg + 1];
+        const char *output_manifest = argv[arg + 2];
 
         struct stat st;
         int ret;
-        if (0 != (ret = lstat(argv[2], &st))) {
+        if (0 != (ret = lstat(input_dir, &st))) {
             fprintf(stderr, "Error opening input_file/input_directory.\n");
             return ret;
         }
 
         if (!S_ISDIR(st.st_mode)) {
-            fprintf(stderr, "%s must be a directory.\n", argv[2]);
+            fprintf(stderr, "%s must be a directory.\n", input_dir);
             return 1;
         }
 
         struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
+        context.output_manifest = fopen(output_manifest, "wb");
         if (context.output_manifest == NULL) {
-            fprintf(stderr, "Unable to open output file %s\n", argv[4]);
+            fprintf(stderr, "Unable to open output file %s\n", output_manifest);
             return 1;
         }
-        mkdir(argv[3], S_IRWXU | S_IRWXG | S_IRWXO);
-        realpath(argv[3], context.blob_dir);
-        chdir(argv[2]);
-        context.excludes = argv + 5;
-        context.exclude_count = argc - 5;
-
-        return store_dir(&context, st, ".");
+        context.binary = NULL;
+        if (binary) {
+            if ((context.binary = binary_open(context.output_manifest)) == NULL) {
+                fprintf(stderr, "Unable to write output file %s\n", output_manifest);
+                fclose(context.output_manifest);
+                return 1;
+            }
+        }
+        else {
+            fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
+        }
+        mkdir(blob_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+        realpath(blob_dir, context.blob_dir);
+        if (packs_open(&context.packs, context.blob_dir)) {
+            if (context.binary != NULL)
+                binary_finish(context.binary);
+            fclose(context.output_manifest);
+            return 1;
+        }
+        context.compress_level = compress_level;
+        context.stat_cache = NULL;
+        if (use_stat_cache) {
+            char root[PATH_MAX];
+            if (realpath(input_dir, root) != NULL)
+                context.stat_cache = stat_cache_open(context.blob_dir, root);
+        }
+        chdir(input_dir);
+        context.excludes = (const char**)argv + arg + 3;
+        context.exclude_count = argc - arg - 3;
+
+        chunk_init_gear();
+        ret = store_tree(&context, st, ".");
+        // the manifest is useless if its packed blobs are not indexed
+        int pack_ret = packs_finish(&context.packs);
+        if (!ret)
+            ret = pack_ret;
+        packs_close(&context.packs);
+        if (context.binary != NULL) {
+            int binary_ret = binary_finish(context.binary);
+            if (!ret)
+                ret = binary_ret;
+        }
+        if (context.stat_cache != NULL)
+            stat_cache_close(context.stat_cache, ret == 0);
+        if (fclose(context.output_manifest) && !ret) {
+            fprintf(stderr, "Error writing output file %s\n", output_manifest);
+            ret = 1;
+        }
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
-        if (argc != 5) {
+        if (argc < 5) {
             usage(argv);
             return 1;
         }
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        struct DEDUPE_MANIFEST manifest;
+        if (manifest_open(&manifest, argv[2], "restore"))
             return 1;
+
+        // manifest paths are relative to the stored directory, as in ./a/b
+        int path_count = argc - 5;
+        char **paths = calloc(path_count + 1, sizeof(*paths));
+        int i;
+        int ret = paths == NULL;
+        for (i = 0; i < path_count && !ret; i++) {
+            const char *path = argv[5 + i];
+            if (strncmp(path, "./", 2) == 0)
+                path += 2;
+            char normalized[PATH_MAX];
+            snprintf(normalized, sizeof(normalized), "./%s", path);
+            size_t len = strlen(normalized);
+            while (len > 2 && normalized[len - 1] == '/')
+                normalized[--len] = '\0';
+            if ((paths[i] = strdup(normalized)) == NULL)
+                ret = 1;
+        }
+        if (ret || manifest_select(&manifest, (const char**)paths, path_count)) {
+            fprintf(stderr, "Out of memory\n");
+            ret = 1;
+            goto x_out;
         }
 
-        char blob_dir[PATH_MAX];
+        struct DEDUPE_RESTORE_CONTEXT context;
         char *output_dir = argv[4];
-        realpath(argv[3], blob_dir);
+        realpath(argv[3], context.blob_dir);
+        if (packs_open(&context.packs, context.blob_dir)) {
+            ret = 1;
+            goto x_out;
+        }
 
         printf("%s\n" , output_dir);
         mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
         if (chdir(output_dir)) {
             fprintf(stderr, "Unable to open output directory %s\n", output_dir);
-            return 1;
+            ret = 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
-        }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
-            return 1;
+        if (!ret)
+            ret = restore_entries(&context, &manifest);
+        if (!ret) {
+            manifest_rewind(&manifest);
+            ret = restore_metadata(&manifest);
         }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
-
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
-
-                mkdir(filename, mode_oct);
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
+        packs_close(&context.packs);
+
+        x_out:
+        manifest_close(&manifest);
+        if (paths != NULL) {
+            for (i = 0; i < path_count; i++)
+                free(paths[i]);
+            free(paths);
         }
-
-        fclose(input_manifest);
-        return 0;
+        return ret;
     }
     else if (strcmp(argv[1], "gc") == 0) {
         if (argc < 3) {
@@ -511,102 +3214,88 @@ int dedupe_main(int argc, char** argv) {
             return 1;
         }
 
-        struct array used_files;
-        struct array all_files;
-        array_init(&used_files, ARRAY_CAPACITY);
-        array_init(&all_files, ARRAY_CAPACITY);
+        struct DEDUPE_PACKS packs;
+        if (packs_open(&packs, blob_dir)) {
+            // without the pack indices nothing can be proven unused
+            packs_close(&packs);
+            return 1;
+        }
+
+        struct DIGEST_SET used;
+        if (digest_set_init(&used, DIGEST_SET_CAPACITY)) {
+            packs_close(&packs);
+            return 1;
+        }
 
-        char blob[PATH_MAX];
         int i;
         int failure = 0;
         for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
+            if (gc_mark_manifest(argv[i], &packs, blob_dir, &used)) {
                 failure = 1;
                 goto out;
             }
+        }
 
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
-                failure = 1;
-                fclose(input_manifest);
-                break;
-            }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
-                }
-            }
-            fclose(input_manifest);
+        if (packs_gc(&packs, &used)) {
+            failure = 1;
+            goto out;
         }
 
-        recursive_list_dir(blob_dir, &all_files);
+        gc_sweep_dir(blob_dir, blob_dir, &packs, &used);
 
-        qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
-        qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
+        out:
+        digest_set_free(&used);
+        packs_close(&packs);
 
-        // Search for unused files
-        int j = 0;
-        for (i = 0; i < all_files.size; i++) {
-            int cmp;
-            while (j < used_files.size &&
-                (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
-                j++;
-            }
+        return failure;
+    }
+    else if (strcmp(argv[1], "verify") == 0) {
+        struct DEDUPE_VERIFY_CONTEXT context;
+        int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+        int arg = 2;
+        context.fast = 0;
+        for (; argc > arg; arg++) {
+            if (strcmp(argv[arg], "-f") == 0)
+                context.fast = 1;
+            else if (strcmp(argv[arg], "-j") == 0 && argc > arg + 1)
+                thread_count = atoi(argv[++arg]);
+            else
+                break;
+        }
+        if (argc != arg + 2) {
+            usage(argv);
+            return 1;
+        }
+        if (thread_count < 1)
+            thread_count = 1;
+        if (thread_count > DEDUPE_MAX_THREADS)
+            thread_count = DEDUPE_MAX_THREADS;
 
-            if (cmp > 0 || j >= used_files.size) {
-                if (remove(all_files.data[i])) {
-                    fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
-                }
-                printf("Delete: %s\n", all_files.data[i]);
-            }
+        struct DEDUPE_MANIFEST manifest;
+        if (manifest_open(&manifest, argv[arg], "verify"))
+            return 1;
+        realpath(argv[arg + 1], context.blob_dir);
+        if (check_file(context.blob_dir)) {
+            fprintf(stderr, "Unable to open blobs dir: %s\n", argv[arg + 1]);
+            manifest_close(&manifest);
+            return 1;
+        }
+        if (packs_open(&context.packs, context.blob_dir)) {
+            manifest_close(&manifest);
+            return 1;
+        }
+        if (digest_set_init(&context.checked, DIGEST_SET_CAPACITY)) {
+            packs_close(&context.packs);
+            manifest_close(&manifest);
+            return 1;
         }
 
-        out:
-        array_free(&used_files, 1);
-        array_free(&all_files, 1);
+        int ret = verify_manifest(&context, &manifest, thread_count);
 
-        return failure;
+        digest_set_free(&context.checked);
+        packs_close(&context.packs);
+        manifest_close(&manifest);
+        return ret;
     }
     else {
         usage(argv);
@@ -448,7 +448,9 @@ void show_nandroid_restore_menu(const char* path) {
     if (file == NULL)
         return;
 
-    if (confirm_selection("Confirm restore?", "Yes - Restore"))
+    if (nandroid_restore_interrupted(file) && confirm_selection("Resume interrupted restore?", "Yes - Skip restored partitions"))
+        nandroid_resume_restore(file);
+    else if (confirm_selection("Confirm restore?", "Yes - Restore"))
         nandroid_restore(file, 1, 1, 1, 1, 1, 0);
 
     free(file);
@@ -948,6 +950,94 @@ int show_partition_menu() {
     return chosen_item;
 }
 
+// Browses the archived files of mount_point in the backup like
+// choose_file_menu. Returns 1 once something was chosen and restored, to
+// leave every level of the menu.
+static int show_nandroid_file_restore_browser(const char* backup_path, const char* mount_point, const char* dir) {
+    static const char* headers[] = { "Choose files to restore", "", NULL };
+    const char* fixed_headers[] = { headers[0], dir, "", NULL };
+    char path[PATH_MAX];
+    char confirm[PATH_MAX];
+    int ret = 0;
+
+    char** names = nandroid_list_backup_files(backup_path, mount_point, dir);
+    if (names == NULL) {
+        ui_print("Unable to read the file list of this backup.\n");
+        return 1;
+    }
+    int count = 0;
+    while (names[count] != NULL)
+        count++;
+
+    // the folder itself comes first
+    char** list = (char**)malloc((count + 2) * sizeof(char*));
+    int i;
+    list[0] = strdup("Restore this folder");
+    for (i = 0; i < count; i++)
+        list[i + 1] = strdup(names[i]);
+    list[count + 1] = NULL;
+
+    for (;;) {
+        int chosen_item = get_menu_selection(fixed_headers, list, 0, 0);
+        if (chosen_item == GO_BACK || chosen_item == REFRESH)
+            break;
+        strcpy(path, dir);
+        if (chosen_item > 0)
+            strcat(path, names[chosen_item - 1]);
+        size_t len = strlen(path);
+        if (chosen_item > 0 && path[len - 1] == '/') {
+            if (show_nandroid_file_restore_browser(backup_path, mount_point, path)) {
+                ret = 1;
+                break;
+            }
+            continue;
+        }
+        if (len > 0 && path[len - 1] == '/')
+            path[len - 1] = '\0';
+        snprintf(confirm, sizeof(confirm), "Yes - Restore %s", path);
+        if (confirm_selection("Confirm restore?", confirm)) {
+            nandroid_restore_backup_files(backup_path, mount_point, path);
+            ret = 1;
+            break;
+        }
+    }
+    free_string_array(list);
+    free_string_array(names);
+    return ret;
+}
+
+static void show_nandroid_file_restore_menu(const char* backup_path) {
+    static const char* headers[] = { "Restore files from", "", NULL };
+    const char* mount_points[] = { "/system", "/data", "/cache", "/sd-ext", get_android_secure_path() };
+    char* list[6];
+    const char* chosen[6];
+    int count = 0;
+    int i;
+
+    // only tar backups list their files
+    for (i = 0; i < 5; i++) {
+        char** names = nandroid_list_backup_files(backup_path, mount_points[i], "");
+        if (names == NULL || names[0] == NULL) {
+            free_string_array(names);
+            continue;
+        }
+        chosen[count] = mount_points[i];
+        list[count++] = names[0];
+        free(names);
+    }
+    list[count] = NULL;
+    if (count == 0) {
+        ui_print("No file lists found in this backup.\n");
+        return;
+    }
+
+    int chosen_item = get_menu_selection(headers, list, 0, 0);
+    if (chosen_item != GO_BACK && chosen_item != REFRESH)
+        show_nandroid_file_restore_browser(backup_path, chosen[chosen_item], list[chosen_item]);
+    for (i = 0; i < count; i++)
+        free(list[i]);
+}
+
 void show_nandroid_advanced_restore_menu(const char* path) {
     if (ensure_path_mounted(path) != 0) {
         LOGE("Can't mount sdcard\n");
@@ -975,12 +1065,13 @@ void show_nandroid_advanced_restore_menu(const char* path) {
                             "Restore data",
                             "Restore cache",
                             "Restore sd-ext",
+                            "Restore selected files",
                             "Restore wimax",
                             NULL };
 
     if (0 != get_partition_device("wimax", tmp)) {
         // disable wimax restore option
-        list[5] = NULL;
+        list[6] = NULL;
     }
 
     static char* confirm_restore = "Confirm restore?";
@@ -1012,7 +1103,10 @@ void show_nandroid_advanced_restore_menu(const char* path) {
                 nandroid_restore(file, 0, 0, 0, 0, 1, 0);
             break;
         }
-        case 5: {
+        case 5:
+            show_nandroid_file_restore_menu(file);
+            break;
+        case 6: {
             if (confirm_selection(confirm_restore, "Yes - Restore wimax"))
                 nandroid_restore(file, 0, 0, 0, 0, 0, 1);
             break;
@@ -1051,20 +1145,42 @@ static void choose_default_backup_format() {
     char* list_tar_default[] = { "tar (default)",
                                  "dup",
                                  "tar + gzip",
+                                 "tar + lz4",
+                                 "incremental tar",
                                  NULL };
     char* list_dup_default[] = { "tar",
                                  "dup (default)",
                                  "tar + gzip",
+                                 "tar + lz4",
+                                 "incremental tar",
                                  NULL };
     char* list_tgz_default[] = { "tar",
                                  "dup",
                                  "tar + gzip (default)",
+                                 "tar + lz4",
+                                 "incremental tar",
+                                 NULL };
+    char* list_lz4_default[] = { "tar",
+                                 "dup",
+                                 "tar + gzip",
+                                 "tar + lz4 (default)",
+                                 "incremental tar",
+                                 NULL };
+    char* list_inc_default[] = { "tar",
+                                 "dup",
+                                 "tar + gzip",
+                                 "tar + lz4",
+                                 "incremental tar (default)",
                                  NULL };
 
     if (fmt == NANDROID_BACKUP_FORMAT_DUP) {
         list = list_dup_default;
     } else if (fmt == NANDROID_BACKUP_FORMAT_TGZ) {
         list = list_tgz_default;
+    } else if (fmt == NANDROID_BACKUP_FORMAT_LZ4) {
+        list = list_lz4_default;
+    } else if (fmt == NANDROID_BACKUP_FORMAT_INC) {
+        list = list_inc_default;
     } else {
         list = list_tar_default;
     }
@@ -1088,6 +1204,44 @@ static void choose_default_backup_format() {
             ui_print("Default backup format set to tar + gzip.\n");
             break;
         }
+        case 3: {
+            write_string_to_file(path, "lz4");
+            ui_print("Default backup format set to tar + lz4.\n");
+            break;
+        }
+        case 4: {
+            write_string_to_file(path, "inc");
+            ui_print("Default backup format set to incremental tar.\n");
+            break;
+        }
+    }
+}
+
+static void toggle_nandroid_verify_first() {
+    char path[PATH_MAX];
+    struct stat st;
+    sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_VERIFY_FIRST_FILE);
+    ensure_path_mounted(path);
+    if (stat(path, &st) == 0) {
+        unlink(path);
+        ui_print("Verify Before Restore: Disabled\n");
+    } else {
+        write_string_to_file(path, "1");
+        ui_print("Verify Before Restore: Enabled\n");
+    }
+}
+
+static void toggle_nandroid_sparse_images() {
+    char path[PATH_MAX];
+    struct stat st;
+    sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_SPARSE_IMAGES_FILE);
+    ensure_path_mounted(path);
+    if (stat(path, &st) == 0) {
+        unlink(path);
+        ui_print("Sparse Raw Images: Disabled\n");
+    } else {
+        write_string_to_file(path, "1");
+        ui_print("Sparse Raw Images: Enabled\n");
     }
 }
 
@@ -1111,7 +1265,7 @@ static void add_nandroid_options_for_volume(char** menu, char* path, int offset)
 // these go on top of menu list
 #define NANDROID_ACTIONS_NUM 4
 // number of fixed bottom entries after volume actions
-#define NANDROID_FIXED_ENTRIES 2
+#define NANDROID_FIXED_ENTRIES 4
 
 int show_nandroid_menu() {
     char* primary_path = get_primary_storage_path();
@@ -1141,6 +1295,8 @@ int show_nandroid_menu() {
     // fixed bottom entries
     list[offset] = "free unused backup data";
     list[offset + 1] = "choose default backup format";
+    list[offset + 2] = "toggle verify before restore";
+    list[offset + 3] = "toggle sparse raw images";
     offset += NANDROID_FIXED_ENTRIES;
 
 #ifdef RECOVERY_EXTEND_NANDROID_MENU
@@ -1162,6 +1318,10 @@ int show_nandroid_menu() {
             run_dedupe_gc();
         } else if (chosen_item == (action_entries_num + 1)) {
             choose_default_backup_format();
+        } else if (chosen_item == (action_entries_num + 2)) {
+            toggle_nandroid_verify_first();
+        } else if (chosen_item == (action_entries_num + 3)) {
+            toggle_nandroid_sparse_images();
         } else if (chosen_item < action_entries_num) {
             // get nandroid volume actions path
             if (chosen_item < NANDROID_ACTIONS_NUM) {
@@ -1174,6 +1334,13 @@ int show_nandroid_menu() {
             switch (chosen_subitem) {
                 case 0: {
                     char backup_path[PATH_MAX];
+                    char backup_dir[PATH_MAX];
+                    sprintf(backup_dir, "%s/clockworkmod/backup", chosen_path);
+                    if (0 == nandroid_find_interrupted_backup(backup_dir, backup_path) &&
+                            confirm_selection("Resume interrupted backup?", "Yes - Resume backup")) {
+                        nandroid_backup(backup_path);
+                        break;
+                    }
                     time_t t = time(NULL);
                     struct tm *tmp = localtime(&t);
                     if (tmp == NULL) {
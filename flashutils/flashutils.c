@@ -67,6 +67,8 @@ static int detect_partition(const char *partitionType, const char *partition)
 int restore_raw_partition(const char* partitionType, const char *partition, const char *filename)
 {
     int type = detect_partition(partitionType, partition);
+    if (is_sparse_image(filename))
+        return restore_sparse_partition(type, partition, filename);
     switch (type) {
         case MTD:
             return cmd_mtd_restore_raw_partition(partition, filename);
@@ -8,6 +8,13 @@ int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 int get_partition_device(const char *partition, char *device);
 
+// Sparse raw images leave out runs of blocks that repeat one value, such
+// as zeroed or erased space. restore_raw_partition takes them as well as
+// plain images.
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename);
+int is_sparse_image(const char* filename);
+int restore_sparse_partition(int type, const char *partition, const char *filename);
+
 #define FLASH_MTD 0
 #define FLASH_MMC 1
 #define FLASH_BML 2
@@ -0,0 +1,489 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include "flashutils/flashutils.h"
+#include "mtdutils/mtdutils.h"
+
+// Raw images are written in the android sparse format, which simg2img
+// and fastboot understand as well: a header followed by chunks of raw
+// blocks or of blocks filled with a repeated 32 bit value.
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define SPARSE_MAJOR_VERSION 1
+
+#define CHUNK_TYPE_RAW 0xCAC1
+#define CHUNK_TYPE_FILL 0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+#define CHUNK_TYPE_CRC32 0xCAC4
+
+#define SPARSE_BLOCK_SIZE 4096
+// keeps total_sz of raw chunks well inside 32 bits
+#define SPARSE_MAX_RAW_BLOCKS 16384
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} __attribute__((packed)) sparse_header;
+
+typedef struct {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+} __attribute__((packed)) chunk_header;
+
+static int read_fully(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, (char*)buf + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        done += r;
+    }
+    return done;
+}
+
+static int write_fully(int fd, const void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = write(fd, (const char*)buf + done, len - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    return 0;
+}
+
+// whether buf is one 32 bit value over and over
+static int block_fill(const char* buf, uint32_t* fill) {
+    const uint32_t* words = (const uint32_t*)buf;
+    size_t i;
+    for (i = 1; i < SPARSE_BLOCK_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != words[0])
+            return 0;
+    }
+    *fill = words[0];
+    return 1;
+}
+
+int is_sparse_image(const char* filename) {
+    sparse_header header;
+    struct stat st;
+    // peeking at a pipe, as undump restores from, would eat the header
+    if (stat(filename, &st) || !S_ISREG(st.st_mode))
+        return 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    int ret = read_fully(fd, &header, sizeof(header)) == sizeof(header) && header.magic == SPARSE_HEADER_MAGIC;
+    close(fd);
+    return ret;
+}
+
+// The partition is read by the usual backup_raw_partition of its flash
+// type, writing into a pipe that is encoded as it arrives.
+typedef struct {
+    const char* partitionType;
+    const char* partition;
+    int fd;
+    int ret;
+} raw_pipe;
+
+static void* backup_thread(void* cookie) {
+    raw_pipe* p = (raw_pipe*)cookie;
+    char path[PATH_MAX];
+    sprintf(path, "/proc/self/fd/%d", p->fd);
+    p->ret = backup_raw_partition(p->partitionType, p->partition, path);
+    close(p->fd);
+    return NULL;
+}
+
+typedef struct {
+    int fd;
+    sparse_header header;
+    chunk_header chunk;
+    // where the header of the raw chunk being written goes
+    off_t chunk_offset;
+    uint32_t fill;
+} sparse_writer;
+
+static int finish_chunk(sparse_writer* w) {
+    if (w->chunk.chunk_sz == 0)
+        return 0;
+    w->header.total_blks += w->chunk.chunk_sz;
+    w->header.total_chunks++;
+    if (w->chunk.chunk_type == CHUNK_TYPE_FILL) {
+        w->chunk.total_sz = sizeof(chunk_header) + sizeof(uint32_t);
+        if (write_fully(w->fd, &w->chunk, sizeof(chunk_header)) || write_fully(w->fd, &w->fill, sizeof(uint32_t)))
+            return -1;
+    } else {
+        w->chunk.total_sz = sizeof(chunk_header) + w->chunk.chunk_sz * SPARSE_BLOCK_SIZE;
+        if (pwrite(w->fd, &w->chunk, sizeof(chunk_header), w->chunk_offset) != sizeof(chunk_header))
+            return -1;
+    }
+    w->chunk.chunk_sz = 0;
+    return 0;
+}
+
+static int add_block(sparse_writer* w, const char* buf) {
+    uint32_t fill;
+    if (block_fill(buf, &fill)) {
+        if (w->chunk.chunk_sz != 0 && (w->chunk.chunk_type != CHUNK_TYPE_FILL || w->fill != fill) && finish_chunk(w))
+            return -1;
+        w->chunk.chunk_type = CHUNK_TYPE_FILL;
+        w->fill = fill;
+        w->chunk.chunk_sz++;
+        return 0;
+    }
+
+    if (w->chunk.chunk_sz != 0 && (w->chunk.chunk_type != CHUNK_TYPE_RAW || w->chunk.chunk_sz == SPARSE_MAX_RAW_BLOCKS) &&
+            finish_chunk(w))
+        return -1;
+    if (w->chunk.chunk_sz == 0) {
+        // the header is filled in once the run of raw blocks ends
+        w->chunk.chunk_type = CHUNK_TYPE_RAW;
+        w->chunk_offset = lseek(w->fd, 0, SEEK_CUR);
+        if (w->chunk_offset == (off_t)-1 || lseek(w->fd, sizeof(chunk_header), SEEK_CUR) == (off_t)-1)
+            return -1;
+    }
+    w->chunk.chunk_sz++;
+    return write_fully(w->fd, buf, SPARSE_BLOCK_SIZE);
+}
+
+int backup_raw_partition_sparse(const char* partitionType, const char *partition, const char *filename)
+{
+    int pipefd[2];
+    pthread_t thread;
+    raw_pipe p;
+    sparse_writer w;
+    char* buf = malloc(SPARSE_BLOCK_SIZE);
+    int ret = 0;
+    // partitions that don't end on a block boundary are saved as they are
+    int unaligned = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (buf == NULL || w.fd < 0 || pipe(pipefd) != 0) {
+        fprintf(stderr, "error opening %s\n", filename);
+        if (w.fd >= 0)
+            close(w.fd);
+        free(buf);
+        return -1;
+    }
+    w.header.magic = SPARSE_HEADER_MAGIC;
+    w.header.major_version = SPARSE_MAJOR_VERSION;
+    w.header.file_hdr_sz = sizeof(sparse_header);
+    w.header.chunk_hdr_sz = sizeof(chunk_header);
+    w.header.blk_sz = SPARSE_BLOCK_SIZE;
+    if (lseek(w.fd, sizeof(sparse_header), SEEK_SET) == (off_t)-1)
+        ret = -1;
+
+    p.partitionType = partitionType;
+    p.partition = partition;
+    p.fd = pipefd[1];
+    p.ret = -1;
+    if (pthread_create(&thread, NULL, backup_thread, &p) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        close(w.fd);
+        unlink(filename);
+        free(buf);
+        return -1;
+    }
+
+    int len;
+    while ((len = read_fully(pipefd[0], buf, SPARSE_BLOCK_SIZE)) > 0) {
+        // after an error the rest is read and dropped, so the dump can
+        // finish
+        if (ret != 0 || unaligned)
+            continue;
+        if (len < SPARSE_BLOCK_SIZE)
+            unaligned = 1;
+        else if (add_block(&w, buf))
+            ret = -1;
+    }
+    pthread_join(thread, NULL);
+    close(pipefd[0]);
+    free(buf);
+
+    if (ret == 0 && !unaligned && p.ret == 0) {
+        if (finish_chunk(&w) || pwrite(w.fd, &w.header, sizeof(sparse_header), 0) != sizeof(sparse_header) || fsync(w.fd))
+            ret = -1;
+    }
+    if (close(w.fd))
+        ret = -1;
+    if (p.ret != 0)
+        ret = p.ret;
+    if (ret != 0) {
+        fprintf(stderr, "error writing %s\n", filename);
+        unlink(filename);
+        return ret;
+    }
+    if (unaligned)
+        return backup_raw_partition(partitionType, partition, filename);
+    return 0;
+}
+
+// Writes the blocks of the image in order to out. Fill chunks go through
+// fill_blocks when it is given, which returns non-zero to have them
+// written out like the others. When stop_fill is set, writing ends at the
+// first byte of a fill of that value running to the end of the image
+// that lies on a stop_align boundary.
+typedef struct {
+    int in;
+    int out;
+    int (*fill_blocks)(int fd, uint32_t fill, uint64_t offset, uint64_t len);
+    int stop_trailing;
+    uint32_t stop_fill;
+    uint64_t stop_align;
+    int ret;
+} sparse_reader;
+
+static int write_fill(int fd, uint32_t fill, uint64_t len) {
+    uint32_t buf[SPARSE_BLOCK_SIZE / sizeof(uint32_t)];
+    size_t i;
+    for (i = 0; i < SPARSE_BLOCK_SIZE / sizeof(uint32_t); i++)
+        buf[i] = fill;
+    for (; len > 0; len -= SPARSE_BLOCK_SIZE) {
+        if (write_fully(fd, buf, SPARSE_BLOCK_SIZE))
+            return -1;
+    }
+    return 0;
+}
+
+static int expand_sparse(sparse_reader* r) {
+    sparse_header header;
+    chunk_header chunk;
+    char* buf = malloc(SPARSE_BLOCK_SIZE);
+    uint64_t offset = 0;
+    uint32_t i;
+    int ret = -1;
+
+    if (buf == NULL || read_fully(r->in, &header, sizeof(header)) != sizeof(header) ||
+            header.magic != SPARSE_HEADER_MAGIC || header.major_version != SPARSE_MAJOR_VERSION ||
+            header.file_hdr_sz < sizeof(header) || header.chunk_hdr_sz < sizeof(chunk) ||
+            header.blk_sz != SPARSE_BLOCK_SIZE) {
+        fprintf(stderr, "unsupported sparse image\n");
+        goto done;
+    }
+    if (lseek(r->in, header.file_hdr_sz, SEEK_SET) == (off_t)-1)
+        goto done;
+
+    for (i = 0; i < header.total_chunks; i++) {
+        uint32_t fill;
+        if (read_fully(r->in, &chunk, sizeof(chunk)) != sizeof(chunk) ||
+                lseek(r->in, header.chunk_hdr_sz - sizeof(chunk), SEEK_CUR) == (off_t)-1)
+            goto done;
+        uint64_t len = (uint64_t)chunk.chunk_sz * SPARSE_BLOCK_SIZE;
+        uint64_t left;
+        switch (chunk.chunk_type) {
+            case CHUNK_TYPE_RAW:
+                for (left = len; left > 0; left -= SPARSE_BLOCK_SIZE) {
+                    if (read_fully(r->in, buf, SPARSE_BLOCK_SIZE) != SPARSE_BLOCK_SIZE ||
+                            write_fully(r->out, buf, SPARSE_BLOCK_SIZE))
+                        goto done;
+                }
+                break;
+            case CHUNK_TYPE_FILL:
+                if (read_fully(r->in, &fill, sizeof(fill)) != sizeof(fill))
+                    goto done;
+                if (r->stop_trailing && fill == r->stop_fill && i == header.total_chunks - 1) {
+                    uint64_t aligned = (offset + r->stop_align - 1) / r->stop_align * r->stop_align;
+                    if (aligned < offset + len) {
+                        if (write_fill(r->out, fill, aligned - offset))
+                            goto done;
+                        ret = 0;
+                        goto done;
+                    }
+                }
+                if (r->fill_blocks != NULL && r->fill_blocks(r->out, fill, offset, len) == 0) {
+                    if (lseek(r->out, offset + len, SEEK_SET) == (off_t)-1)
+                        goto done;
+                } else if (write_fill(r->out, fill, len)) {
+                    goto done;
+                }
+                break;
+            case CHUNK_TYPE_DONT_CARE:
+                // only a seekable target can leave blocks alone
+                if (r->fill_blocks == NULL || lseek(r->out, offset + len, SEEK_SET) == (off_t)-1)
+                    goto done;
+                break;
+            case CHUNK_TYPE_CRC32:
+                if (lseek(r->in, sizeof(uint32_t), SEEK_CUR) == (off_t)-1)
+                    goto done;
+                break;
+            default:
+                fprintf(stderr, "unknown sparse chunk type %x\n", chunk.chunk_type);
+                goto done;
+        }
+        offset += len;
+    }
+    ret = 0;
+
+done:
+    free(buf);
+    return ret;
+}
+
+static int block_device_fill(int fd, uint32_t fill, uint64_t offset, uint64_t len) {
+    uint64_t range[2] = { offset, len };
+    int zeroes = 0;
+    if (fill != 0)
+        return -1;
+    // discard is only good enough when the device reads back zeroes
+    // after it
+    if (ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes && ioctl(fd, BLKDISCARD, range) == 0)
+        return 0;
+    return ioctl(fd, BLKZEROOUT, range);
+}
+
+static int restore_sparse_block_device(const char* device, const char* filename) {
+    sparse_reader r;
+    memset(&r, 0, sizeof(r));
+    r.in = open(filename, O_RDONLY);
+    if (r.in < 0) {
+        fprintf(stderr, "error opening %s\n", filename);
+        return -1;
+    }
+    r.out = open(device, O_WRONLY);
+    if (r.out < 0) {
+        fprintf(stderr, "error opening %s\n", device);
+        close(r.in);
+        return -1;
+    }
+    r.fill_blocks = block_device_fill;
+    int ret = expand_sparse(&r);
+    if (fsync(r.out))
+        ret = -1;
+    close(r.out);
+    close(r.in);
+    return ret;
+}
+
+static void* restore_thread(void* cookie) {
+    sparse_reader* r = (sparse_reader*)cookie;
+    if ((r->ret = expand_sparse(r)) != 0)
+        fprintf(stderr, "error reading sparse image\n");
+    close(r->out);
+    return NULL;
+}
+
+int restore_sparse_partition(int type, const char *partition, const char *filename)
+{
+    // emmc is written in place, leaving zeroed blocks to discard when
+    // the card can do it
+    if (type == MMC) {
+        char device[PATH_MAX];
+        if (partition[0] == '/')
+            strcpy(device, partition);
+        else if (cmd_mmc_get_partition_device(partition, device) != 0)
+            return -1;
+        return restore_sparse_block_device(device, filename);
+    }
+
+    // bml restores read the image once for each device they write, so
+    // it is expanded to a file for them
+    if (type == BML) {
+        char tmp[PATH_MAX];
+        sparse_reader r;
+        memset(&r, 0, sizeof(r));
+        strcpy(tmp, "/tmp/sparse_image.XXXXXX");
+        r.in = open(filename, O_RDONLY);
+        if (r.in < 0) {
+            fprintf(stderr, "error opening %s\n", filename);
+            return -1;
+        }
+        r.out = mkstemp(tmp);
+        if (r.out < 0) {
+            close(r.in);
+            return -1;
+        }
+        int ret = expand_sparse(&r);
+        close(r.out);
+        close(r.in);
+        if (ret == 0)
+            ret = cmd_bml_restore_raw_partition(partition, tmp);
+        unlink(tmp);
+        return ret;
+    }
+    if (type != MTD)
+        return -1;
+
+    // mtd goes through the usual restore, reading the expanded image from
+    // a pipe. The restore erases what it didn't write, so the erased
+    // blocks at the end of the image can be left out.
+    sparse_reader r;
+    int pipefd[2];
+    pthread_t thread;
+    size_t total_size, erase_size;
+    const MtdPartition* mtd;
+    memset(&r, 0, sizeof(r));
+    if (mtd_scan_partitions() > 0 && (mtd = mtd_find_partition_by_name(partition)) != NULL &&
+            mtd_partition_info(mtd, &total_size, &erase_size, NULL) == 0) {
+        r.stop_trailing = 1;
+        r.stop_fill = 0xffffffff;
+        r.stop_align = erase_size;
+    }
+    r.in = open(filename, O_RDONLY);
+    if (r.in < 0) {
+        fprintf(stderr, "error opening %s\n", filename);
+        return -1;
+    }
+    if (pipe(pipefd) != 0) {
+        close(r.in);
+        return -1;
+    }
+    r.out = pipefd[1];
+    if (pthread_create(&thread, NULL, restore_thread, &r) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        close(r.in);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    sprintf(path, "/proc/self/fd/%d", pipefd[0]);
+    int ret = cmd_mtd_restore_raw_partition(partition, path);
+
+    // whatever the restore left unread is drained so the thread can end
+    char buf[SPARSE_BLOCK_SIZE];
+    while (read_fully(pipefd[0], buf, sizeof(buf)) > 0)
+        ;
+    pthread_join(thread, NULL);
+    close(pipefd[0]);
+    close(r.in);
+    // a short image would otherwise pass for a good restore
+    if (ret == 0)
+        ret = r.ret;
+    return ret;
+}
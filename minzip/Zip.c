@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -522,12 +523,35 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * Read "count" bytes at "offset" without touching the file position,
+ * so any number of threads can read from the archive at once.  Returns
+ * the number of bytes read, which is short only at the end of the file.
+ */
+static ssize_t readAt(int fd, void *buf, size_t count, off_t offset)
+{
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = pread(fd, (char *)buf + total, count - total,
+                offset + total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
+    off_t offset = pEntry->offset;
     size_t bytesLeft = pEntry->compLen;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
@@ -539,7 +563,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
         if (count > sizeof(buf)) {
             count = sizeof(buf);
         }
-        n = read(pArchive->fd, buf, count);
+        n = readAt(pArchive->fd, buf, count, offset);
         if (n < 0 || (size_t)n != count) {
             LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
             return false;
@@ -548,6 +572,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
         if (!ret) {
             return false;
         }
+        offset += count;
         bytesLeft -= count;
     }
     return true;
@@ -563,6 +588,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     z_stream zstream;
     int zerr;
     long compRemaining;
+    off_t offset = pEntry->offset;
 
     compRemaining = pEntry->compLen;
 
@@ -605,12 +631,13 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             LOGVV("+++ reading %ld bytes (%ld left)\n",
                 getSize, compRemaining);
 
-            int cc = read(pArchive->fd, readBuf, getSize);
+            int cc = readAt(pArchive->fd, readBuf, getSize, offset);
             if (cc != (int) getSize) {
                 LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
                 goto z_bail;
             }
 
+            offset += getSize;
             compRemaining -= getSize;
 
             zstream.next_in = readBuf;
@@ -668,19 +695,15 @@ bail:
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The entry is read with positional reads and all state is local to the
+ * call, so several threads may process entries of one archive at once.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +718,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -907,6 +928,167 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* Never run more extraction threads than this, however many cpus there
+ * are; past a few the flash is the limit.
+ */
+#define MZ_EXTRACT_MAX_THREADS 8
+
+/* A regular file left for the worker pool by MZ_EXTRACT_PARALLEL.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    char *secontext;
+    int state;      // 0 while pending, 1 once extracted, -1 on failure
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzExtractJob *jobs;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int next;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} MzExtractPool;
+
+static bool addExtractJob(MzExtractPool *pool, const ZipEntry *pEntry,
+        const char *targetFile, struct selabel_handle *sehnd)
+{
+    if (pool->count == pool->capacity) {
+        unsigned int capacity = pool->capacity ? pool->capacity * 2 : 256;
+        MzExtractJob *jobs = (MzExtractJob *)realloc(pool->jobs,
+                capacity * sizeof(MzExtractJob));
+        if (jobs == NULL) {
+            return false;
+        }
+        pool->jobs = jobs;
+        pool->capacity = capacity;
+    }
+    MzExtractJob *job = &pool->jobs[pool->count];
+    job->pEntry = pEntry;
+    job->state = 0;
+    job->secontext = NULL;
+    job->targetFile = strdup(targetFile);
+    if (job->targetFile == NULL) {
+        return false;
+    }
+    /* The labels are looked up here, on one thread, and set on the file
+     * descriptors by the workers; setfscreatecon() only works for the
+     * thread that calls it.
+     */
+    if (sehnd) {
+        selabel_lookup(sehnd, &job->secontext, targetFile, UNZIP_FILEMODE);
+    }
+    pool->count++;
+    return true;
+}
+
+static bool extractJobFile(MzExtractPool *pool, MzExtractJob *job)
+{
+    int fd = creat(job->targetFile, UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                job->targetFile, strerror(errno));
+        return false;
+    }
+    if (job->secontext && fsetfilecon(fd, job->secontext) != 0) {
+        LOGE("Can't set context of \"%s\": %s\n",
+                job->targetFile, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pool->pArchive, job->pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    if (pool->timestamp != NULL && utime(job->targetFile, pool->timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", job->targetFile);
+    return true;
+}
+
+static void *extractWorker(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->failed || pool->next == pool->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        MzExtractJob *job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractJobFile(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = ok ? 1 : -1;
+        if (!ok) {
+            pool->failed = true;
+        }
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/* Extracts the pool's files on one thread per cpu, invoking the callback
+ * on the calling thread for each file in archive order as it is done.
+ */
+static bool runExtractPool(MzExtractPool *pool,
+        void (*callback)(const char *fn, void *), void *cookie)
+{
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus < 1 ? 1 :
+            (cpus > MZ_EXTRACT_MAX_THREADS ? MZ_EXTRACT_MAX_THREADS : cpus);
+    if ((unsigned int)wanted > pool->count) {
+        wanted = pool->count;
+    }
+    int started = 0;
+    while (started < wanted &&
+            pthread_create(&threads[started], NULL, extractWorker, pool) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        extractWorker(pool);
+    }
+
+    unsigned int i;
+    for (i = 0; i < pool->count; i++) {
+        MzExtractJob *job = &pool->jobs[i];
+        pthread_mutex_lock(&pool->lock);
+        while (job->state == 0 && !(pool->failed && i >= pool->next)) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        int state = job->state;
+        pthread_mutex_unlock(&pool->lock);
+        if (state != 1) {
+            break;
+        }
+        if (callback != NULL) callback(job->targetFile, cookie);
+    }
+
+    int t;
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    return !pool->failed;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -982,6 +1164,11 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 //TODO: since the entries are sorted, binary search for the first match
 //      and stop after the first non-match.
      */
+    MzExtractPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+
     unsigned int i;
     bool seenMatch = false;
     int ok = true;
@@ -1041,8 +1228,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1110,6 +1295,16 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
+            } else if (flags & MZ_EXTRACT_PARALLEL) {
+                /* The directories are all in place before the pool
+                 * starts; it invokes the callback once the file is done.
+                 */
+                if (!addExtractJob(&pool, pEntry, targetFile, sehnd)) {
+                    LOGE("Can't queue \"%s\" for extraction\n", targetFile);
+                    ok = false;
+                    break;
+                }
+                continue;
             } else {
                 /* The entry is a regular file.
                  * Open the target for writing.
@@ -1157,6 +1352,21 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && pool.count > 0) {
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.done, NULL);
+        ok = runExtractPool(&pool, callback, cookie);
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.done);
+    }
+    for (i = 0; i < pool.count; i++) {
+        free(pool.jobs[i].targetFile);
+        if (pool.jobs[i].secontext) {
+            freecon(pool.jobs[i].secontext);
+        }
+    }
+    free(pool.jobs);
+
     free(helper.buf);
     free(zpath);
 
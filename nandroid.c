@@ -17,6 +17,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
+#include <pthread.h>
 #include <signal.h>
 #include <sys/wait.h>
 
@@ -37,10 +38,17 @@
 #include "extendedcommands.h"
 #include "recovery_settings.h"
 #include "nandroid.h"
+#include "nandroid_compress.h"
+#include "nandroid_index.h"
+#include "nandroid_members.h"
+#include "nandroid_stream.h"
+#include "nandroid_tar.h"
+#include "nandroid_throttle.h"
 #include "mounts.h"
 
 #include "flashutils/flashutils.h"
 #include <libgen.h>
+#include <openssl/md5.h>
 
 void nandroid_generate_timestamp_path(char* backup_path) {
     time_t t = time(NULL) + RECOVERY_TZ_OFFSET;
@@ -55,9 +63,9 @@ void nandroid_generate_timestamp_path(char* backup_path) {
 }
 
 static void ensure_directory(const char* dir) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "mkdir -p %s && chmod 777 %s", dir, dir);
-    __system(tmp);
+    // recovery runs with a cleared umask, so the directories come out 0777
+    dirCreateHierarchy(dir, 0777, NULL, 0, NULL);
+    chmod(dir, 0777);
 }
 
 static int print_and_error(const char* message) {
@@ -65,56 +73,732 @@ static int print_and_error(const char* message) {
     return 1;
 }
 
+// Backup jobs can run side by side, so the helpers they share take
+// these locks. basename() and dirname() aren't used from the jobs either,
+// as they may return a static buffer.
+static pthread_mutex_t nandroid_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t nandroid_mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t nandroid_gc_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int nandroid_backup_bitfield = 0;
 #define NANDROID_FIELD_DEDUPE_CLEARED_SPACE 1
+// raw partitions are saved as sparse images, see flashutils
+static int nandroid_sparse_images = 0;
+static int nandroid_perf_users = 0;
+
+// Progress of all running jobs against estimates taken when each one
+// starts. tar backups count the bytes they archive, the handlers that
+// run a command count the files it prints.
+static uint64_t nandroid_bytes_total = 0;
+static uint64_t nandroid_bytes_count = 0;
 static int nandroid_files_total = 0;
 static int nandroid_files_count = 0;
+static struct timeval nandroid_progress_start;
+// the next tenth of the progress bar to print a status line at
+static int nandroid_status_step = 1;
+
+// called with nandroid_progress_lock held
+static float nandroid_progress_fraction() {
+    if (nandroid_bytes_count != 0 && nandroid_bytes_total != 0)
+        return (float)nandroid_bytes_count / (float)nandroid_bytes_total;
+    if (nandroid_files_total != 0)
+        return (float)nandroid_files_count / (float)nandroid_files_total;
+    return 0;
+}
+
 static void nandroid_callback(const char* filename) {
     if (filename == NULL)
         return;
-    const char* justfile = basename(filename);
     char tmp[PATH_MAX];
-    strcpy(tmp, justfile);
-    if (tmp[strlen(tmp) - 1] == '\n')
-        tmp[strlen(tmp) - 1] = '\0';
+    strncpy(tmp, filename, sizeof(tmp));
+    tmp[sizeof(tmp) - 1] = '\0';
+    size_t len = strlen(tmp);
+    if (len > 0 && tmp[len - 1] == '\n')
+        tmp[--len] = '\0';
+    if (len > 1 && tmp[len - 1] == '/')
+        tmp[--len] = '\0';
+    const char* justfile = strrchr(tmp, '/');
+    justfile = justfile != NULL ? justfile + 1 : tmp;
+    memmove(tmp, justfile, strlen(justfile) + 1);
     tmp[ui_get_text_cols() - 1] = '\0';
+
+    pthread_mutex_lock(&nandroid_progress_lock);
     nandroid_files_count++;
     ui_increment_frame();
     ui_nice_print("%s\n", tmp);
-    if (!ui_was_niced() && nandroid_files_total != 0)
-        ui_set_progress((float)nandroid_files_count / (float)nandroid_files_total);
+    if (!ui_was_niced() && (nandroid_files_total != 0 || nandroid_bytes_total != 0))
+        ui_set_progress(nandroid_progress_fraction());
     if (!ui_was_niced())
         ui_delete_line();
+    pthread_mutex_unlock(&nandroid_progress_lock);
 }
 
-static void compute_directory_stats(const char* directory) {
-    char tmp[PATH_MAX];
-    char count_text[100];
-
-    // reset file count if we ever return before setting it
+// Starts a new progress bar. Jobs that overlap share one bar, so this
+// is only done when nothing else is running.
+static void nandroid_progress_reset() {
+    pthread_mutex_lock(&nandroid_progress_lock);
+    nandroid_bytes_count = 0;
+    nandroid_bytes_total = 0;
     nandroid_files_count = 0;
     nandroid_files_total = 0;
+    nandroid_status_step = 1;
+    gettimeofday(&nandroid_progress_start, NULL);
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+    pthread_mutex_unlock(&nandroid_progress_lock);
+}
 
-    sprintf(tmp, "find %s | %s wc -l > /tmp/dircount", directory, strcmp(directory, "/data") == 0 && is_data_media() ? "grep -v /data/media |" : "");
-    __system(tmp);
+// set_perf_mode() for jobs that may overlap
+static void nandroid_perf_mode(int on) {
+    pthread_mutex_lock(&nandroid_progress_lock);
+    if (on ? nandroid_perf_users++ == 0 : --nandroid_perf_users == 0)
+        set_perf_mode(on);
+    pthread_mutex_unlock(&nandroid_progress_lock);
+}
+
+// Space and inodes taken by the files under name, not crossing into
+// other mounts.
+static uint64_t nandroid_disk_usage(int parent, const char* name, dev_t dev, int* files) {
+    struct stat st;
+    if (fstatat(parent, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || st.st_dev != dev)
+        return 0;
+    uint64_t size = (uint64_t)st.st_blocks * 512;
+    (*files)++;
+    if (!S_ISDIR(st.st_mode))
+        return size;
+
+    int fd = openat(parent, name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return size;
+    DIR* d = fdopendir(fd);
+    if (d == NULL) {
+        close(fd);
+        return size;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            size += nandroid_disk_usage(fd, de->d_name, dev, files);
+    }
+    closedir(d);
+    return size;
+}
+
+// Guesses how much a backup of directory will hold from the used blocks
+// and inodes of its filesystem, rather than walking all of it first.
+static void nandroid_estimate(const char* directory, uint64_t* bytes, int* files) {
+    struct statfs s;
+    *bytes = 0;
+    *files = 0;
+    if (statfs(directory, &s) != 0)
+        return;
+    *bytes = (uint64_t)(s.f_blocks - s.f_bfree) * s.f_bsize;
+    *files = s.f_files > s.f_ffree ? s.f_files - s.f_ffree : 0;
+
+    // the internal storage shares /data but is not part of its backup
+    struct stat st;
+    if (strcmp(directory, "/data") == 0 && is_data_media() && stat(directory, &st) == 0) {
+        int media_files = 0;
+        uint64_t media = nandroid_disk_usage(AT_FDCWD, "/data/media", st.st_dev, &media_files);
+        *bytes = *bytes > media ? *bytes - media : 0;
+        *files = *files > media_files ? *files - media_files : 0;
+    }
+}
+
+// For the handlers that only report file names.
+static void nandroid_estimate_files(const char* directory) {
+    uint64_t bytes;
+    int files;
+    nandroid_estimate(directory, &bytes, &files);
+    pthread_mutex_lock(&nandroid_progress_lock);
+    nandroid_files_total += files;
+    pthread_mutex_unlock(&nandroid_progress_lock);
+}
+
+// Moves the bar by len bytes. With status set, every tenth of the way
+// also prints the throughput and the time left.
+static void nandroid_progress_bytes(size_t len, int status) {
+    pthread_mutex_lock(&nandroid_progress_lock);
+    nandroid_bytes_count += len;
+    float fraction = nandroid_progress_fraction();
+    ui_set_progress(fraction);
+    if (status && nandroid_bytes_total != 0 && fraction * 10 >= nandroid_status_step && nandroid_status_step < 10) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long ms = (now.tv_sec - nandroid_progress_start.tv_sec) * 1000 + (now.tv_usec - nandroid_progress_start.tv_usec) / 1000;
+        uint64_t rate = ms > 0 ? nandroid_bytes_count * 1000 / ms : 0;
+        uint64_t left = nandroid_bytes_total > nandroid_bytes_count ? nandroid_bytes_total - nandroid_bytes_count : 0;
+        long eta = rate > 0 ? (long)(left / rate) : 0;
+        ui_print("%d%%: %lluMB at %lluMB/s, about %ld:%02ld left\n", (int)(fraction * 100),
+                (unsigned long long)(nandroid_bytes_count >> 20), (unsigned long long)(rate >> 20), eta / 60, eta % 60);
+        nandroid_status_step = (int)(fraction * 10) + 1;
+    }
+    pthread_mutex_unlock(&nandroid_progress_lock);
+}
+
+// Counts the archive bytes on their way to next. The estimate for the
+// directory, if one is given, is added to the total when opened and
+// swapped for the actual size on close.
+typedef struct {
+    nandroid_sink sink;
+    nandroid_sink* next;
+    uint64_t estimate;
+    uint64_t written;
+    int estimated;
+    int status;
+} progress_sink;
+
+static int progress_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    progress_sink* s = (progress_sink*)sink;
+    nandroid_throttle(len);
+    int ret = s->next->write(s->next, data, len);
+    s->written += len;
+    nandroid_progress_bytes(len, s->status);
+    return ret;
+}
+
+static int progress_sink_close(nandroid_sink* sink) {
+    progress_sink* s = (progress_sink*)sink;
+    int ret = s->next->close(s->next);
+    if (s->estimated) {
+        pthread_mutex_lock(&nandroid_progress_lock);
+        nandroid_bytes_total += s->written;
+        nandroid_bytes_total = nandroid_bytes_total > s->estimate ? nandroid_bytes_total - s->estimate : 0;
+        pthread_mutex_unlock(&nandroid_progress_lock);
+    }
+    free(s);
+    return ret;
+}
+
+static nandroid_sink* progress_sink_open(nandroid_sink* next, const char* directory, int status) {
+    if (next == NULL)
+        return NULL;
+    progress_sink* s = calloc(1, sizeof(progress_sink));
+    if (s == NULL)
+        return next;
+    int files;
+    s->sink.write = progress_sink_write;
+    s->sink.close = progress_sink_close;
+    s->next = next;
+    s->status = status;
+    if (directory != NULL) {
+        nandroid_estimate(directory, &s->estimate, &files);
+        s->estimated = 1;
+        pthread_mutex_lock(&nandroid_progress_lock);
+        nandroid_bytes_total += s->estimate;
+        pthread_mutex_unlock(&nandroid_progress_lock);
+    }
+    return &s->sink;
+}
+
+// Checksums of backup files computed while they were written, so
+// nandroid.md5 doesn't have to read them all back.
+typedef struct nandroid_md5 {
+    struct nandroid_md5* next;
+    char name[NAME_MAX + 1];
+    uint64_t size;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+} nandroid_md5;
+
+static nandroid_md5* nandroid_md5_list = NULL;
+// guards the lists of checksums and the checkpoint
+static pthread_mutex_t nandroid_md5_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// An interrupted backup is resumed from its nandroid.checkpoint, which
+// lists every volume with its checksum as soon as it is complete, and
+// every partition with the number of its files once they all are.
+#define NANDROID_CHECKPOINT_FILE "nandroid.checkpoint"
+static int nandroid_checkpoint_fd = -1;
+// Files left by the interrupted backup that still match the checkpoint,
+// and the partitions it finished, with their file count as the size.
+static nandroid_md5* nandroid_resume_files = NULL;
+static nandroid_md5* nandroid_resume_done = NULL;
+
+static nandroid_md5* nandroid_md5_find(nandroid_md5* list, const char* name) {
+    for (; list != NULL; list = list->next) {
+        if (strcmp(list->name, name) == 0)
+            return list;
+    }
+    return NULL;
+}
+
+// Adds or replaces the entry for name. md5 may be NULL.
+static void nandroid_md5_add(nandroid_md5** list, const char* name, uint64_t size, const unsigned char* md5) {
+    nandroid_md5* entry = nandroid_md5_find(*list, name);
+    if (entry == NULL) {
+        if ((entry = malloc(sizeof(nandroid_md5))) == NULL)
+            return;
+        strncpy(entry->name, name, sizeof(entry->name));
+        entry->name[sizeof(entry->name) - 1] = '\0';
+        entry->next = *list;
+        *list = entry;
+    }
+    entry->size = size;
+    if (md5 != NULL)
+        memcpy(entry->md5, md5, MD5_DIGEST_LENGTH);
+    else
+        memset(entry->md5, 0, MD5_DIGEST_LENGTH);
+}
+
+static void nandroid_md5_free(nandroid_md5** list) {
+    while (*list != NULL) {
+        nandroid_md5* next = (*list)->next;
+        free(*list);
+        *list = next;
+    }
+}
+
+static void md5_hex(const unsigned char* md5, char* hex) {
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", md5[i]);
+}
+
+static int md5_parse(const char* hex, unsigned char* md5) {
+    int i;
+    unsigned int byte;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return -1;
+        md5[i] = byte;
+    }
+    return 0;
+}
+
+// Appends a record to the checkpoint, with nandroid_md5_lock held. Each
+// one is synced, so pulling the battery loses no more than the last.
+static void nandroid_checkpoint_write(const char* record) {
+    size_t len = strlen(record);
+    if (nandroid_checkpoint_fd < 0)
+        return;
+    if (write(nandroid_checkpoint_fd, record, len) != (ssize_t)len || fsync(nandroid_checkpoint_fd))
+        LOGW("Unable to update the backup checkpoint\n");
+}
+
+static void nandroid_md5_callback(const char* path, uint64_t size, const unsigned char* md5) {
+    char record[NAME_MAX + 64];
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+    const char* name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    md5_hex(md5, hex);
+    snprintf(record, sizeof(record), "file %s %llu %s\n", hex, (unsigned long long)size, name);
+
+    pthread_mutex_lock(&nandroid_md5_lock);
+    nandroid_md5_add(&nandroid_md5_list, name, size, md5);
+    nandroid_checkpoint_write(record);
+    pthread_mutex_unlock(&nandroid_md5_lock);
+}
+
+static void nandroid_md5_clear() {
+    pthread_mutex_lock(&nandroid_md5_lock);
+    nandroid_md5_free(&nandroid_md5_list);
+    pthread_mutex_unlock(&nandroid_md5_lock);
+}
+
+static int md5_file(const char* path, unsigned char* md5) {
+    char buf[64 * 1024];
+    MD5_CTX ctx;
+    ssize_t len;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    MD5_Init(&ctx);
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        MD5_Update(&ctx, buf, len);
+    close(fd);
+    MD5_Final(md5, &ctx);
+    return len < 0 ? -1 : 0;
+}
 
-    FILE* f = fopen("/tmp/dircount", "r");
+// Whether file is one of the files the backup of partition name wrote.
+static int nandroid_partition_file(const char* file, const char* name) {
+    size_t len = strlen(name);
+    return strncmp(file, name, len) == 0 && file[len] == '.';
+}
+
+// Reads the checkpoint of an interrupted backup, keeping the files that
+// still match it. Everything else in the backup is removed, so nothing
+// is left over from the work that is done again. Returns 0 if there is
+// nothing to resume.
+static int nandroid_checkpoint_load(const char* backup_path) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    unsigned char file_md5[MD5_DIGEST_LENGTH];
+    nandroid_md5* listed = NULL;
+    nandroid_md5* entry;
+    struct stat st;
+    int format = -1;
+
+    sprintf(path, "%s/%s", backup_path, NANDROID_CHECKPOINT_FILE);
+    FILE* f = fopen(path, "r");
     if (f == NULL)
+        return 0;
+    pthread_mutex_lock(&nandroid_md5_lock);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long size;
+        int count;
+        int offset = -1;
+        size_t len = strlen(line);
+        // a record without its newline was cut short
+        if (len == 0 || line[len - 1] != '\n')
+            continue;
+        line[--len] = '\0';
+        if (sscanf(line, "format %d", &format) == 1)
+            continue;
+        if (sscanf(line, "done %s %d", path, &count) == 2)
+            nandroid_md5_add(&nandroid_resume_done, path, count, NULL);
+        else if (sscanf(line, "file %32s %llu %n", hex, &size, &offset) == 2 && offset > 0 && md5_parse(hex, md5) == 0)
+            nandroid_md5_add(&listed, line + offset, size, md5);
+    }
+    pthread_mutex_unlock(&nandroid_md5_lock);
+    fclose(f);
+
+    if (format != (int)nandroid_get_default_backup_format()) {
+        ui_print("The backup format has changed since, starting over.\n");
+        nandroid_md5_free(&listed);
+        nandroid_md5_free(&nandroid_resume_done);
+    }
+    else {
+        ui_print("Checking the interrupted backup...\n");
+    }
+
+    int kept = 0;
+    for (entry = listed; entry != NULL; entry = entry->next) {
+        sprintf(path, "%s/%s", backup_path, entry->name);
+        if (stat(path, &st) != 0 || (uint64_t)st.st_size != entry->size || md5_file(path, file_md5) ||
+                memcmp(file_md5, entry->md5, MD5_DIGEST_LENGTH) != 0)
+            continue;
+        pthread_mutex_lock(&nandroid_md5_lock);
+        nandroid_md5_add(&nandroid_resume_files, entry->name, entry->size, entry->md5);
+        pthread_mutex_unlock(&nandroid_md5_lock);
+        kept++;
+    }
+    nandroid_md5_free(&listed);
+
+    DIR* d = opendir(backup_path);
+    struct dirent* de;
+    while (d != NULL && (de = readdir(d)) != NULL) {
+        sprintf(path, "%s/%s", backup_path, de->d_name);
+        if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode) || strcmp(de->d_name, NANDROID_CHECKPOINT_FILE) == 0 ||
+                nandroid_md5_find(nandroid_resume_files, de->d_name) != NULL)
+            continue;
+        unlink(path);
+    }
+    if (d != NULL)
+        closedir(d);
+    return kept > 0;
+}
+
+// Starts the checkpoint of a backup, resuming the one there is if the
+// backup was interrupted.
+static void nandroid_checkpoint_open(const char* backup_path) {
+    char path[PATH_MAX];
+    char record[64];
+    struct stat st;
+
+    sprintf(path, "%s/nandroid.md5", backup_path);
+    int resume = stat(path, &st) != 0;
+    sprintf(path, "%s/%s", backup_path, NANDROID_CHECKPOINT_FILE);
+    if (resume && stat(path, &st) == 0) {
+        ui_print("Resuming interrupted backup...\n");
+        resume = nandroid_checkpoint_load(backup_path);
+    }
+    else {
+        resume = 0;
+    }
+
+    nandroid_checkpoint_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0666);
+    if (nandroid_checkpoint_fd < 0) {
+        LOGW("Unable to create %s, the backup can't be resumed\n", path);
         return;
+    }
+    if (!resume) {
+        sprintf(record, "format %u\n", nandroid_get_default_backup_format());
+        pthread_mutex_lock(&nandroid_md5_lock);
+        nandroid_checkpoint_write(record);
+        pthread_mutex_unlock(&nandroid_md5_lock);
+    }
+}
 
-    if (fgets(count_text, sizeof(count_text), f) == NULL) {
-        fclose(f);
+// Ends the checkpoint, removing it once the backup is complete.
+static void nandroid_checkpoint_close(const char* backup_path, int complete) {
+    char path[PATH_MAX];
+    if (nandroid_checkpoint_fd >= 0)
+        close(nandroid_checkpoint_fd);
+    nandroid_checkpoint_fd = -1;
+    if (complete) {
+        sprintf(path, "%s/%s", backup_path, NANDROID_CHECKPOINT_FILE);
+        unlink(path);
+    }
+    nandroid_md5_free(&nandroid_resume_files);
+    nandroid_md5_free(&nandroid_resume_done);
+}
+
+// A nandroid_resume_callback for the volumes of the interrupted backup.
+static int nandroid_resume_volume(const char* path, uint64_t* size, unsigned char* md5) {
+    const char* name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    pthread_mutex_lock(&nandroid_md5_lock);
+    nandroid_md5* entry = nandroid_md5_find(nandroid_resume_files, name);
+    if (entry != NULL) {
+        *size = entry->size;
+        memcpy(md5, entry->md5, MD5_DIGEST_LENGTH);
+    }
+    pthread_mutex_unlock(&nandroid_md5_lock);
+    return entry != NULL;
+}
+
+// Whether the interrupted backup finished partition name and all of its
+// files are still there. Their checksums go back in the list for
+// nandroid.md5.
+static int nandroid_checkpoint_done(const char* name) {
+    nandroid_md5* entry;
+    int count = 0;
+    pthread_mutex_lock(&nandroid_md5_lock);
+    nandroid_md5* done = nandroid_md5_find(nandroid_resume_done, name);
+    for (entry = nandroid_resume_files; done != NULL && entry != NULL; entry = entry->next) {
+        if (nandroid_partition_file(entry->name, name))
+            count++;
+    }
+    if (done != NULL && count == (int)done->size) {
+        for (entry = nandroid_resume_files; entry != NULL; entry = entry->next) {
+            if (nandroid_partition_file(entry->name, name))
+                nandroid_md5_add(&nandroid_md5_list, entry->name, entry->size, entry->md5);
+        }
+    }
+    pthread_mutex_unlock(&nandroid_md5_lock);
+    return done != NULL && count == (int)done->size;
+}
+
+// Records that partition name is backed up, with the checksums of the
+// files that don't have one yet, like raw images.
+static void nandroid_checkpoint_partition(const char* backup_path, const char* name) {
+    char path[PATH_MAX];
+    char record[NAME_MAX + 32];
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    struct stat st;
+    int count = 0;
+
+    if (nandroid_checkpoint_fd < 0)
+        return;
+    DIR* d = opendir(backup_path);
+    if (d == NULL)
+        return;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        sprintf(path, "%s/%s", backup_path, de->d_name);
+        if (!nandroid_partition_file(de->d_name, name) || lstat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        count++;
+        pthread_mutex_lock(&nandroid_md5_lock);
+        nandroid_md5* entry = nandroid_md5_find(nandroid_md5_list, de->d_name);
+        int listed = entry != NULL && entry->size == (uint64_t)st.st_size;
+        pthread_mutex_unlock(&nandroid_md5_lock);
+        if (!listed) {
+            if (md5_file(path, md5)) {
+                closedir(d);
+                return;
+            }
+            nandroid_md5_callback(path, st.st_size, md5);
+        }
+    }
+    closedir(d);
+
+    snprintf(record, sizeof(record), "done %s %d\n", name, count);
+    pthread_mutex_lock(&nandroid_md5_lock);
+    nandroid_checkpoint_write(record);
+    pthread_mutex_unlock(&nandroid_md5_lock);
+}
+
+// Drops what the interrupted backup left of partition name, returning
+// whether there was anything.
+static int nandroid_checkpoint_forget(const char* backup_path, const char* name) {
+    char path[PATH_MAX];
+    nandroid_md5** entry;
+    int found = 0;
+    pthread_mutex_lock(&nandroid_md5_lock);
+    for (entry = &nandroid_resume_files; *entry != NULL;) {
+        if (!nandroid_partition_file((*entry)->name, name)) {
+            entry = &(*entry)->next;
+            continue;
+        }
+        nandroid_md5* forgotten = *entry;
+        sprintf(path, "%s/%s", backup_path, forgotten->name);
+        unlink(path);
+        *entry = forgotten->next;
+        free(forgotten);
+        found = 1;
+    }
+    pthread_mutex_unlock(&nandroid_md5_lock);
+    return found;
+}
+
+// Writes nandroid.md5 in md5sum format. Files without a checksum from
+// the writers, like raw partition images and dedupe manifests, are read
+// back here.
+static int nandroid_write_md5(const char* backup_path) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct dirent** names;
+    struct stat st;
+    int ret = 0;
+    int i;
+
+    int count = scandir(backup_path, &names, NULL, alphasort);
+    if (count < 0)
+        return -1;
+    sprintf(tmp, "%s/nandroid.md5.tmp", backup_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL)
+        ret = -1;
+
+    for (i = 0; i < count; i++) {
+        const char* name = names[i]->d_name;
+        sprintf(path, "%s/%s", backup_path, name);
+        if (ret || lstat(path, &st) || !S_ISREG(st.st_mode) ||
+                strcmp(name, "nandroid.md5") == 0 || strcmp(name, "nandroid.md5.tmp") == 0 ||
+                strcmp(name, NANDROID_CHECKPOINT_FILE) == 0) {
+            free(names[i]);
+            continue;
+        }
+
+        const unsigned char* md5 = NULL;
+        unsigned char file_md5[MD5_DIGEST_LENGTH];
+        nandroid_md5* entry;
+        pthread_mutex_lock(&nandroid_md5_lock);
+        for (entry = nandroid_md5_list; entry != NULL; entry = entry->next) {
+            if (strcmp(entry->name, name) == 0 && entry->size == (uint64_t)st.st_size) {
+                md5 = entry->md5;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&nandroid_md5_lock);
+        if (md5 == NULL) {
+            if (md5_file(path, file_md5)) {
+                ui_print("Unable to read %s\n", path);
+                ret = -1;
+            }
+            md5 = file_md5;
+        }
+
+        int j;
+        for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+            fprintf(f, "%02x", md5[j]);
+        fprintf(f, "  %s\n", name);
+        free(names[i]);
+    }
+    free(names);
+
+    if (f != NULL && fclose(f))
+        ret = -1;
+    if (ret == 0) {
+        sprintf(path, "%s/nandroid.md5", backup_path);
+        ret = rename(tmp, path);
+    }
+    else {
+        unlink(tmp);
+    }
+    return ret;
+}
+
+// The writers create everything in a backup readable and writable by
+// all, so this only catches files left behind with narrower modes, like
+// those of an older recovery picked up by a resumed backup. It stays
+// within backup_path, so it costs the same however many backups and
+// blobs are kept next to it.
+static void nandroid_fix_permissions(const char* backup_path) {
+    char path[PATH_MAX];
+    struct stat st;
+    struct dirent* de;
+
+    chmod(backup_path, 0777);
+    DIR* dir = opendir(backup_path);
+    if (dir == NULL)
         return;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        sprintf(path, "%s/%s", backup_path, de->d_name);
+        if (lstat(path, &st))
+            continue;
+        mode_t mode = S_ISDIR(st.st_mode) ? 0777 : 0666;
+        if ((S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) && (st.st_mode & mode) != mode)
+            chmod(path, (st.st_mode & 07777) | mode);
     }
+    closedir(dir);
+}
+
+// Set while a restore checks the backup files as it reads them.
+static int nandroid_verify_inline = 0;
+
+static int nandroid_load_md5(const char* backup_path) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    unsigned char md5[MD5_DIGEST_LENGTH];
 
-    size_t len = strlen(count_text);
-    if (count_text[len - 1] == '\n')
-        count_text[len - 1] = '\0';
+    nandroid_md5_clear();
+    sprintf(path, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
 
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        // "<md5>  <name>" as md5sum writes it
+        if (md5_parse(line, md5) || len < MD5_DIGEST_LENGTH * 2 + 3 || line[MD5_DIGEST_LENGTH * 2] != ' ') {
+            ret = -1;
+            break;
+        }
+        const char* name = line + MD5_DIGEST_LENGTH * 2 + 2;
+        pthread_mutex_lock(&nandroid_md5_lock);
+        nandroid_md5_add(&nandroid_md5_list, name, 0, md5);
+        pthread_mutex_unlock(&nandroid_md5_lock);
+    }
     fclose(f);
-    nandroid_files_total = atoi(count_text);
-    ui_reset_progress();
-    ui_show_progress(1, 0);
+    if (ret)
+        nandroid_md5_clear();
+    return ret;
+}
+
+// Checks a backup file against nandroid.md5. Files it doesn't list pass,
+// as they did with md5sum -c.
+static int nandroid_verify_md5(const char* path, const unsigned char* md5) {
+    const char* name = strrchr(path, '/');
+    nandroid_md5* entry;
+    int ret = 0;
+
+    name = name != NULL ? name + 1 : path;
+    pthread_mutex_lock(&nandroid_md5_lock);
+    for (entry = nandroid_md5_list; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            ret = memcmp(entry->md5, md5, MD5_DIGEST_LENGTH) != 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nandroid_md5_lock);
+    if (ret)
+        ui_print("MD5 mismatch on %s!\n", name);
+    return ret;
+}
+
+// Checks a file that is restored by something other than the in-process
+// tar reader before it is used.
+static int nandroid_verify_file(const char* path) {
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    if (!nandroid_verify_inline)
+        return 0;
+    if (md5_file(path, md5)) {
+        ui_print("Unable to read %s\n", path);
+        return -1;
+    }
+    return nandroid_verify_md5(path, md5);
 }
 
 typedef void (*file_event_callback)(const char* filename);
@@ -123,6 +807,7 @@ typedef int (*nandroid_backup_handler)(const char* backup_path, const char* back
 static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
     sprintf(tmp, "cd %s ; mkyaffs2image . %s.img ; exit $?", backup_path, backup_file_image);
+    nandroid_estimate_files(backup_path);
 
     FILE *fp = __popen(tmp, "r");
     if (fp == NULL) {
@@ -139,53 +824,281 @@ static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_fil
     return __pclose(fp);
 }
 
-static int do_tar_compress(char* command, int callback) {
-    char buf[PATH_MAX];
+// Archives backup_path into out, leaving out what filter says to if one
+// is given.
+static int do_tar_compress_filtered(const char* backup_path, nandroid_sink* out, int callback, nandroid_tar_filter filter, void* cookie) {
+    char dir[PATH_MAX];
+    char name[PATH_MAX];
+    const char* excludes[3];
+    int count = 0;
+    int flags = 0;
+    char backup_xattrs[PROPERTY_VALUE_MAX];
 
-    set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar command!\n");
-        set_perf_mode(0);
+    if (out == NULL) {
+        ui_print("Unable to open backup output!\n");
         return -1;
     }
 
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
-        if (callback)
-            nandroid_callback(buf);
-    }
+    strcpy(dir, backup_path);
+    char* slash = strrchr(dir, '/');
+    strcpy(name, slash != NULL ? slash + 1 : dir);
+    if (slash == dir)
+        strcpy(dir, "/");
+    else if (slash != NULL)
+        *slash = '\0';
+    else
+        strcpy(dir, ".");
+
+    excludes[count++] = "data/data/com.google.android.music/files/*";
+    if (strcmp(backup_path, "/data") == 0 && is_data_media())
+        excludes[count++] = "data/media";
+    excludes[count] = NULL;
+
+    // busybox tar ignores pax records on restore, so labels are only
+    // stored when the device asks for them
+    property_get("ro.cwm.backup_xattrs", backup_xattrs, "false");
+    if (strcmp(backup_xattrs, "true") == 0)
+        flags |= TAR_SELINUX;
+
+    // how much of the partition a filtered backup stores isn't known
+    // up front, so its progress goes by files instead
+    if (filter != NULL)
+        nandroid_estimate_files(backup_path);
+    out = progress_sink_open(out, filter == NULL ? backup_path : NULL, callback);
+    nandroid_perf_mode(1);
+    int ret = tar_create_filtered(out, dir, name, excludes, flags, callback ? nandroid_callback : NULL, filter, cookie);
+    if (out->close(out) && ret == 0)
+        ret = -1;
+    nandroid_perf_mode(0);
+    return ret;
+}
 
-    set_perf_mode(0);
-    return __pclose(fp);
+static int do_tar_compress(const char* backup_path, nandroid_sink* out, int callback) {
+    return do_tar_compress_filtered(backup_path, out, callback, NULL, NULL);
 }
 
-static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+// Archives backup_path into the volumes of image, listing its members
+// next to it so single files can be restored from it later.
+static int do_tar_compress_indexed(const char* backup_path, const char* image, int codec, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar ; (tar cv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude 'media'" : "", backup_path, backup_file_image);
+    // restore looks for the empty image file to pick the format
+    close(creat(image, 0666));
+
+    sprintf(tmp, "%s.members", image);
+    members_writer* members = members_writer_open(tmp, NANDROID_VOLUME_SIZE);
+    if (members == NULL)
+        LOGW("Unable to write %s\n", tmp);
+
+    sprintf(tmp, "%s.", image);
+    nandroid_sink* out = volume_sink_open(tmp, NANDROID_VOLUME_SIZE, nandroid_md5_callback, nandroid_resume_volume);
+    if (codec != NANDROID_CODEC_NONE)
+        out = compress_sink_open(out, codec, members != NULL ? members_seek : NULL, members);
+    int ret = do_tar_compress(backup_path, members_sink_open(out, members), callback);
+    // the backup is good without its member list
+    if (members_writer_close(members, ret == 0))
+        LOGW("Unable to list the files of %s\n", image);
+    return ret;
+}
 
-    return do_tar_compress(tmp, callback);
+static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s.tar", backup_file_image);
+    return do_tar_compress_indexed(backup_path, tmp, NANDROID_CODEC_NONE, callback);
 }
 
 static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar.gz ; (tar cv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | pigz -c | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.gz.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude 'media'" : "", backup_path, backup_file_image);
+    sprintf(tmp, "%s.tar.gz", backup_file_image);
+    return do_tar_compress_indexed(backup_path, tmp, NANDROID_CODEC_GZIP, callback);
+}
 
-    return do_tar_compress(tmp, callback);
+static int tar_lz4_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s.tar.lz4", backup_file_image);
+    return do_tar_compress_indexed(backup_path, tmp, NANDROID_CODEC_LZ4, callback);
 }
 
 static int tar_dump_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    return do_tar_compress(backup_path, fd_sink_open(STDOUT_FILENO), 0);
+}
+
+// Incremental backups only store what changed since the newest complete
+// backup of the same partition in a directory next to theirs, which may
+// be incremental too. Besides the <image>.inc tar, every backup keeps
+// an <image>.idx of the partition to compare the next one against, and
+// all but the full backup at the start of a chain have an <image>.del
+// naming their base on the first line, followed by what was deleted
+// since.
+#define NANDROID_INC_MAX_CHAIN 8
+
+// Splits <parent>/<backup>/<file> so parent holds <parent>, backup
+// <backup> and file points into image.
+static int nandroid_inc_split(const char* image, char* parent, char* backup, const char** file) {
+    const char* slash = strrchr(image, '/');
+    if (slash == NULL)
+        return -1;
+    *file = slash + 1;
+    memcpy(parent, image, slash - image);
+    parent[slash - image] = '\0';
+    char* dir = strrchr(parent, '/');
+    if (dir == NULL)
+        return -1;
+    strcpy(backup, dir + 1);
+    *dir = '\0';
+    return 0;
+}
+
+// Reads the base image of an incremental one. Returns 0 for a full
+// backup, 1 if it has a base and -1 on error.
+static int nandroid_inc_base(const char* image, char* base) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s); tar cv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) 2> /dev/null | cat", backup_path, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude 'media'" : "", backup_path);
+    char line[PATH_MAX];
+    char parent[PATH_MAX];
+    char backup[PATH_MAX];
+    const char* file;
 
-    return __system(tmp);
+    sprintf(tmp, "%s.del", image);
+    FILE* f = fopen(tmp, "r");
+    if (f == NULL)
+        return errno == ENOENT ? 0 : -1;
+    int ret = -1;
+    if (fgets(line, sizeof(line), f) != NULL && strncmp(line, "base\t", 5) == 0 &&
+            nandroid_inc_split(image, parent, backup, &file) == 0) {
+        size_t len = strlen(line);
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        snprintf(base, PATH_MAX, "%s/%s/%s", parent, line + 5, file);
+        ret = 1;
+    }
+    fclose(f);
+    return ret;
+}
+
+// Follows the bases of image back to its full backup. chain, if given,
+// gets image and each of its bases, newest first. Returns how many there
+// are, or -1 if one of them is missing.
+static int nandroid_inc_chain(const char* image, char chain[][PATH_MAX]) {
+    char current[PATH_MAX];
+    char base[PATH_MAX];
+    struct stat st;
+    int count = 1;
+
+    strcpy(current, image);
+    if (chain != NULL)
+        strcpy(chain[0], image);
+    for (;;) {
+        int ret = nandroid_inc_base(current, base);
+        if (ret == 0)
+            return count;
+        if (ret < 0 || count == NANDROID_INC_MAX_CHAIN) {
+            ui_print("Unable to find the base of %s\n", current);
+            return -1;
+        }
+        sprintf(current, "%s.inc", base);
+        if (stat(current, &st) != 0) {
+            ui_print("Base backup %s is missing!\n", base);
+            return -1;
+        }
+        strcpy(current, base);
+        if (chain != NULL)
+            strcpy(chain[count], base);
+        count++;
+    }
+}
+
+// Finds the newest complete backup next to the one image is part of
+// that indexed the same partition. Its directory name goes in backup.
+static int nandroid_inc_find_base(const char* image, char* base, char* backup) {
+    char parent[PATH_MAX];
+    char own[PATH_MAX];
+    char tmp[PATH_MAX];
+    const char* file;
+    struct stat st;
+    time_t newest = 0;
+    int found = 0;
+
+    if (nandroid_inc_split(image, parent, own, &file))
+        return -1;
+    DIR* d = opendir(parent);
+    if (d == NULL)
+        return -1;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, own) == 0)
+            continue;
+        // nandroid.md5 is written once a backup has finished
+        snprintf(tmp, sizeof(tmp), "%s/%s/nandroid.md5", parent, de->d_name);
+        if (stat(tmp, &st) != 0)
+            continue;
+        snprintf(tmp, sizeof(tmp), "%s/%s/%s.idx", parent, de->d_name, file);
+        if (stat(tmp, &st) != 0 || (found && st.st_mtime < newest))
+            continue;
+        snprintf(base, PATH_MAX, "%s/%s/%s", parent, de->d_name, file);
+        strcpy(backup, de->d_name);
+        newest = st.st_mtime;
+        found = 1;
+    }
+    closedir(d);
+    return found ? 0 : -1;
+}
+
+static int incremental_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    char base[PATH_MAX];
+    char base_backup[PATH_MAX];
+    index_builder builder;
+    const char* name = strrchr(backup_path, '/');
+    name = name != NULL ? name + 1 : backup_path;
+
+    memset(&builder, 0, sizeof(builder));
+    if (nandroid_inc_find_base(backup_file_image, base, base_backup) == 0) {
+        int depth = nandroid_inc_chain(base, NULL);
+        if (depth > 0 && depth < NANDROID_INC_MAX_CHAIN) {
+            sprintf(tmp, "%s.idx", base);
+            builder.previous = index_load(tmp);
+        }
+    }
+    if (builder.previous != NULL)
+        ui_print("Storing changes to %s since %s...\n", name, base_backup);
+    else
+        ui_print("Storing all of %s for later backups to build on...\n", name);
+
+    sprintf(tmp, "%s.idx", backup_file_image);
+    builder.out = fopen(tmp, "w");
+    if (builder.out == NULL) {
+        ui_print("Unable to write %s\n", tmp);
+        index_free(builder.previous);
+        return -1;
+    }
+
+    sprintf(tmp, "%s.inc", backup_file_image);
+    close(creat(tmp, 0666));
+    strcat(tmp, ".");
+    int ret = do_tar_compress_filtered(backup_path, volume_sink_open(tmp, NANDROID_VOLUME_SIZE, nandroid_md5_callback, nandroid_resume_volume), callback,
+            index_filter, &builder);
+    if ((fclose(builder.out) || builder.error) && ret == 0)
+        ret = -1;
+
+    if (ret == 0 && builder.previous != NULL) {
+        sprintf(tmp, "%s.del", backup_file_image);
+        FILE* f = fopen(tmp, "w");
+        if (f == NULL || fprintf(f, "base\t%s\n", base_backup) < 0 || index_write_deletions(builder.previous, f))
+            ret = -1;
+        if (f != NULL && fclose(f))
+            ret = -1;
+        if (ret)
+            ui_print("Unable to write %s\n", tmp);
+    }
+    index_free(builder.previous);
+    return ret;
 }
 
 void nandroid_dedupe_gc(const char* blob_dir) {
     char backup_dir[PATH_MAX];
     strcpy(backup_dir, blob_dir);
-    char *d = dirname(backup_dir);
-    strcpy(backup_dir, d);
+    char* slash = strrchr(backup_dir, '/');
+    if (slash != NULL)
+        *slash = '\0';
     strcat(backup_dir, "/backup");
     ui_print("Freeing space...\n");
     char tmp[PATH_MAX];
@@ -197,23 +1110,29 @@ void nandroid_dedupe_gc(const char* blob_dir) {
 static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
     char blob_dir[PATH_MAX];
+    int i;
+    // <base>/backup/<timestamp>/<image> keeps its blobs in <base>/blobs
     strcpy(blob_dir, backup_file_image);
-    char *d = dirname(blob_dir);
-    strcpy(blob_dir, d);
-    d = dirname(blob_dir);
-    strcpy(blob_dir, d);
-    d = dirname(blob_dir);
-    strcpy(blob_dir, d);
+    for (i = 0; i < 3; i++) {
+        char* slash = strrchr(blob_dir, '/');
+        if (slash != NULL)
+            *slash = '\0';
+    }
     strcat(blob_dir, "/blobs");
     ensure_directory(blob_dir);
 
+    // other jobs wait for the collection, so it can't sweep up the blobs
+    // they are writing
+    pthread_mutex_lock(&nandroid_gc_lock);
     if (!(nandroid_backup_bitfield & NANDROID_FIELD_DEDUPE_CLEARED_SPACE)) {
         nandroid_backup_bitfield |= NANDROID_FIELD_DEDUPE_CLEARED_SPACE;
         nandroid_dedupe_gc(blob_dir);
     }
+    pthread_mutex_unlock(&nandroid_gc_lock);
 
-    sprintf(tmp, "dedupe c %s %s %s.dup %s", backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
+    sprintf(tmp, "dedupe c -s -z 1 %s %s %s.dup %s", backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
 
+    nandroid_estimate_files(backup_path);
     FILE *fp = __popen(tmp, "r");
     if (fp == NULL) {
         ui_print("Unable to execute dedupe.\n");
@@ -260,6 +1179,10 @@ static void refresh_default_backup_handler() {
         default_backup_handler = dedupe_compress_wrapper;
     else if (0 == strcmp(fmt, "tgz"))
         default_backup_handler = tar_gzip_compress_wrapper;
+    else if (0 == strcmp(fmt, "lz4"))
+        default_backup_handler = tar_lz4_compress_wrapper;
+    else if (0 == strcmp(fmt, "inc"))
+        default_backup_handler = incremental_compress_wrapper;
     else if (0 == strcmp(fmt, "tar"))
         default_backup_handler = tar_compress_wrapper;
     else
@@ -272,6 +1195,10 @@ unsigned nandroid_get_default_backup_format() {
         return NANDROID_BACKUP_FORMAT_DUP;
     } else if (default_backup_handler == tar_gzip_compress_wrapper) {
         return NANDROID_BACKUP_FORMAT_TGZ;
+    } else if (default_backup_handler == tar_lz4_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_LZ4;
+    } else if (default_backup_handler == incremental_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_INC;
     } else {
         return NANDROID_BACKUP_FORMAT_TAR;
     }
@@ -306,12 +1233,249 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     return default_backup_handler;
 }
 
+// Partitions are backed up side by side, up to ro.cwm.backup_jobs at a
+// time. At most ro.cwm.backup_disk_jobs of them may read or write any
+// one disk. Raw dumps, which share the flash utilities, and dedupe runs,
+// which share the blob store, run one at a time.
+#define NANDROID_MAX_JOBS 16
+#define NANDROID_JOB_DEVICES 3
+#define NANDROID_DEVICE_NAME 64
+#define NANDROID_RAW_DEVICE "raw"
+#define NANDROID_DEDUPE_DEVICE "dedupe"
+
+typedef enum {
+    JOB_PENDING,
+    JOB_RUNNING,
+    JOB_FINISHED,
+    JOB_REAPED,
+} nandroid_job_state;
+
+typedef struct nandroid_job nandroid_job;
+typedef struct nandroid_scheduler nandroid_scheduler;
+
+struct nandroid_job {
+    int (*run)(nandroid_job* job);
+    const char* backup_path;
+    const char* root;
+    char image[PATH_MAX];
+    char devices[NANDROID_JOB_DEVICES][NANDROID_DEVICE_NAME];
+    int device_count;
+    nandroid_job_state state;
+    int ret;
+    pthread_t thread;
+    nandroid_scheduler* scheduler;
+};
+
+struct nandroid_scheduler {
+    nandroid_job jobs[NANDROID_MAX_JOBS];
+    int count;
+    int running;
+    int max_jobs;
+    int disk_jobs;
+    char destination[NANDROID_DEVICE_NAME];
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+};
+
+// Names the disk a block device lives on, so mmcblk0p12 and mmcblk0p25
+// count against the same one.
+static void nandroid_device_disk(const char* device, char* disk) {
+    char path[PATH_MAX];
+    if (realpath(device, path) == NULL)
+        strcpy(path, device);
+    const char* name = strrchr(path, '/');
+    strncpy(disk, name != NULL ? name + 1 : path, NANDROID_DEVICE_NAME - 1);
+    disk[NANDROID_DEVICE_NAME - 1] = '\0';
+
+    char* end = disk + strlen(disk);
+    if (device[0] != '/' || strncmp(disk, "mtd", 3) == 0 || strncmp(disk, "bml", 3) == 0) {
+        // mtd partitions are named, not numbered
+        strcpy(disk, "mtd");
+    } else if (strncmp(disk, "mmcblk", 6) == 0) {
+        char* p = strchr(disk + 6, 'p');
+        if (p != NULL)
+            *p = '\0';
+    } else {
+        while (end > disk && isdigit(end[-1]))
+            *--end = '\0';
+    }
+}
+
+static int nandroid_get_int_property(const char* name, int def) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get(name, value, "");
+    int ret = atoi(value);
+    return ret > 0 ? ret : def;
+}
+
+// Devices where the backup shares its flash with the partitions being
+// backed up can cap nandroid io to ro.cwm.nandroid_bandwidth MB/s. It
+// backs off on its own while UI frames are later than
+// ro.cwm.nandroid_latency_budget ms.
+static void nandroid_throttle_setup() {
+    uint64_t bandwidth = nandroid_get_int_property("ro.cwm.nandroid_bandwidth", 0);
+    nandroid_throttle_init(bandwidth * 1024 * 1024, nandroid_get_int_property("ro.cwm.nandroid_latency_budget", 100));
+}
+
+static void nandroid_scheduler_init(nandroid_scheduler* s, const Volume* destination) {
+    memset(s, 0, sizeof(nandroid_scheduler));
+    s->max_jobs = nandroid_get_int_property("ro.cwm.backup_jobs", 2);
+    s->disk_jobs = nandroid_get_int_property("ro.cwm.backup_disk_jobs", 2);
+    if (destination != NULL && destination->blk_device != NULL)
+        nandroid_device_disk(destination->blk_device, s->destination);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->job_done, NULL);
+}
+
+static void nandroid_scheduler_destroy(nandroid_scheduler* s) {
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->job_done);
+}
+
+static void nandroid_job_add_device(nandroid_job* job, const char* device) {
+    int i;
+    for (i = 0; i < job->device_count; i++) {
+        if (strcmp(job->devices[i], device) == 0)
+            return;
+    }
+    if (job->device_count < NANDROID_JOB_DEVICES)
+        strcpy(job->devices[job->device_count++], device);
+}
+
+// Jobs start in the order they are added unless an earlier one is held
+// back by its devices.
+static nandroid_job* nandroid_add_job(nandroid_scheduler* s, const char* backup_path, const char* root, int (*run)(nandroid_job* job)) {
+    char disk[NANDROID_DEVICE_NAME];
+    nandroid_job* job = &s->jobs[s->count++];
+    job->run = run;
+    job->backup_path = backup_path;
+    job->root = root;
+    job->scheduler = s;
+    job->state = JOB_PENDING;
+
+    const char* name = strrchr(root, '/');
+    name = name != NULL ? name + 1 : root;
+    if (nandroid_checkpoint_done(name)) {
+        ui_print("%s was already backed up.\n", name);
+        job->state = JOB_REAPED;
+    }
+
+    Volume* vol = volume_for_path(root);
+    if (vol != NULL && vol->blk_device != NULL) {
+        nandroid_device_disk(vol->blk_device, disk);
+        nandroid_job_add_device(job, disk);
+    }
+    if (vol == NULL || vol->fs_type == NULL ||
+            strcmp(vol->fs_type, "mtd") == 0 ||
+            strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0)
+        nandroid_job_add_device(job, NANDROID_RAW_DEVICE);
+    else if (default_backup_handler == dedupe_compress_wrapper)
+        nandroid_job_add_device(job, NANDROID_DEDUPE_DEVICE);
+    if (s->destination[0] != '\0')
+        nandroid_job_add_device(job, s->destination);
+    return job;
+}
+
+static int nandroid_job_fits(nandroid_scheduler* s, nandroid_job* job) {
+    int i, j, k;
+    for (i = 0; i < job->device_count; i++) {
+        int users = 0;
+        int limit = strcmp(job->devices[i], NANDROID_RAW_DEVICE) == 0 ||
+                strcmp(job->devices[i], NANDROID_DEDUPE_DEVICE) == 0 ? 1 : s->disk_jobs;
+        for (j = 0; j < s->count; j++) {
+            if (s->jobs[j].state != JOB_RUNNING)
+                continue;
+            for (k = 0; k < s->jobs[j].device_count; k++) {
+                if (strcmp(s->jobs[j].devices[k], job->devices[i]) == 0)
+                    users++;
+            }
+        }
+        if (users >= limit)
+            return 0;
+    }
+    return 1;
+}
+
+static void* nandroid_job_thread(void* cookie) {
+    nandroid_job* job = (nandroid_job*)cookie;
+    nandroid_scheduler* s = job->scheduler;
+    const char* name = strrchr(job->root, '/');
+    name = name != NULL ? name + 1 : job->root;
+    int ret = job->run(job);
+
+    // the volumes an interrupted backup left don't match a partition
+    // that has changed since, so it is backed up again from the start
+    if (ret != 0 && nandroid_checkpoint_forget(job->backup_path, name)) {
+        ui_print("%s has changed since the interrupted backup, starting it over...\n", name);
+        ret = job->run(job);
+    }
+    if (ret == 0)
+        nandroid_checkpoint_partition(job->backup_path, name);
+
+    pthread_mutex_lock(&s->lock);
+    job->ret = ret;
+    job->state = JOB_FINISHED;
+    s->running--;
+    pthread_cond_broadcast(&s->job_done);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Runs every job, stopping at the first failure once the jobs already
+// running are done. Returns the status of the failed job.
+static int nandroid_run_jobs(nandroid_scheduler* s) {
+    int ret = 0;
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        int pending = 0;
+        for (i = 0; i < s->count; i++) {
+            nandroid_job* job = &s->jobs[i];
+            if (job->state != JOB_PENDING)
+                continue;
+            pending = 1;
+            if (ret != 0 || s->running >= s->max_jobs || !nandroid_job_fits(s, job))
+                continue;
+            if (s->running == 0)
+                nandroid_progress_reset();
+            job->state = JOB_RUNNING;
+            s->running++;
+            if (pthread_create(&job->thread, NULL, nandroid_job_thread, job)) {
+                job->state = JOB_REAPED;
+                s->running--;
+                ret = print_and_error("Unable to start backup job.\n");
+            }
+        }
+        if (s->running == 0 && (ret != 0 || !pending))
+            break;
+
+        pthread_cond_wait(&s->job_done, &s->lock);
+        for (i = 0; i < s->count; i++) {
+            nandroid_job* job = &s->jobs[i];
+            if (job->state != JOB_FINISHED)
+                continue;
+            pthread_join(job->thread, NULL);
+            job->state = JOB_REAPED;
+            if (ret == 0)
+                ret = job->ret;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
 int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
     char name[PATH_MAX];
     char tmp[PATH_MAX];
-    strcpy(name, basename(mount_point));
+    const char* slash = strrchr(mount_point, '/');
+    strcpy(name, slash != NULL ? slash + 1 : mount_point);
 
+    // the mount table isn't safe to share, only the backup itself runs
+    // alongside other jobs
+    pthread_mutex_lock(&nandroid_mount_lock);
     struct stat file_info;
     build_configuration_path(tmp, NANDROID_HIDE_PROGRESS_FILE);
     ensure_path_mounted(tmp);
@@ -319,10 +1483,10 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
 
     ui_print("Backing up %s...\n", name);
     if (0 != (ret = ensure_path_mounted(mount_point) != 0)) {
+        pthread_mutex_unlock(&nandroid_mount_lock);
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
-    compute_directory_stats(mount_point);
     scan_mounted_volumes();
     Volume *v = volume_for_path(mount_point);
     const MountedVolume *mv = NULL;
@@ -336,6 +1500,7 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
     else
         sprintf(tmp, "%s/%s.%s", backup_path, name, mv->filesystem);
     nandroid_backup_handler backup_handler = get_backup_handler(mount_point);
+    pthread_mutex_unlock(&nandroid_mount_lock);
 
     if (backup_handler == NULL) {
         ui_print("Error finding an appropriate backup handler.\n");
@@ -343,7 +1508,9 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
     }
     ret = backup_handler(mount_point, tmp, callback);
     if (umount_when_finished) {
+        pthread_mutex_lock(&nandroid_mount_lock);
         ensure_path_unmounted(mount_point);
+        pthread_mutex_unlock(&nandroid_mount_lock);
     }
     if (0 != ret) {
         ui_print("Error while making a backup image of %s!\n", mount_point);
@@ -353,6 +1520,12 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
     return 0;
 }
 
+static int nandroid_backup_raw(Volume* vol, const char* image) {
+    if (nandroid_sparse_images)
+        return backup_raw_partition_sparse(vol->fs_type, vol->blk_device, image);
+    return backup_raw_partition(vol->fs_type, vol->blk_device, image);
+}
+
 int nandroid_backup_partition(const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
@@ -365,14 +1538,14 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
     if (strcmp(vol->fs_type, "mtd") == 0 ||
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
-        const char* name = basename(root);
+        const char* name = strrchr(root, '/') != NULL ? strrchr(root, '/') + 1 : root;
         if (strcmp(backup_path, "-") == 0)
             strcpy(tmp, "/proc/self/fd/1");
         else
             sprintf(tmp, "%s/%s.img", backup_path, name);
 
         ui_print("Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
+        if (0 != (ret = nandroid_backup_raw(vol, tmp))) {
             ui_print("Error while backing up %s image!", name);
             return ret;
         }
@@ -384,11 +1557,34 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
     return nandroid_backup_partition_extended(backup_path, root, 1);
 }
 
+static int nandroid_backup_job(nandroid_job* job) {
+    return nandroid_backup_partition(job->backup_path, job->root);
+}
+
+static int nandroid_backup_extended_job(nandroid_job* job) {
+    return nandroid_backup_partition_extended(job->backup_path, job->root, 0);
+}
+
+static int nandroid_wimax_job(nandroid_job* job) {
+    Volume* vol = volume_for_path(job->root);
+    ui_print("Backing up WiMAX...\n");
+    if (0 != nandroid_backup_raw(vol, job->image))
+        return print_and_error("Error while dumping WiMAX image!\n");
+    return 0;
+}
+
 int nandroid_backup(const char* backup_path) {
     nandroid_backup_bitfield = 0;
+    nandroid_md5_clear();
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     refresh_default_backup_handler();
 
+    char tmp[PATH_MAX];
+    struct stat s;
+    build_configuration_path(tmp, NANDROID_SPARSE_IMAGES_FILE);
+    ensure_path_mounted(tmp);
+    nandroid_sparse_images = stat(tmp, &s) == 0;
+
     if (ensure_path_mounted(backup_path) != 0) {
         return print_and_error("Can't mount backup path.\n");
     }
@@ -402,7 +1598,6 @@ int nandroid_backup(const char* backup_path) {
         return print_and_error("Unable to find volume for backup path.\n");
     int ret;
     struct statfs sfs;
-    struct stat s;
     if (NULL != volume) {
         if (0 != (ret = statfs(volume->mount_point, &sfs)))
             return print_and_error("Unable to stat backup path.\n");
@@ -414,47 +1609,38 @@ int nandroid_backup(const char* backup_path) {
         if (sdcard_free_mb < 150)
             ui_print("There may not be enough free space to complete backup... continuing...\n");
     }
-    char tmp[PATH_MAX];
     ensure_directory(backup_path);
+    // a backup that was interrupted is picked up where it stopped
+    nandroid_checkpoint_open(backup_path);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
-        return ret;
+    nandroid_scheduler scheduler;
+    nandroid_scheduler_init(&scheduler, volume);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
-        return ret;
+    nandroid_add_job(&scheduler, backup_path, "/boot", nandroid_backup_job);
+    nandroid_add_job(&scheduler, backup_path, "/recovery", nandroid_backup_job);
 
     Volume *vol = volume_for_path("/wimax");
     if (vol != NULL && 0 == stat(vol->blk_device, &s)) {
         char serialno[PROPERTY_VALUE_MAX];
-        ui_print("Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
-        sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp);
-        if (0 != ret)
-            return print_and_error("Error while dumping WiMAX image!\n");
+        nandroid_job* job = nandroid_add_job(&scheduler, backup_path, "/wimax", nandroid_wimax_job);
+        sprintf(job->image, "%s/wimax.%s.img", backup_path, serialno);
     }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-        return ret;
+    nandroid_add_job(&scheduler, backup_path, "/system", nandroid_backup_job);
+    nandroid_add_job(&scheduler, backup_path, "/data", nandroid_backup_job);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
-        return ret;
-
-    if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
-            return ret;
-    }
+    if (has_datadata())
+        nandroid_add_job(&scheduler, backup_path, "/datadata", nandroid_backup_job);
 
     if (is_data_media() || 0 != stat(get_android_secure_path(), &s)) {
         ui_print("No .android_secure found. Skipping backup of applications on external storage.\n");
     } else {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, get_android_secure_path(), 0)))
-            return ret;
+        nandroid_add_job(&scheduler, backup_path, get_android_secure_path(), nandroid_backup_extended_job);
     }
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
-        return ret;
+    nandroid_add_job(&scheduler, backup_path, "/cache", nandroid_backup_extended_job);
 
     vol = volume_for_path("/sd-ext");
     if (vol == NULL || 0 != stat(vol->blk_device, &s)) {
@@ -462,13 +1648,26 @@ int nandroid_backup(const char* backup_path) {
     } else {
         if (0 != ensure_path_mounted("/sd-ext"))
             LOGI("Could not mount sd-ext. sd-ext backup may not be supported on this device. Skipping backup of sd-ext.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/sd-ext")))
-            return ret;
+        else
+            nandroid_add_job(&scheduler, backup_path, "/sd-ext", nandroid_backup_job);
+    }
+
+    // the jobs inherit the priority
+    nandroid_throttle_setup();
+    int io = nandroid_io_begin(NANDROID_IO_READER);
+    ret = nandroid_run_jobs(&scheduler);
+    nandroid_io_end(io);
+    nandroid_scheduler_destroy(&scheduler);
+    if (0 != ret) {
+        nandroid_checkpoint_close(backup_path, 0);
+        return ret;
     }
 
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    ret = nandroid_write_md5(backup_path);
+    nandroid_md5_clear();
+    nandroid_checkpoint_close(backup_path, ret == 0);
+    if (0 != ret) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
@@ -483,8 +1682,11 @@ int nandroid_backup(const char* backup_path) {
     d = dirname(base_dir);
     strcpy(base_dir, d);
 
-    sprintf(tmp, "chmod -R 777 %s ; chmod -R u+r,u+w,g+r,g+w,o+r,o+w %s ; chmod u+x,g+x,o+x %s/backup ; chmod u+x,g+x,o+x %s/blobs", backup_path, base_dir, base_dir, base_dir);
-    __system(tmp);
+    nandroid_fix_permissions(backup_path);
+    sprintf(tmp, "%s/backup", base_dir);
+    chmod(tmp, 0777);
+    sprintf(tmp, "%s/blobs", base_dir);
+    chmod(tmp, 0777);
 
     sync();
     ui_set_background(BACKGROUND_ICON_NONE);
@@ -493,11 +1695,10 @@ int nandroid_backup(const char* backup_path) {
     return 0;
 }
 
-int nandroid_dump(const char* partition) {
-    // silence our ui_print statements and other logging
-    ui_set_log_stdout(0);
-
+static int nandroid_dump_partition(const char* partition) {
     nandroid_backup_bitfield = 0;
+    // images can't be patched up after they are written to stdout
+    nandroid_sparse_images = 0;
     refresh_default_backup_handler();
 
     // override our default to be the basic tar dumper
@@ -529,6 +1730,132 @@ int nandroid_dump(const char* partition) {
     return 1;
 }
 
+// Set by the host before adb backup, like /tmp/ro.bu.restore, to pick
+// how the dump is compressed: none, gzip or lz4. USB is slower than lz4,
+// so that is the default.
+#define NANDROID_DUMP_CODEC_FILE "/tmp/ro.bu.compress"
+
+static int nandroid_dump_codec() {
+    char codec[16];
+    int ret = NANDROID_CODEC_LZ4;
+    FILE* f = fopen(NANDROID_DUMP_CODEC_FILE, "r");
+    if (f == NULL)
+        return ret;
+    if (fgets(codec, sizeof(codec), f) != NULL) {
+        if (strncmp(codec, "none", 4) == 0)
+            ret = NANDROID_CODEC_NONE;
+        else if (strncmp(codec, "gzip", 4) == 0)
+            ret = NANDROID_CODEC_GZIP;
+    }
+    fclose(f);
+    return ret;
+}
+
+// Frames what the dump writes to its end of the pipe, or takes the frames
+// apart for undump, reading fd and writing other. The pipe is kept
+// drained if that fails, so the tar or image tool on the other end can't
+// get stuck. Closes its end of the pipe when done.
+typedef struct {
+    int fd;
+    int other;
+    const char* partition;
+    int ret;
+} nandroid_stream_job;
+
+static void* dump_stream_thread(void* cookie) {
+    nandroid_stream_job* job = (nandroid_stream_job*)cookie;
+    char* buf = malloc(NANDROID_STREAM_FRAME_SIZE);
+    nandroid_sink* out = stream_sink_open(fd_sink_open(job->other), job->partition, nandroid_dump_codec());
+    int ret = out == NULL || buf == NULL ? -1 : 0;
+    ssize_t n;
+    while (buf != NULL && (n = read(job->fd, buf, NANDROID_STREAM_FRAME_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+        if (ret == 0 && out->write(out, buf, n))
+            ret = -1;
+    }
+    if (out != NULL && out->close(out))
+        ret = -1;
+    free(buf);
+    close(job->fd);
+    job->ret = ret;
+    return NULL;
+}
+
+static void* undump_stream_thread(void* cookie) {
+    nandroid_stream_job* job = (nandroid_stream_job*)cookie;
+    nandroid_sink* out = fd_sink_open(job->other);
+    job->ret = out == NULL ? -1 : stream_read(job->fd, job->partition, out);
+    if (out != NULL)
+        out->close(out);
+    close(job->other);
+    return NULL;
+}
+
+// Runs dump or undump with stdout or stdin, given as std, going through a
+// pipe serviced by thread_func.
+static int nandroid_run_streamed(int (*run)(const char*), const char* partition, int std, void* (*thread_func)(void*)) {
+    nandroid_stream_job job;
+    pthread_t thread;
+    int fds[2];
+
+    int orig = dup(std);
+    if (orig < 0 || pipe(fds)) {
+        if (orig >= 0)
+            close(orig);
+        return 1;
+    }
+    // only the tar or image tool on our side of the stream may hold on
+    // to the pipe
+    int ours = std == STDOUT_FILENO ? fds[1] : fds[0];
+    int theirs = std == STDOUT_FILENO ? fds[0] : fds[1];
+    fcntl(orig, F_SETFD, FD_CLOEXEC);
+    fcntl(theirs, F_SETFD, FD_CLOEXEC);
+    dup2(ours, std);
+    close(ours);
+
+    job.partition = partition;
+    job.ret = -1;
+    if (std == STDOUT_FILENO) {
+        job.fd = theirs;
+        job.other = orig;
+    } else {
+        job.fd = orig;
+        job.other = theirs;
+    }
+
+    // the host or the restore going away must not kill recovery
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    int started = pthread_create(&thread, NULL, thread_func, &job) == 0;
+    int ret = started ? run(partition) : 1;
+
+    // putting std back closes our end of the pipe, ending the thread
+    if (std == STDOUT_FILENO)
+        fflush(stdout);
+    dup2(orig, std);
+    if (started)
+        pthread_join(thread, NULL);
+    else
+        close(theirs);
+    close(orig);
+    signal(SIGPIPE, old_sigpipe);
+    if (ret == 0 && job.ret != 0) {
+        LOGE("Error in the %s stream of %s\n", std == STDOUT_FILENO ? "dump" : "undump", partition);
+        ret = 1;
+    }
+    return ret;
+}
+
+int nandroid_dump(const char* partition) {
+    // silence our ui_print statements and other logging
+    ui_set_log_stdout(0);
+    return nandroid_run_streamed(nandroid_dump_partition, partition, STDOUT_FILENO, dump_stream_thread);
+}
+
 typedef int (*nandroid_restore_handler)(const char* backup_file_image, const char* backup_path, int callback);
 
 static int unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
@@ -549,39 +1876,238 @@ static int unyaffs_wrapper(const char* backup_file_image, const char* backup_pat
     return __pclose(fp);
 }
 
-static int do_tar_extract(char* command, int callback) {
-    char buf[PATH_MAX];
+// Feeds tar. Once tar has exited the rest of the backup is still read,
+// and verified, but thrown away, and tar's status tells whether the
+// restore worked.
+typedef struct {
+    nandroid_sink sink;
+    int fd;
+    int closed;
+} tar_input_sink;
+
+static int tar_input_write(nandroid_sink* sink, const void* data, size_t len) {
+    tar_input_sink* s = (tar_input_sink*)sink;
+    const char* p = data;
+    nandroid_throttle(len);
+    while (len > 0 && !s->closed) {
+        ssize_t written = write(s->fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE)
+                return -1;
+            s->closed = 1;
+            break;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+typedef struct {
+    char image[PATH_MAX];
+    int codec;
+    // only the entries of the archive in this range, if members is set
+    members_index* members;
+    uint64_t start;
+    uint64_t end;
+    int fd;
+    int ret;
+} decompress_job;
+
+static void* decompress_thread(void* cookie) {
+    decompress_job* job = (decompress_job*)cookie;
+    tar_input_sink out;
+    nandroid_io_begin(NANDROID_IO_READER);
+    out.sink.write = tar_input_write;
+    out.sink.close = NULL;
+    out.fd = job->fd;
+    out.closed = 0;
+    if (job->members == NULL) {
+        job->ret = decompress_volumes(job->image, job->codec, &out.sink, nandroid_verify_inline ? nandroid_verify_md5 : NULL);
+    } else {
+        static const char end_of_archive[1024];
+        uint64_t seek_offset = 0;
+        uint64_t compressed_offset = 0;
+        job->ret = -1;
+        if (job->codec == NANDROID_CODEC_NONE || members_seek_point(job->members, job->start, &seek_offset, &compressed_offset) == 0)
+            job->ret = decompress_range(job->image, job->codec, members_volume_size(job->members), seek_offset, compressed_offset,
+                    job->start, job->end, &out.sink);
+        if (job->ret == 0)
+            job->ret = out.sink.write(&out.sink, end_of_archive, sizeof(end_of_archive));
+    }
+    // tar sees the end of the archive
+    close(job->fd);
+    return NULL;
+}
+
+static int do_tar_decompress_job(decompress_job* job, const char* backup_path, int callback) {
+    char tmp[PATH_MAX];
+    pthread_t thread;
+    int fds[2];
 
-    set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
+    if (pipe(fds)) {
+        ui_print("Unable to create pipe.\n");
+        return -1;
+    }
+    // only tar gets the read end
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    sprintf(tmp, "cd $(dirname %s) ; tar xv 0<&%d ; exit $?", backup_path, fds[0]);
+
+    // a tar that dies early must not take recovery down with it
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    nandroid_perf_mode(1);
+    FILE *fp = __popen(tmp, "r");
+    close(fds[0]);
     if (fp == NULL) {
         ui_print("Unable to execute tar command.\n");
-        set_perf_mode(0);
+        close(fds[1]);
+        nandroid_perf_mode(0);
+        signal(SIGPIPE, old_sigpipe);
         return -1;
     }
 
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
+    job->fd = fds[1];
+    job->ret = -1;
+    int started = pthread_create(&thread, NULL, decompress_thread, job) == 0;
+    if (!started)
+        close(fds[1]);
+
+    while (fgets(tmp, PATH_MAX, fp) != NULL) {
+        tmp[PATH_MAX - 1] = '\0';
         if (callback)
-            nandroid_callback(buf);
+            nandroid_callback(tmp);
     }
 
-    set_perf_mode(0);
-    return __pclose(fp);
+    if (started)
+        pthread_join(thread, NULL);
+    int ret = __pclose(fp);
+    nandroid_perf_mode(0);
+    signal(SIGPIPE, old_sigpipe);
+    return ret != 0 ? ret : job->ret;
+}
+
+static int do_tar_decompress(const char* backup_file_image, const char* backup_path, int codec, int callback) {
+    decompress_job job;
+    memset(&job, 0, sizeof(job));
+    strcpy(job.image, backup_file_image);
+    job.codec = codec;
+    return do_tar_decompress_job(&job, backup_path, callback);
 }
 
 static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; cat %s* | pigz -d -c | tar xv ; exit $?", backup_path, backup_file_image);
+    return do_tar_decompress(backup_file_image, backup_path, NANDROID_CODEC_GZIP, callback);
+}
 
-    return do_tar_extract(tmp, callback);
+static int tar_lz4_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_decompress(backup_file_image, backup_path, NANDROID_CODEC_LZ4, callback);
 }
 
 static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_decompress(backup_file_image, backup_path, NANDROID_CODEC_NONE, callback);
+}
+
+// Checks the chain of an <image>.inc is all there, before the partition
+// is wiped for it.
+static int incremental_check(const char* backup_file_image) {
+    char image[PATH_MAX];
+    strcpy(image, backup_file_image);
+    image[strlen(image) - strlen(".inc")] = '\0';
+    return nandroid_inc_chain(image, NULL) < 0 ? -1 : 0;
+}
+
+// Puts back the sums of the backup image belongs to, after those of a
+// base replaced them.
+static int incremental_reload_md5(const char* image, int verify) {
+    char parent[PATH_MAX];
+    char backup[PATH_MAX];
+    const char* file;
+
+    nandroid_md5_clear();
+    if (!verify)
+        return 0;
+    if (nandroid_inc_split(image, parent, backup, &file) == 0) {
+        strcat(parent, "/");
+        strcat(parent, backup);
+        if (0 == nandroid_load_md5(parent))
+            return 0;
+    }
+    ui_print("Can't read nandroid.md5 of %s!\n", image);
+    return -1;
+}
+
+static int incremental_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    char chain[NANDROID_INC_MAX_CHAIN][PATH_MAX];
+    char image[PATH_MAX];
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; cat %s* | tar xv ; exit $?", backup_path, backup_file_image);
+    char dir[PATH_MAX];
+    char parent[PATH_MAX];
+    char backup[PATH_MAX];
+    const char* file = NULL;
+    int verify = nandroid_verify_inline;
+    int reloaded = 0;
+    int ret = 0;
+    int i;
+
+    strcpy(image, backup_file_image);
+    image[strlen(image) - strlen(".inc")] = '\0';
+    int count = nandroid_inc_chain(image, chain);
+    if (count < 0)
+        return -1;
+
+    // entry names are relative to the parent of backup_path, as for tar
+    strcpy(dir, backup_path);
+    char* slash = strrchr(dir, '/');
+    if (slash == dir)
+        strcpy(dir, "/");
+    else if (slash != NULL)
+        *slash = '\0';
+
+    // oldest first, removing what each increment deleted before
+    // extracting what it changed
+    for (i = count - 1; i >= 0 && ret == 0; i--) {
+        if (i < count - 1) {
+            sprintf(tmp, "%s.del", chain[i]);
+            FILE* f = fopen(tmp, "r");
+            if (f == NULL || fgets(tmp, sizeof(tmp), f) == NULL || index_apply_deletions(f, dir)) {
+                ui_print("Unable to apply the deletions of %s\n", chain[i]);
+                ret = -1;
+            }
+            if (f != NULL)
+                fclose(f);
+            if (ret)
+                break;
+        }
+
+        // the bases live in other backups, with their own nandroid.md5,
+        // and the newest increment is checked against ours again
+        file = NULL;
+        if (i > 0) {
+            if (nandroid_inc_split(chain[i], parent, backup, &file) == 0)
+                sprintf(tmp, "%s/%s", parent, backup);
+            if (file == NULL || 0 != nandroid_load_md5(tmp)) {
+                ui_print("Can't read nandroid.md5 of %s!\n", chain[i]);
+                ret = -1;
+                break;
+            }
+            nandroid_verify_inline = 1;
+        } else if (count > 1) {
+            reloaded = 1;
+            if (0 != incremental_reload_md5(image, verify)) {
+                ret = -1;
+                break;
+            }
+        }
+        sprintf(tmp, "%s.inc", chain[i]);
+        ret = do_tar_decompress(tmp, backup_path, NANDROID_CODEC_NONE, callback);
+        nandroid_verify_inline = verify;
+    }
 
-    return do_tar_extract(tmp, callback);
+    // a base failed, leaving its sums in place of ours
+    if (count > 1 && !reloaded && 0 != incremental_reload_md5(image, verify))
+        ret = -1;
+    return ret;
 }
 
 static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
@@ -689,6 +2215,18 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
                 restore_handler = tar_gzip_extract_wrapper;
                 break;
             }
+            sprintf(tmp, "%s/%s.%s.tar.lz4", backup_path, name, filesystem);
+            if (0 == (ret = stat(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_lz4_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.inc", backup_path, name, filesystem);
+            if (0 == (ret = stat(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = incremental_extract_wrapper;
+                break;
+            }
             sprintf(tmp, "%s/%s.%s.dup", backup_path, name, filesystem);
             if (0 == (ret = stat(tmp, &file_info))) {
                 backup_filesystem = filesystem;
@@ -727,6 +2265,15 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     ensure_path_mounted(path);
     int callback = stat(path, &file_info) != 0;
 
+    // images that aren't streamed through the tar reader are checked
+    // before the partition is wiped
+    if (strcmp(backup_path, "-") != 0 && restore_handler != tar_extract_wrapper &&
+            restore_handler != tar_gzip_extract_wrapper && restore_handler != tar_lz4_extract_wrapper &&
+            restore_handler != incremental_extract_wrapper && 0 != nandroid_verify_file(tmp))
+        return print_and_error("MD5 mismatch!\n");
+    if (restore_handler == incremental_extract_wrapper && 0 != incremental_check(tmp))
+        return print_and_error("Incomplete incremental backup!\n");
+
     ui_print("Restoring %s...\n", name);
     if (backup_filesystem == NULL) {
         if (0 != (ret = format_volume(mount_point))) {
@@ -781,17 +2328,20 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             strcmp(vol->fs_type, "emmc") == 0) {
         int ret;
         const char* name = basename(root);
+        if (strcmp(backup_path, "-") == 0)
+            strcpy(tmp, "/proc/self/fd/0");
+        else
+            sprintf(tmp, "%s%s.img", backup_path, root);
+
+        if (strcmp(backup_path, "-") != 0 && 0 != nandroid_verify_file(tmp))
+            return print_and_error("MD5 mismatch!\n");
+
         ui_print("Erasing %s before restore...\n", name);
         if (0 != (ret = format_volume(root))) {
             ui_print("Error while erasing %s image!", name);
             return ret;
         }
 
-        if (strcmp(backup_path, "-") == 0)
-            strcpy(tmp, backup_path);
-        else
-            sprintf(tmp, "%s%s.img", backup_path, root);
-
         ui_print("Restoring %s image...\n", name);
         if (0 != (ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
             ui_print("Error while flashing %s image!\n", name);
@@ -802,29 +2352,50 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_show_indeterminate_progress();
-    nandroid_files_total = 0;
+// A restore lists what it asked for and each partition it finishes in
+// nandroid.restoring next to the backup, so one that was interrupted can
+// be resumed without restoring those again.
+#define NANDROID_RESTORE_JOURNAL "nandroid.restoring"
+static FILE* nandroid_restore_journal = NULL;
+// partitions finished by the restore being resumed, by name
+static nandroid_md5* nandroid_restore_done = NULL;
 
-    if (ensure_path_mounted(backup_path) != 0)
-        return print_and_error("Can't mount backup path\n");
+static int nandroid_restore_skip(const char* name) {
+    if (nandroid_md5_find(nandroid_restore_done, name) == NULL)
+        return 0;
+    ui_print("%s was already restored.\n", name);
+    return 1;
+}
 
-    char tmp[PATH_MAX];
+static void nandroid_restore_record(const char* name) {
+    if (nandroid_restore_journal == NULL)
+        return;
+    if (fprintf(nandroid_restore_journal, "done %s\n", name) < 0 || fflush(nandroid_restore_journal) ||
+            fsync(fileno(nandroid_restore_journal)))
+        LOGW("Unable to update %s\n", NANDROID_RESTORE_JOURNAL);
+}
 
-    ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("MD5 mismatch!\n");
+static int nandroid_restore_step(const char* backup_path, const char* mount_point, int extended) {
+    const char* name = strrchr(mount_point, '/');
+    name = name != NULL ? name + 1 : mount_point;
+    if (nandroid_restore_skip(name))
+        return 0;
+    int ret = extended ? nandroid_restore_partition_extended(backup_path, mount_point, 0) : nandroid_restore_partition(backup_path, mount_point);
+    if (ret == 0)
+        nandroid_restore_record(name);
+    return ret;
+}
 
+static int nandroid_restore_partitions(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
+    char tmp[PATH_MAX];
     int ret;
 
-    if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
+    if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_step(backup_path, "/boot", 0)))
         return ret;
 
     struct stat s;
     Volume *vol = volume_for_path("/wimax");
-    if (restore_wimax && vol != NULL && 0 == stat(vol->blk_device, &s)) {
+    if (restore_wimax && vol != NULL && 0 == stat(vol->blk_device, &s) && !nandroid_restore_skip("wimax")) {
         char serialno[PROPERTY_VALUE_MAX];
 
         serialno[0] = 0;
@@ -838,33 +2409,116 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
             ui_print("         You should create a new backup to\n");
             ui_print("         protect your WiMAX keys.\n");
         } else {
+            if (0 != nandroid_verify_file(tmp))
+                return print_and_error("MD5 mismatch!\n");
             ui_print("Erasing WiMAX before restore...\n");
             if (0 != (ret = format_volume("/wimax")))
                 return print_and_error("Error while formatting wimax!\n");
             ui_print("Restoring WiMAX image...\n");
             if (0 != (ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp)))
                 return ret;
+            nandroid_restore_record("wimax");
         }
     }
 
-    if (restore_system && 0 != (ret = nandroid_restore_partition(backup_path, "/system")))
+    if (restore_system && 0 != (ret = nandroid_restore_step(backup_path, "/system", 0)))
         return ret;
 
-    if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "/data")))
+    if (restore_data && 0 != (ret = nandroid_restore_step(backup_path, "/data", 0)))
         return ret;
 
     if (has_datadata()) {
-        if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "/datadata")))
+        if (restore_data && 0 != (ret = nandroid_restore_step(backup_path, "/datadata", 0)))
             return ret;
     }
 
-    if (restore_data && 0 != (ret = nandroid_restore_partition_extended(backup_path, get_android_secure_path(), 0)))
+    if (restore_data && 0 != (ret = nandroid_restore_step(backup_path, get_android_secure_path(), 1)))
+        return ret;
+
+    if (restore_cache && 0 != (ret = nandroid_restore_step(backup_path, "/cache", 1)))
         return ret;
 
-    if (restore_cache && 0 != (ret = nandroid_restore_partition_extended(backup_path, "/cache", 0)))
+    if (restore_sdext && 0 != (ret = nandroid_restore_step(backup_path, "/sd-ext", 0)))
         return ret;
 
-    if (restore_sdext && 0 != (ret = nandroid_restore_partition(backup_path, "/sd-ext")))
+    return 0;
+}
+
+// Opens the restore journal, picking up the partitions already done if
+// resume is set.
+static void nandroid_restore_journal_open(const char* backup_path, int resume, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    char name[PATH_MAX];
+
+    sprintf(path, "%s/%s", backup_path, NANDROID_RESTORE_JOURNAL);
+    if (resume && (nandroid_restore_journal = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), nandroid_restore_journal) != NULL) {
+            if (sscanf(line, "done %s", name) == 1)
+                nandroid_md5_add(&nandroid_restore_done, name, 0, NULL);
+        }
+        fclose(nandroid_restore_journal);
+    }
+
+    nandroid_restore_journal = fopen(path, resume ? "a" : "w");
+    if (nandroid_restore_journal == NULL) {
+        LOGW("Unable to create %s, the restore can't be resumed\n", path);
+        return;
+    }
+    if (!resume) {
+        fprintf(nandroid_restore_journal, "restore %d %d %d %d %d %d\n", restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+        fflush(nandroid_restore_journal);
+    }
+}
+
+static void nandroid_restore_journal_close(const char* backup_path, int complete) {
+    char path[PATH_MAX];
+    if (nandroid_restore_journal != NULL)
+        fclose(nandroid_restore_journal);
+    nandroid_restore_journal = NULL;
+    nandroid_md5_free(&nandroid_restore_done);
+    if (complete) {
+        sprintf(path, "%s/%s", backup_path, NANDROID_RESTORE_JOURNAL);
+        unlink(path);
+    }
+}
+
+static int nandroid_restore_journaled(const char* backup_path, int resume, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    nandroid_bytes_total = 0;
+    nandroid_files_total = 0;
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path\n");
+
+    char tmp[PATH_MAX];
+    struct stat st;
+    build_configuration_path(tmp, NANDROID_VERIFY_FIRST_FILE);
+    ensure_path_mounted(tmp);
+    int verify_first = stat(tmp, &st) == 0;
+
+    // by default every file is checked as it is restored, instead of
+    // reading the whole backup twice
+    if (verify_first) {
+        ui_print("Checking MD5 sums...\n");
+        sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
+        if (0 != __system(tmp))
+            return print_and_error("MD5 mismatch!\n");
+    } else if (0 != nandroid_load_md5(backup_path)) {
+        return print_and_error("Can't read nandroid.md5!\n");
+    }
+
+    nandroid_verify_inline = !verify_first;
+    nandroid_restore_journal_open(backup_path, resume, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    nandroid_throttle_setup();
+    int io = nandroid_io_begin(NANDROID_IO_WRITER);
+    int ret = nandroid_restore_partitions(backup_path, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+    nandroid_io_end(io);
+    nandroid_restore_journal_close(backup_path, ret == 0);
+    nandroid_verify_inline = 0;
+    nandroid_md5_clear();
+    if (ret)
         return ret;
 
     sync();
@@ -874,7 +2528,157 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     return 0;
 }
 
-int nandroid_undump(const char* partition) {
+int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
+    return nandroid_restore_journaled(backup_path, 0, restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax);
+}
+
+// Loads the member list of the tar backup of mount_point, setting image
+// and codec to the archive it describes.
+static members_index* nandroid_members_open(const char* backup_path, const char* mount_point, char* image, int* codec) {
+    static const char* filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", "f2fs", NULL };
+    static const char* suffixes[] = { ".tar", ".tar.gz", ".tar.lz4" };
+    static const int codecs[] = { NANDROID_CODEC_NONE, NANDROID_CODEC_GZIP, NANDROID_CODEC_LZ4 };
+    const char* name = strrchr(mount_point, '/');
+    name = name != NULL ? name + 1 : mount_point;
+    char path[PATH_MAX];
+    struct stat st;
+    int i, j;
+
+    for (i = 0; filesystems[i] != NULL; i++) {
+        for (j = 0; j < 3; j++) {
+            sprintf(image, "%s/%s.%s%s", backup_path, name, filesystems[i], suffixes[j]);
+            sprintf(path, "%s.members", image);
+            if (stat(path, &st) == 0) {
+                *codec = codecs[j];
+                return members_load(path);
+            }
+        }
+    }
+    return NULL;
+}
+
+char** nandroid_list_backup_files(const char* backup_path, const char* mount_point, const char* dir) {
+    char image[PATH_MAX];
+    int codec;
+    if (ensure_path_mounted(backup_path) != 0)
+        return NULL;
+    members_index* members = nandroid_members_open(backup_path, mount_point, image, &codec);
+    if (members == NULL)
+        return NULL;
+    char** names = members_list(members, dir);
+    members_free(members);
+    return names;
+}
+
+int nandroid_restore_backup_files(const char* backup_path, const char* mount_point, const char* path) {
+    char image[PATH_MAX];
+    char tmp[PATH_MAX];
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    decompress_job job;
+
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path\n");
+
+    memset(&job, 0, sizeof(job));
+    job.members = nandroid_members_open(backup_path, mount_point, image, &job.codec);
+    if (job.members == NULL)
+        return print_and_error("No file list found in this backup.\n");
+    if (members_find(job.members, path, &job.start, &job.end) != 0) {
+        members_free(job.members);
+        ui_print("%s is not in this backup.\n", path);
+        return -1;
+    }
+
+    // only the list is checked, the volumes can't be without reading
+    // all of them
+    int ret = 0;
+    sprintf(tmp, "%s.members", image);
+    if (0 != nandroid_load_md5(backup_path))
+        ret = print_and_error("Can't read nandroid.md5!\n");
+    else if (md5_file(tmp, md5) || nandroid_verify_md5(tmp, md5))
+        ret = print_and_error("MD5 mismatch!\n");
+    nandroid_md5_clear();
+    if (ret == 0 && 0 != ensure_path_mounted(mount_point)) {
+        ui_print("Can't mount %s!\n", mount_point);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        ui_print("Restoring %s...\n", path);
+        strcpy(job.image, image);
+        nandroid_files_total = 0;
+        nandroid_bytes_total = 0;
+        nandroid_throttle_setup();
+        int io = nandroid_io_begin(NANDROID_IO_WRITER);
+        ret = do_tar_decompress_job(&job, mount_point, 1);
+        nandroid_io_end(io);
+    }
+    members_free(job.members);
+    sync();
+    ui_set_background(BACKGROUND_ICON_NONE);
+    ui_reset_progress();
+    if (ret == 0)
+        ui_print("\nRestore complete!\n");
+    else
+        ui_print("Error while restoring %s!\n", path);
+    return ret;
+}
+
+int nandroid_restore_interrupted(const char* backup_path) {
+    char path[PATH_MAX];
+    struct stat st;
+    sprintf(path, "%s/%s", backup_path, NANDROID_RESTORE_JOURNAL);
+    return stat(path, &st) == 0;
+}
+
+int nandroid_resume_restore(const char* backup_path) {
+    char path[PATH_MAX];
+    int boot, system, data, cache, sdext, wimax;
+
+    sprintf(path, "%s/%s", backup_path, NANDROID_RESTORE_JOURNAL);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return print_and_error("Can't read the interrupted restore.\n");
+    int fields = fscanf(f, "restore %d %d %d %d %d %d", &boot, &system, &data, &cache, &sdext, &wimax);
+    fclose(f);
+    if (fields != 6)
+        return print_and_error("Can't read the interrupted restore.\n");
+    return nandroid_restore_journaled(backup_path, 1, boot, system, data, cache, sdext, wimax);
+}
+
+// Finds the newest backup in dir that didn't finish. nandroid_backup
+// resumes it when given its path.
+int nandroid_find_interrupted_backup(const char* dir, char* backup_path) {
+    char path[PATH_MAX];
+    struct stat st;
+    time_t newest = 0;
+    int found = 0;
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return -1;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/nandroid.md5", dir, de->d_name);
+        if (stat(path, &st) == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", dir, de->d_name, NANDROID_CHECKPOINT_FILE);
+        if (stat(path, &st) != 0 || (found && st.st_mtime < newest))
+            continue;
+        snprintf(backup_path, PATH_MAX, "%s/%s", dir, de->d_name);
+        newest = st.st_mtime;
+        found = 1;
+    }
+    closedir(d);
+    return found ? 0 : -1;
+}
+
+static int nandroid_undump_partition(const char* partition) {
+    nandroid_bytes_total = 0;
     nandroid_files_total = 0;
 
     int ret;
@@ -909,6 +2713,10 @@ int nandroid_undump(const char* partition) {
     return 0;
 }
 
+int nandroid_undump(const char* partition) {
+    return nandroid_run_streamed(nandroid_undump_partition, partition, STDIN_FILENO, undump_stream_thread);
+}
+
 int nandroid_usage() {
     printf("Usage: nandroid backup\n");
     printf("Usage: nandroid restore <directory>\n");
@@ -919,6 +2727,8 @@ int nandroid_usage() {
 
 static int bu_usage() {
     printf("Usage: bu <fd> backup partition\n");
+    printf("Usage: Optionally, prior to backup:\n");
+    printf("Usage: echo -n <none|gzip|lz4> > /tmp/ro.bu.compress\n");
     printf("Usage: Prior to restore:\n");
     printf("Usage: echo -n <partition> > /tmp/ro.bu.restore\n");
     printf("Usage: bu <fd> restore\n");
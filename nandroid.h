@@ -6,6 +6,13 @@ int bu_main(int argc, char** argv);
 int nandroid_backup(const char* backup_path);
 int nandroid_dump(const char* partition);
 int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax);
+int nandroid_restore_interrupted(const char* backup_path);
+int nandroid_resume_restore(const char* backup_path);
+int nandroid_find_interrupted_backup(const char* dir, char* backup_path);
+// Selective restores from the member list of a tar backup. Paths are as
+// archived, starting with the last part of the mount point.
+char** nandroid_list_backup_files(const char* backup_path, const char* mount_point, const char* dir);
+int nandroid_restore_backup_files(const char* backup_path, const char* mount_point, const char* path);
 int nandroid_undump(const char* partition);
 void nandroid_dedupe_gc(const char* blob_dir);
 void nandroid_force_backup_format(const char* fmt);
@@ -14,5 +21,7 @@ unsigned nandroid_get_default_backup_format();
 #define NANDROID_BACKUP_FORMAT_TAR 0
 #define NANDROID_BACKUP_FORMAT_DUP 1
 #define NANDROID_BACKUP_FORMAT_TGZ 2
+#define NANDROID_BACKUP_FORMAT_LZ4 3
+#define NANDROID_BACKUP_FORMAT_INC 4
 
 #endif
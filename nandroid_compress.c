@@ -0,0 +1,929 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/md5.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "nandroid_compress.h"
+
+// Input is compressed in blocks of this size, one block per job.
+#define COMPRESS_BLOCK_SIZE (256 * 1024)
+// gzip blocks are primed with the end of the previous block, so
+// splitting the input costs almost nothing in ratio.
+#define GZIP_DICT_SIZE (32 * 1024)
+#define COMPRESS_MAX_THREADS 16
+// gzip blocks starting a seek point go without the dictionary, so
+// decompression can start there
+#define COMPRESS_SEEK_BLOCKS 16
+
+#define LZ4_MAGIC 0x184D2204
+// version 1, independent blocks
+#define LZ4_FLG 0x60
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+// 256KB maximum block size
+#define LZ4_BD 0x50
+#define LZ4_UNCOMPRESSED 0x80000000U
+#define LZ4_HASH_LOG 14
+#define LZ4_MIN_MATCH 4
+// the last match must start 12 bytes before the end of a block and the
+// last 5 bytes are always literals
+#define LZ4_MF_LIMIT 12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_OFFSET 65535
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t rotl32(uint32_t v, int bits) {
+    return (v << bits) | (v >> (32 - bits));
+}
+
+// xxh32 with seed 0 of an input shorter than 16 bytes, which is all the
+// lz4 frame descriptor checksum needs
+static uint32_t lz4_xxh32_short(const unsigned char* p, size_t len) {
+    const uint32_t prime1 = 2654435761U;
+    const uint32_t prime2 = 2246822519U;
+    const uint32_t prime3 = 3266489917U;
+    const uint32_t prime4 = 668265263U;
+    const uint32_t prime5 = 374761393U;
+    uint32_t h = prime5 + len;
+    for (; len >= 4; p += 4, len -= 4)
+        h = rotl32(h + get_le32(p) * prime3, 17) * prime4;
+    for (; len > 0; p++, len--)
+        h = rotl32(h + *p * prime5, 11) * prime1;
+    h ^= h >> 15;
+    h *= prime2;
+    h ^= h >> 13;
+    h *= prime3;
+    h ^= h >> 16;
+    return h;
+}
+
+static size_t lz4_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static unsigned char* lz4_put_length(unsigned char* op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+// Writes one sequence. A match length of 0 ends the block with literals
+// only.
+static unsigned char* lz4_put_sequence(unsigned char* op, const unsigned char* literals, size_t literal_len, size_t offset, size_t match_len) {
+    unsigned char* token = op++;
+    *token = (literal_len >= 15 ? 15 : literal_len) << 4;
+    if (literal_len >= 15)
+        op = lz4_put_length(op, literal_len - 15);
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (match_len == 0)
+        return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+    match_len -= LZ4_MIN_MATCH;
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15)
+        op = lz4_put_length(op, match_len - 15);
+    return op;
+}
+
+// Greedy single pass compressor. dst must hold lz4_bound(len) bytes.
+// table is 1 << LZ4_HASH_LOG entries of scratch space.
+static size_t lz4_compress_block(const unsigned char* src, size_t len, unsigned char* dst, uint32_t* table) {
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* end = src + len;
+    unsigned char* op = dst;
+
+    memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+    if (len > LZ4_MF_LIMIT) {
+        const unsigned char* match_start_limit = end - LZ4_MF_LIMIT;
+        const unsigned char* match_end_limit = end - LZ4_LAST_LITERALS;
+        // skip ahead faster the longer nothing matches
+        unsigned misses = 0;
+        while (ip <= match_start_limit) {
+            uint32_t sequence = get_le32(ip);
+            uint32_t hash = (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+            const unsigned char* ref = src + table[hash];
+            table[hash] = ip - src;
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || get_le32(ref) != sequence) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            size_t match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < match_end_limit && ip[match_len] == ref[match_len])
+                match_len++;
+
+            op = lz4_put_sequence(op, anchor, ip - anchor, ip - ref, match_len);
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+    op = lz4_put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+// Returns the decompressed length, or -1 if the block is corrupt or
+// doesn't fit in capacity bytes.
+static ssize_t lz4_decompress_block(const unsigned char* src, size_t len, unsigned char* dst, size_t capacity) {
+    const unsigned char* ip = src;
+    const unsigned char* end = src + len;
+    unsigned char* op = dst;
+    unsigned char* out_end = dst + capacity;
+
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            unsigned b;
+            do {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                literal_len += b;
+            } while (b == 255);
+        }
+        if (literal_len > (size_t)(end - ip) || literal_len > (size_t)(out_end - op))
+            return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        // the last sequence has no match
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            unsigned b;
+            do {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(out_end - op))
+            return -1;
+        const unsigned char* match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        }
+        else {
+            // overlapping copies repeat the last offset bytes
+            while (match_len-- > 0)
+                *op++ = *match++;
+        }
+    }
+    return op - dst;
+}
+
+typedef struct {
+    unsigned char* in;
+    size_t in_len;
+    // the end of the previous block, for gzip
+    const unsigned char* dict;
+    size_t dict_len;
+    unsigned char* out;
+    size_t out_size;
+    size_t out_len;
+    uLong crc;
+    int last;
+    int done;
+    int error;
+} compress_job;
+
+typedef struct {
+    nandroid_sink sink;
+    nandroid_sink* next;
+    int codec;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t job_done;
+    pthread_t threads[COMPRESS_MAX_THREADS];
+    int thread_count;
+    // jobs is a ring, block n lives in jobs[n % job_count]
+    compress_job* jobs;
+    int job_count;
+    // blocks handed to the workers, blocks taken by a worker, and blocks
+    // written to next, in input order
+    unsigned long submitted;
+    unsigned long started;
+    unsigned long written;
+    int stop;
+    uLong crc;
+    uLong length;
+    // bytes passed to next so far
+    uint64_t out_offset;
+    nandroid_seek_callback seek;
+    void* cookie;
+    int error;
+} compress_sink;
+
+static int compress_gzip_block(z_stream* strm, compress_job* job) {
+    if (deflateReset(strm) != Z_OK)
+        return -1;
+    if (job->dict_len > 0 && deflateSetDictionary(strm, job->dict, job->dict_len) != Z_OK)
+        return -1;
+
+    size_t bound = deflateBound(strm, job->in_len) + 16;
+    if (job->out_size < bound) {
+        unsigned char* out = realloc(job->out, bound);
+        if (out == NULL)
+            return -1;
+        job->out = out;
+        job->out_size = bound;
+    }
+
+    // every block but the last ends on a byte boundary with a sync flush,
+    // so the raw deflate streams can simply be concatenated
+    int flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+    strm->next_in = job->in;
+    strm->avail_in = job->in_len;
+    strm->next_out = job->out;
+    strm->avail_out = job->out_size;
+    for (;;) {
+        int ret = deflate(strm, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+        if (flush == Z_FINISH ? ret == Z_STREAM_END : strm->avail_in == 0 && strm->avail_out > 0)
+            break;
+        size_t used = job->out_size - strm->avail_out;
+        unsigned char* out = realloc(job->out, job->out_size * 2);
+        if (out == NULL)
+            return -1;
+        job->out = out;
+        job->out_size *= 2;
+        strm->next_out = job->out + used;
+        strm->avail_out = job->out_size - used;
+    }
+    job->out_len = job->out_size - strm->avail_out;
+    job->crc = crc32(0, job->in, job->in_len);
+    return 0;
+}
+
+static int compress_lz4_block(uint32_t* table, compress_job* job) {
+    size_t bound = 4 + lz4_bound(job->in_len);
+    if (job->out_size < bound) {
+        unsigned char* out = realloc(job->out, bound);
+        if (out == NULL)
+            return -1;
+        job->out = out;
+        job->out_size = bound;
+    }
+
+    if (job->in_len == 0) {
+        job->out_len = 0;
+        return 0;
+    }
+    size_t len = lz4_compress_block(job->in, job->in_len, job->out + 4, table);
+    // blocks that don't shrink are stored as they are
+    if (len >= job->in_len) {
+        memcpy(job->out + 4, job->in, job->in_len);
+        put_le32(job->out, job->in_len | LZ4_UNCOMPRESSED);
+        job->out_len = 4 + job->in_len;
+    }
+    else {
+        put_le32(job->out, len);
+        job->out_len = 4 + len;
+    }
+    return 0;
+}
+
+static void* compress_worker(void* cookie) {
+    compress_sink* s = cookie;
+    z_stream strm;
+    uint32_t* table = NULL;
+    int ready;
+
+    memset(&strm, 0, sizeof(strm));
+    if (s->codec == NANDROID_CODEC_GZIP)
+        ready = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    else
+        ready = (table = malloc(sizeof(uint32_t) << LZ4_HASH_LOG)) != NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!s->stop && s->started == s->submitted)
+            pthread_cond_wait(&s->work_ready, &s->lock);
+        if (s->started == s->submitted) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        compress_job* job = &s->jobs[s->started++ % s->job_count];
+        pthread_mutex_unlock(&s->lock);
+
+        int ret = -1;
+        if (ready) {
+            if (s->codec == NANDROID_CODEC_GZIP)
+                ret = compress_gzip_block(&strm, job);
+            else
+                ret = compress_lz4_block(table, job);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        job->error = ret;
+        job->done = 1;
+        pthread_cond_broadcast(&s->job_done);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (s->codec == NANDROID_CODEC_GZIP && ready)
+        deflateEnd(&strm);
+    free(table);
+    return NULL;
+}
+
+// Waits for the oldest block in flight and passes it on.
+static int compress_write_oldest(compress_sink* s) {
+    compress_job* job = &s->jobs[s->written % s->job_count];
+    pthread_mutex_lock(&s->lock);
+    while (!job->done)
+        pthread_cond_wait(&s->job_done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    if (job->error) {
+        LOGE("Unable to compress backup data\n");
+        s->error = -1;
+    }
+    else if (!s->error) {
+        // every block before this one was full
+        if (s->seek != NULL && s->written % COMPRESS_SEEK_BLOCKS == 0)
+            s->seek(s->cookie, (uint64_t)s->written * COMPRESS_BLOCK_SIZE, s->out_offset);
+        if (s->next->write(s->next, job->out, job->out_len))
+            s->error = -1;
+        s->out_offset += job->out_len;
+        if (s->codec == NANDROID_CODEC_GZIP) {
+            s->crc = crc32_combine(s->crc, job->crc, job->in_len);
+            s->length += job->in_len;
+        }
+    }
+    job->in_len = 0;
+    job->done = 0;
+    s->written++;
+    return s->error;
+}
+
+// Makes the block being filled ready to take input.
+static int compress_reserve(compress_sink* s) {
+    // the slot of the previous block stays untouched too, as the
+    // dictionary of this one
+    while (s->submitted - s->written >= (unsigned long)s->job_count - 1) {
+        if (compress_write_oldest(s))
+            return -1;
+    }
+    compress_job* job = &s->jobs[s->submitted % s->job_count];
+    job->dict_len = 0;
+    if (s->codec == NANDROID_CODEC_GZIP && s->submitted > 0 && (s->seek == NULL || s->submitted % COMPRESS_SEEK_BLOCKS != 0)) {
+        compress_job* prev = &s->jobs[(s->submitted - 1) % s->job_count];
+        job->dict_len = prev->in_len < GZIP_DICT_SIZE ? prev->in_len : GZIP_DICT_SIZE;
+        job->dict = prev->in + prev->in_len - job->dict_len;
+    }
+    return 0;
+}
+
+static void compress_submit(compress_sink* s, int last) {
+    pthread_mutex_lock(&s->lock);
+    s->jobs[s->submitted % s->job_count].last = last;
+    s->submitted++;
+    pthread_cond_signal(&s->work_ready);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int compress_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    compress_sink* s = (compress_sink*)sink;
+    const unsigned char* p = data;
+    while (len > 0) {
+        if (s->error || compress_reserve(s))
+            return -1;
+        compress_job* job = &s->jobs[s->submitted % s->job_count];
+        size_t chunk = COMPRESS_BLOCK_SIZE - job->in_len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(job->in + job->in_len, p, chunk);
+        job->in_len += chunk;
+        p += chunk;
+        len -= chunk;
+        if (job->in_len == COMPRESS_BLOCK_SIZE)
+            compress_submit(s, 0);
+    }
+    return s->error;
+}
+
+static int compress_sink_close(nandroid_sink* sink) {
+    compress_sink* s = (compress_sink*)sink;
+    int i;
+
+    // gzip always ends with a final block, even an empty one
+    if (!s->error && !compress_reserve(s)) {
+        if (s->jobs[s->submitted % s->job_count].in_len > 0 || s->codec == NANDROID_CODEC_GZIP)
+            compress_submit(s, 1);
+    }
+    while (s->written < s->submitted)
+        compress_write_oldest(s);
+
+    if (!s->error) {
+        unsigned char trailer[8];
+        if (s->codec == NANDROID_CODEC_GZIP) {
+            put_le32(trailer, s->crc);
+            put_le32(trailer + 4, s->length);
+            s->error = s->next->write(s->next, trailer, 8);
+        }
+        else {
+            // end mark
+            put_le32(trailer, 0);
+            s->error = s->next->write(s->next, trailer, 4);
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->work_ready);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->thread_count; i++)
+        pthread_join(s->threads[i], NULL);
+
+    int ret = s->error;
+    if (s->next->close(s->next))
+        ret = -1;
+    for (i = 0; i < s->job_count; i++) {
+        free(s->jobs[i].in);
+        free(s->jobs[i].out);
+    }
+    free(s->jobs);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work_ready);
+    pthread_cond_destroy(&s->job_done);
+    free(s);
+    return ret;
+}
+
+static int compress_write_header(compress_sink* s) {
+    unsigned char header[10];
+    if (s->codec == NANDROID_CODEC_GZIP) {
+        // no name, no mtime, unix
+        memset(header, 0, sizeof(header));
+        header[0] = 0x1f;
+        header[1] = 0x8b;
+        header[2] = Z_DEFLATED;
+        header[9] = 3;
+        s->out_offset = 10;
+        return s->next->write(s->next, header, 10);
+    }
+
+    put_le32(header, LZ4_MAGIC);
+    header[4] = LZ4_FLG;
+    header[5] = LZ4_BD;
+    header[6] = lz4_xxh32_short(header + 4, 2) >> 8;
+    s->out_offset = 7;
+    return s->next->write(s->next, header, 7);
+}
+
+nandroid_sink* compress_sink_open(nandroid_sink* next, int codec, nandroid_seek_callback seek, void* cookie) {
+    if (next == NULL)
+        return NULL;
+
+    compress_sink* s = calloc(1, sizeof(compress_sink));
+    if (s == NULL) {
+        next->close(next);
+        return NULL;
+    }
+    s->sink.write = compress_sink_write;
+    s->sink.close = compress_sink_close;
+    s->next = next;
+    s->codec = codec;
+    s->seek = seek;
+    s->cookie = cookie;
+    s->crc = crc32(0, NULL, 0);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work_ready, NULL);
+    pthread_cond_init(&s->job_done, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > COMPRESS_MAX_THREADS ? COMPRESS_MAX_THREADS : cpus;
+    // enough blocks to keep every worker busy while the oldest one is
+    // being written out and the newest one filled
+    s->job_count = threads * 2 + 2;
+    s->jobs = calloc(s->job_count, sizeof(compress_job));
+    if (s->jobs == NULL)
+        s->job_count = 0;
+    int i;
+    for (i = 0; s->jobs != NULL && i < s->job_count; i++) {
+        if ((s->jobs[i].in = malloc(COMPRESS_BLOCK_SIZE)) == NULL)
+            break;
+    }
+    if (s->jobs == NULL || i < s->job_count || compress_write_header(s)) {
+        LOGE("Unable to start compression\n");
+        s->error = -1;
+    }
+    for (i = 0; !s->error && i < threads; i++) {
+        if (pthread_create(&s->threads[i], NULL, compress_worker, s))
+            break;
+        s->thread_count++;
+    }
+    if (s->thread_count == 0)
+        s->error = -1;
+
+    if (s->error) {
+        compress_sink_close(&s->sink);
+        return NULL;
+    }
+    return &s->sink;
+}
+
+typedef struct {
+    char image[PATH_MAX];
+    char path[PATH_MAX];
+    int fd;
+    // -1 for the image itself, then its volumes
+    int volume;
+    int found;
+    nandroid_verify_callback verify;
+    MD5_CTX md5;
+    // reads a stream instead of the volumes when set
+    nandroid_read_callback read;
+    void* cookie;
+} volume_reader;
+
+// Opens the next file, skipping a missing image or stopping at the first
+// missing volume. Returns 1 when there is nothing left.
+static int volume_open_next(volume_reader* r) {
+    while (r->volume < 26) {
+        if (r->volume < 0)
+            strcpy(r->path, r->image);
+        else
+            snprintf(r->path, sizeof(r->path), "%s.%c", r->image, 'a' + r->volume);
+        r->volume++;
+        r->fd = open(r->path, O_RDONLY);
+        if (r->fd >= 0) {
+            r->found = 1;
+            MD5_Init(&r->md5);
+            return 0;
+        }
+        if (errno != ENOENT) {
+            LOGE("Unable to open %s\n", r->path);
+            return -1;
+        }
+        if (r->volume > 0)
+            break;
+    }
+    r->volume = 26;
+    if (!r->found) {
+        LOGE("Unable to open %s\n", r->image);
+        return -1;
+    }
+    return 1;
+}
+
+// Reads the image and its volumes as one stream, the way "cat image*"
+// did. Returns 0 at the end of the last one.
+static ssize_t volume_read(volume_reader* r, void* buf, size_t len) {
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    if (r->read != NULL)
+        return r->read(r->cookie, buf, len);
+    for (;;) {
+        if (r->fd < 0) {
+            int ret = volume_open_next(r);
+            if (ret)
+                return ret < 0 ? -1 : 0;
+        }
+        ssize_t n = read(r->fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            LOGE("Unable to read %s\n", r->path);
+        if (n != 0) {
+            if (n > 0 && r->verify != NULL)
+                MD5_Update(&r->md5, buf, n);
+            return n;
+        }
+        close(r->fd);
+        r->fd = -1;
+        if (r->verify != NULL) {
+            MD5_Final(md5, &r->md5);
+            if (r->verify(r->path, md5))
+                return -1;
+        }
+    }
+}
+
+// Returns 0 once len bytes are read, 1 at a clean end of the stream and
+// -1 on errors or a truncated stream.
+static int volume_read_fully(volume_reader* r, void* buf, size_t len) {
+    unsigned char* p = buf;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = volume_read(r, p + total, len - total);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return total == 0 ? 1 : -1;
+        total += n;
+    }
+    return 0;
+}
+
+static int decompress_gzip(volume_reader* r, nandroid_sink* out, unsigned char* in, unsigned char* buf) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // 32 selects gzip decoding
+    if (inflateInit2(&strm, 15 + 32) != Z_OK)
+        return -1;
+
+    int ret = 0;
+    int ended = 0;
+    for (;;) {
+        if (strm.avail_in == 0) {
+            ssize_t n = volume_read(r, in, COMPRESS_BLOCK_SIZE);
+            if (n <= 0) {
+                if (n < 0 || !ended)
+                    ret = -1;
+                break;
+            }
+            strm.next_in = in;
+            strm.avail_in = n;
+        }
+        // concatenated gzip members are one stream, as gunzip sees them
+        if (ended) {
+            inflateReset(&strm);
+            ended = 0;
+        }
+        strm.next_out = buf;
+        strm.avail_out = COMPRESS_BLOCK_SIZE;
+        int status = inflate(&strm, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            ret = -1;
+            break;
+        }
+        if (out->write(out, buf, COMPRESS_BLOCK_SIZE - strm.avail_out)) {
+            ret = -1;
+            break;
+        }
+        if (status == Z_STREAM_END)
+            ended = 1;
+    }
+    inflateEnd(&strm);
+    return ret;
+}
+
+static int decompress_lz4(volume_reader* r, nandroid_sink* out, unsigned char* in, unsigned char* buf) {
+    unsigned char header[15];
+    if (volume_read_fully(r, header, 6) || get_le32(header) != LZ4_MAGIC)
+        return -1;
+    int flags = header[4];
+    size_t descriptor_len = flags & LZ4_FLG_CONTENT_SIZE ? 11 : 3;
+    if (volume_read_fully(r, header + 6, descriptor_len - 2))
+        return -1;
+    if (header[4 + descriptor_len - 1] != ((lz4_xxh32_short(header + 4, descriptor_len - 1) >> 8) & 0xff))
+        return -1;
+    // only independent blocks of up to 256KB, as written above
+    int block_size_id = (header[5] >> 4) & 7;
+    if ((flags & 0xe0) != LZ4_FLG || block_size_id < 4 || block_size_id > 5)
+        return -1;
+
+    for (;;) {
+        unsigned char size[4];
+        if (volume_read_fully(r, size, 4))
+            return -1;
+        uint32_t len = get_le32(size);
+        if (len == 0)
+            break;
+        int uncompressed = (len & LZ4_UNCOMPRESSED) != 0;
+        len &= ~LZ4_UNCOMPRESSED;
+        if (len > COMPRESS_BLOCK_SIZE || volume_read_fully(r, in, len))
+            return -1;
+        if (flags & LZ4_FLG_BLOCK_CHECKSUM && volume_read_fully(r, size, 4))
+            return -1;
+
+        if (uncompressed) {
+            if (out->write(out, in, len))
+                return -1;
+            continue;
+        }
+        ssize_t n = lz4_decompress_block(in, len, buf, COMPRESS_BLOCK_SIZE);
+        if (n < 0 || out->write(out, buf, n))
+            return -1;
+    }
+    if (flags & LZ4_FLG_CONTENT_CHECKSUM) {
+        unsigned char checksum[4];
+        if (volume_read_fully(r, checksum, 4))
+            return -1;
+    }
+    return 0;
+}
+
+static int copy_volumes(volume_reader* r, nandroid_sink* out, unsigned char* buf) {
+    ssize_t n;
+    while ((n = volume_read(r, buf, COMPRESS_BLOCK_SIZE)) > 0) {
+        if (out->write(out, buf, n))
+            return -1;
+    }
+    return n < 0 ? -1 : 0;
+}
+
+static int decompress_reader(volume_reader* r, const char* name, int codec, nandroid_sink* out) {
+    unsigned char* in = malloc(COMPRESS_BLOCK_SIZE);
+    unsigned char* buf = malloc(COMPRESS_BLOCK_SIZE);
+    int ret = -1;
+    if (in != NULL && buf != NULL) {
+        if (codec == NANDROID_CODEC_GZIP)
+            ret = decompress_gzip(r, out, in, buf);
+        else if (codec == NANDROID_CODEC_LZ4)
+            ret = decompress_lz4(r, out, in, buf);
+        else
+            ret = copy_volumes(r, out, buf);
+        // whatever follows the compressed stream still gets verified
+        ssize_t n = 0;
+        while (ret == 0 && (n = volume_read(r, in, COMPRESS_BLOCK_SIZE)) > 0)
+            ;
+        if (n < 0)
+            ret = -1;
+        if (ret)
+            LOGE("Unable to read %s\n", name);
+    }
+    if (r->fd >= 0)
+        close(r->fd);
+    free(in);
+    free(buf);
+    return ret;
+}
+
+int decompress_volumes(const char* image, int codec, nandroid_sink* out, nandroid_verify_callback verify) {
+    volume_reader r;
+    memset(&r, 0, sizeof(r));
+    strncpy(r.image, image, sizeof(r.image) - 3);
+    r.fd = -1;
+    r.volume = -1;
+    r.verify = verify;
+    return decompress_reader(&r, image, codec, out);
+}
+
+int decompress_stream(nandroid_read_callback read, void* cookie, int codec, nandroid_sink* out) {
+    volume_reader r;
+    memset(&r, 0, sizeof(r));
+    r.fd = -1;
+    r.read = read;
+    r.cookie = cookie;
+    return decompress_reader(&r, "stream", codec, out);
+}
+
+// Passes on the part of what it is given between start and end. Returns
+// 1 once it is past end.
+typedef struct {
+    nandroid_sink* out;
+    uint64_t offset;
+    uint64_t start;
+    uint64_t end;
+} range_writer;
+
+static int range_write(range_writer* w, const unsigned char* data, size_t len) {
+    uint64_t from = w->offset;
+    uint64_t to = w->offset + len;
+    w->offset = to;
+    if (from < w->start)
+        from = w->start;
+    if (to > w->end)
+        to = w->end;
+    if (from < to && w->out->write(w->out, data + (from - (w->offset - len)), to - from))
+        return -1;
+    return w->offset >= w->end;
+}
+
+static int decompress_gzip_range(volume_reader* r, range_writer* w, unsigned char* in, unsigned char* buf) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // a seek point is the start of a raw deflate block
+    if (inflateInit2(&strm, -15) != Z_OK)
+        return -1;
+
+    int ret = 0;
+    for (;;) {
+        if (strm.avail_in == 0) {
+            ssize_t n = volume_read(r, in, COMPRESS_BLOCK_SIZE);
+            if (n <= 0) {
+                ret = -1;
+                break;
+            }
+            strm.next_in = in;
+            strm.avail_in = n;
+        }
+        strm.next_out = buf;
+        strm.avail_out = COMPRESS_BLOCK_SIZE;
+        int status = inflate(&strm, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            ret = -1;
+            break;
+        }
+        ret = range_write(w, buf, COMPRESS_BLOCK_SIZE - strm.avail_out);
+        if (ret != 0 || status == Z_STREAM_END) {
+            // the stream ending before end means the index was wrong
+            ret = ret > 0 ? 0 : -1;
+            break;
+        }
+    }
+    inflateEnd(&strm);
+    return ret;
+}
+
+static int decompress_lz4_range(volume_reader* r, range_writer* w, unsigned char* in, unsigned char* buf) {
+    for (;;) {
+        unsigned char size[4];
+        if (volume_read_fully(r, size, 4))
+            return -1;
+        uint32_t len = get_le32(size);
+        if (len == 0)
+            return -1;
+        int uncompressed = (len & LZ4_UNCOMPRESSED) != 0;
+        len &= ~LZ4_UNCOMPRESSED;
+        if (len > COMPRESS_BLOCK_SIZE || volume_read_fully(r, in, len))
+            return -1;
+
+        int ret;
+        if (uncompressed) {
+            ret = range_write(w, in, len);
+        } else {
+            ssize_t n = lz4_decompress_block(in, len, buf, COMPRESS_BLOCK_SIZE);
+            ret = n < 0 ? -1 : range_write(w, buf, n);
+        }
+        if (ret != 0)
+            return ret > 0 ? 0 : -1;
+    }
+}
+
+int decompress_range(const char* image, int codec, uint64_t volume_size, uint64_t seek_offset, uint64_t compressed_offset,
+        uint64_t start, uint64_t end, nandroid_sink* out) {
+    volume_reader r;
+    range_writer w;
+    memset(&r, 0, sizeof(r));
+    strncpy(r.image, image, sizeof(r.image) - 3);
+    r.fd = -1;
+    // plain archives are read from start itself
+    if (codec == NANDROID_CODEC_NONE)
+        seek_offset = compressed_offset = start;
+    r.volume = compressed_offset / volume_size;
+    w.out = out;
+    w.offset = seek_offset;
+    w.start = start;
+    w.end = end;
+    if (start >= end)
+        return 0;
+
+    unsigned char* in = malloc(COMPRESS_BLOCK_SIZE);
+    unsigned char* buf = malloc(COMPRESS_BLOCK_SIZE);
+    int ret = -1;
+    if (in != NULL && buf != NULL && volume_open_next(&r) == 0 &&
+            lseek(r.fd, compressed_offset % volume_size, SEEK_SET) != (off_t)-1) {
+        if (codec == NANDROID_CODEC_GZIP) {
+            ret = decompress_gzip_range(&r, &w, in, buf);
+        } else if (codec == NANDROID_CODEC_LZ4) {
+            ret = decompress_lz4_range(&r, &w, in, buf);
+        } else {
+            ssize_t n;
+            while ((n = volume_read(&r, buf, COMPRESS_BLOCK_SIZE)) > 0 && (ret = range_write(&w, buf, n)) == 0)
+                ;
+            ret = ret > 0 ? 0 : -1;
+        }
+    }
+    if (ret)
+        LOGE("Unable to read %s\n", image);
+    if (r.fd >= 0)
+        close(r.fd);
+    free(in);
+    free(buf);
+    return ret;
+}
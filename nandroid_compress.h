@@ -0,0 +1,47 @@
+#ifndef NANDROID_COMPRESS_H
+#define NANDROID_COMPRESS_H
+
+#include <sys/types.h>
+
+#include "nandroid_tar.h"
+
+// plain tar, only read back by decompress_volumes
+#define NANDROID_CODEC_NONE 0
+// gzip compatible output, readable by gunzip and pigz
+#define NANDROID_CODEC_GZIP 1
+// lz4 frames, much faster than gzip at a lower ratio
+#define NANDROID_CODEC_LZ4 2
+
+// Called with the points the compressed stream can be decompressed from
+// without what comes before them: offset into the input, and the offset
+// of the compressed data for it.
+typedef void (*nandroid_seek_callback)(void* cookie, uint64_t offset, uint64_t compressed_offset);
+
+// Compresses everything written to it into next, splitting the input
+// into blocks that are compressed on one thread per cpu. next is closed
+// along with the returned sink, or right away if it can't be created.
+// seek, if given, gets a seek point every few megabytes.
+nandroid_sink* compress_sink_open(nandroid_sink* next, int codec, nandroid_seek_callback seek, void* cookie);
+
+// Called with the md5 of every file read back. Returns non-zero to fail
+// the read on a mismatch.
+typedef int (*nandroid_verify_callback)(const char* path, const unsigned char* md5);
+
+// Decompresses image followed by its volumes image.a, image.b, ... as
+// written by volume_sink_open into out, which is not closed. verify, if
+// given, checks each file as soon as it has been read.
+int decompress_volumes(const char* image, int codec, nandroid_sink* out, nandroid_verify_callback verify);
+
+// Returns like read(2), with 0 at the end of the stream.
+typedef ssize_t (*nandroid_read_callback)(void* cookie, void* buf, size_t len);
+
+// Decompresses what read returns into out, which is not closed.
+int decompress_stream(nandroid_read_callback read, void* cookie, int codec, nandroid_sink* out);
+
+// Decompresses the input between start and end into out, starting at a
+// seek point at or before start. Volumes are volume_size bytes each.
+// Nothing is verified, as only part of the volumes is read.
+int decompress_range(const char* image, int codec, uint64_t volume_size, uint64_t seek_offset, uint64_t compressed_offset,
+        uint64_t start, uint64_t end, nandroid_sink* out);
+
+#endif
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "nandroid_index.h"
+
+#define INDEX_MIN_BUCKETS 1024
+
+// what index_filter made of an entry of the previous index
+#define INDEX_GONE 0
+#define INDEX_SEEN 1
+#define INDEX_REPLACED 2
+
+typedef struct index_entry {
+    struct index_entry* next;
+    uint64_t ino;
+    uint64_t size;
+    long mtime;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    int state;
+    char path[];
+} index_entry;
+
+struct nandroid_index {
+    index_entry** buckets;
+    size_t bucket_count;
+    size_t count;
+};
+
+static uint32_t index_hash(const char* path) {
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (; *path != '\0'; path++)
+        hash = (hash ^ (unsigned char)*path) * 16777619U;
+    return hash;
+}
+
+static int index_grow(nandroid_index* index) {
+    size_t count = index->bucket_count * 2;
+    index_entry** buckets = calloc(count, sizeof(index_entry*));
+    if (buckets == NULL)
+        return -1;
+    size_t i;
+    for (i = 0; i < index->bucket_count; i++) {
+        while (index->buckets[i] != NULL) {
+            index_entry* e = index->buckets[i];
+            index->buckets[i] = e->next;
+            index_entry** bucket = &buckets[index_hash(e->path) & (count - 1)];
+            e->next = *bucket;
+            *bucket = e;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = count;
+    return 0;
+}
+
+static index_entry* index_find(nandroid_index* index, const char* path) {
+    index_entry* e;
+    for (e = index->buckets[index_hash(path) & (index->bucket_count - 1)]; e != NULL; e = e->next) {
+        if (strcmp(e->path, path) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+nandroid_index* index_load(const char* path) {
+    char line[PATH_MAX + 128];
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    nandroid_index* index = calloc(1, sizeof(nandroid_index));
+    if (index == NULL || (index->buckets = calloc(INDEX_MIN_BUCKETS, sizeof(index_entry*))) == NULL) {
+        free(index);
+        fclose(f);
+        return NULL;
+    }
+    index->bucket_count = INDEX_MIN_BUCKETS;
+
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long ino;
+        unsigned long long size;
+        long mtime;
+        unsigned int mode;
+        unsigned int uid;
+        unsigned int gid;
+        int offset = -1;
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        sscanf(line, "%llu\t%llu\t%ld\t%o\t%u\t%u\t%n", &ino, &size, &mtime, &mode, &uid, &gid, &offset);
+        if (offset < 0 || line[offset] == '\0') {
+            LOGE("Bad entry in %s\n", path);
+            ret = -1;
+            break;
+        }
+
+        index_entry* e = malloc(sizeof(index_entry) + len - offset + 1);
+        if (e == NULL || (index->count >= index->bucket_count && index_grow(index))) {
+            free(e);
+            ret = -1;
+            break;
+        }
+        e->ino = ino;
+        e->size = size;
+        e->mtime = mtime;
+        e->mode = mode;
+        e->uid = uid;
+        e->gid = gid;
+        e->state = INDEX_GONE;
+        strcpy(e->path, line + offset);
+        index_entry** bucket = &index->buckets[index_hash(e->path) & (index->bucket_count - 1)];
+        e->next = *bucket;
+        *bucket = e;
+        index->count++;
+    }
+    if (ferror(f))
+        ret = -1;
+    fclose(f);
+    if (ret) {
+        index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+void index_free(nandroid_index* index) {
+    if (index == NULL)
+        return;
+    size_t i;
+    for (i = 0; i < index->bucket_count; i++) {
+        while (index->buckets[i] != NULL) {
+            index_entry* next = index->buckets[i]->next;
+            free(index->buckets[i]);
+            index->buckets[i] = next;
+        }
+    }
+    free(index->buckets);
+    free(index);
+}
+
+int index_filter(void* cookie, const char* path, const struct stat* st) {
+    index_builder* b = (index_builder*)cookie;
+
+    // a newline would end the entry early, so such paths are left out of
+    // the index and stored every time
+    if (strchr(path, '\n') != NULL)
+        return 1;
+    if (fprintf(b->out, "%llu\t%llu\t%ld\t%o\t%u\t%u\t%s\n", (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+            (long)st->st_mtime, (unsigned int)st->st_mode, (unsigned int)st->st_uid, (unsigned int)st->st_gid, path) < 0) {
+        LOGE("Unable to write index entry for %s\n", path);
+        b->error = -1;
+        return -1;
+    }
+    if (b->previous == NULL)
+        return 1;
+
+    index_entry* e = index_find(b->previous, path);
+    if (e == NULL)
+        return 1;
+    // the old entry has to go before a new one of another type can be
+    // extracted in its place
+    if ((e->mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+        e->state = INDEX_REPLACED;
+        return 1;
+    }
+    e->state = INDEX_SEEN;
+    return e->ino != st->st_ino || e->size != (uint64_t)st->st_size || e->mtime != (long)st->st_mtime ||
+            e->mode != st->st_mode || e->uid != st->st_uid || e->gid != st->st_gid;
+}
+
+static int index_compare_reverse(const void* a, const void* b) {
+    return strcmp(*(const char* const*)b, *(const char* const*)a);
+}
+
+int index_write_deletions(nandroid_index* previous, FILE* out) {
+    const char** paths = malloc((previous->count + 1) * sizeof(char*));
+    size_t count = 0;
+    size_t i;
+    if (paths == NULL)
+        return -1;
+
+    index_entry* e;
+    for (i = 0; i < previous->bucket_count; i++) {
+        for (e = previous->buckets[i]; e != NULL; e = e->next) {
+            if (e->state != INDEX_SEEN)
+                paths[count++] = e->path;
+        }
+    }
+    // a path sorts after its parent, so reverse order removes children
+    // first
+    qsort(paths, count, sizeof(char*), index_compare_reverse);
+
+    int ret = 0;
+    for (i = 0; i < count && ret == 0; i++) {
+        if (fprintf(out, "%s\n", paths[i]) < 0)
+            ret = -1;
+    }
+    free(paths);
+    return ret;
+}
+
+int index_apply_deletions(FILE* list, const char* dir) {
+    char line[PATH_MAX];
+    char path[PATH_MAX];
+    int ret = 0;
+
+    while (fgets(line, sizeof(line), list) != NULL) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, line);
+        if (remove(path) != 0 && errno != ENOENT) {
+            LOGE("Unable to remove %s\n", path);
+            ret = -1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef NANDROID_INDEX_H
+#define NANDROID_INDEX_H
+
+#include <stdio.h>
+
+#include <sys/stat.h>
+
+// Every entry of a partition as it was backed up, one line each:
+// inode, size, mtime, mode, uid and gid followed by the archive path.
+// Incremental backups compare against the index of the backup before
+// them to find what changed.
+typedef struct nandroid_index nandroid_index;
+
+// Returns NULL if path can't be read.
+nandroid_index* index_load(const char* path);
+void index_free(nandroid_index* index);
+
+// Passed as the cookie of index_filter. previous may be NULL, in which
+// case everything is archived.
+typedef struct {
+    nandroid_index* previous;
+    // the index of this backup, written as the tree is walked
+    FILE* out;
+    int error;
+} index_builder;
+
+// A nandroid_tar_filter that stores new and changed entries and writes
+// every entry to the builder's index.
+int index_filter(void* cookie, const char* path, const struct stat* st);
+
+// Writes the paths of previous that are gone, or have become a
+// different type of file, since index_filter last looked at it. Children
+// come before their directory, so they can be removed in order.
+int index_write_deletions(nandroid_index* previous, FILE* out);
+
+// Removes the paths of a list written by index_write_deletions from
+// under dir.
+int index_apply_deletions(FILE* list, const char* dir);
+
+#endif
@@ -0,0 +1,432 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nandroid_members.h"
+
+#define TAR_BLOCK_SIZE 512
+// pax headers longer than this only hold what nandroid doesn't look at
+#define MEMBERS_MAX_PAX (64 * 1024)
+
+struct members_writer {
+    FILE* out;
+    char path[PATH_MAX];
+    int error;
+};
+
+members_writer* members_writer_open(const char* path, uint64_t volume_size) {
+    members_writer* w = calloc(1, sizeof(members_writer));
+    if (w == NULL)
+        return NULL;
+    strncpy(w->path, path, sizeof(w->path) - 1);
+    w->out = fopen(path, "w");
+    if (w->out == NULL) {
+        free(w);
+        return NULL;
+    }
+    if (fprintf(w->out, "volume %llu\n", (unsigned long long)volume_size) < 0)
+        w->error = -1;
+    return w;
+}
+
+void members_seek(void* cookie, uint64_t offset, uint64_t compressed_offset) {
+    members_writer* w = (members_writer*)cookie;
+    if (fprintf(w->out, "seek %llu %llu\n", (unsigned long long)offset, (unsigned long long)compressed_offset) < 0)
+        w->error = -1;
+}
+
+int members_writer_close(members_writer* w, int complete) {
+    if (w == NULL)
+        return 0;
+    int ret = w->error;
+    if (fclose(w->out))
+        ret = -1;
+    if (ret || !complete)
+        unlink(w->path);
+    free(w);
+    return ret;
+}
+
+// Follows the tar stream a block at a time: headers are gathered whole,
+// pax records are kept to find long paths in, and file data is skipped.
+typedef struct {
+    nandroid_sink sink;
+    nandroid_sink* next;
+    members_writer* w;
+    uint64_t offset;
+    char header[TAR_BLOCK_SIZE];
+    size_t header_fill;
+    uint64_t skip;
+    // the pax header being read, and what it said
+    char* pax;
+    size_t pax_len;
+    size_t pax_fill;
+    char pax_path[PATH_MAX];
+    int has_pax_path;
+    uint64_t pax_size;
+    int has_pax_size;
+    // where the entry being read began, with its pax header
+    uint64_t entry_start;
+    int in_entry;
+    int ended;
+} members_sink;
+
+static uint64_t tar_number(const char* field, size_t size) {
+    uint64_t value = 0;
+    size_t i;
+    for (i = 0; i < size && field[i] == ' '; i++)
+        ;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static uint64_t tar_padded(uint64_t len) {
+    return (len + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+static void members_parse_pax(members_sink* s) {
+    char* p = s->pax;
+    char* end = s->pax + s->pax_fill;
+    while (p < end) {
+        char* space = memchr(p, ' ', end - p);
+        size_t record_len = strtoul(p, NULL, 10);
+        if (space == NULL || record_len == 0 || record_len > (size_t)(end - p))
+            break;
+        char* key = space + 1;
+        char* value_end = p + record_len - 1;
+        char* equals = memchr(key, '=', value_end - key);
+        if (equals != NULL) {
+            size_t value_len = value_end - equals - 1;
+            if (equals - key == 4 && strncmp(key, "path", 4) == 0 && value_len < sizeof(s->pax_path)) {
+                memcpy(s->pax_path, equals + 1, value_len);
+                s->pax_path[value_len] = '\0';
+                s->has_pax_path = 1;
+            } else if (equals - key == 4 && strncmp(key, "size", 4) == 0) {
+                s->pax_size = strtoull(equals + 1, NULL, 10);
+                s->has_pax_size = 1;
+            }
+        }
+        p += record_len;
+    }
+}
+
+static int members_header(members_sink* s) {
+    uint64_t header_offset = s->offset - TAR_BLOCK_SIZE;
+    size_t i;
+    for (i = 0; i < TAR_BLOCK_SIZE && s->header[i] == '\0'; i++)
+        ;
+    if (i == TAR_BLOCK_SIZE) {
+        s->ended = 1;
+        if (fprintf(s->w->out, "end %llu\n", (unsigned long long)header_offset) < 0)
+            return -1;
+        return 0;
+    }
+    if (memcmp(s->header + 257, "ustar", 5) != 0) {
+        LOGE("Unexpected tar header at %llu\n", (unsigned long long)header_offset);
+        return -1;
+    }
+
+    if (!s->in_entry) {
+        s->entry_start = header_offset;
+        s->in_entry = 1;
+    }
+    char type = s->header[156];
+    uint64_t size = tar_number(s->header + 124, 12);
+    if (type == 'x' || type == 'g') {
+        // only a pax header of this entry says anything about it
+        if (type == 'x' && size <= MEMBERS_MAX_PAX) {
+            free(s->pax);
+            s->pax = malloc(size + 1);
+            if (s->pax == NULL)
+                return -1;
+            s->pax_len = size;
+            s->pax_fill = 0;
+        }
+        s->skip = tar_padded(size);
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    if (s->has_pax_path) {
+        strcpy(path, s->pax_path);
+    } else {
+        char name[101];
+        char prefix[156];
+        memcpy(name, s->header, 100);
+        name[100] = '\0';
+        memcpy(prefix, s->header + 345, 155);
+        prefix[155] = '\0';
+        if (prefix[0] != '\0')
+            snprintf(path, sizeof(path), "%s/%s", prefix, name);
+        else
+            strcpy(path, name);
+    }
+    if (s->has_pax_size)
+        size = s->pax_size;
+    if (strchr(path, '\n') != NULL)
+        path[0] = '\0';
+    if (fprintf(s->w->out, "entry %llu %llu %s\n", (unsigned long long)s->entry_start, (unsigned long long)size, path) < 0)
+        return -1;
+
+    // links, directories and devices have no data
+    s->skip = type == '1' || type == '2' || type == '3' || type == '4' || type == '5' || type == '6' ? 0 : tar_padded(size);
+    s->in_entry = 0;
+    s->has_pax_path = 0;
+    s->has_pax_size = 0;
+    return 0;
+}
+
+static int members_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    members_sink* s = (members_sink*)sink;
+    const char* p = data;
+    size_t left = len;
+
+    while (left > 0 && !s->ended && !s->w->error) {
+        size_t chunk;
+        if (s->skip > 0) {
+            chunk = s->skip < left ? s->skip : left;
+            if (s->pax != NULL) {
+                size_t wanted = s->pax_len - s->pax_fill;
+                size_t copy = chunk < wanted ? chunk : wanted;
+                memcpy(s->pax + s->pax_fill, p, copy);
+                s->pax_fill += copy;
+            }
+            s->skip -= chunk;
+            if (s->skip == 0 && s->pax != NULL) {
+                members_parse_pax(s);
+                free(s->pax);
+                s->pax = NULL;
+            }
+        } else {
+            chunk = TAR_BLOCK_SIZE - s->header_fill;
+            if (chunk > left)
+                chunk = left;
+            memcpy(s->header + s->header_fill, p, chunk);
+            s->header_fill += chunk;
+        }
+        p += chunk;
+        left -= chunk;
+        s->offset += chunk;
+        if (s->header_fill == TAR_BLOCK_SIZE) {
+            s->header_fill = 0;
+            if (members_header(s))
+                s->w->error = -1;
+        }
+    }
+    return s->next->write(s->next, data, len);
+}
+
+static int members_sink_close(nandroid_sink* sink) {
+    members_sink* s = (members_sink*)sink;
+    int ret = s->next->close(s->next);
+    // an archive that didn't end properly can't be indexed
+    if (!s->ended)
+        s->w->error = -1;
+    free(s->pax);
+    free(s);
+    return ret;
+}
+
+nandroid_sink* members_sink_open(nandroid_sink* next, members_writer* w) {
+    if (next == NULL || w == NULL)
+        return next;
+    members_sink* s = calloc(1, sizeof(members_sink));
+    if (s == NULL) {
+        w->error = -1;
+        return next;
+    }
+    s->sink.write = members_sink_write;
+    s->sink.close = members_sink_close;
+    s->next = next;
+    s->w = w;
+    return &s->sink;
+}
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    char* path;
+} members_entry;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t compressed_offset;
+} members_seek_entry;
+
+struct members_index {
+    uint64_t volume_size;
+    members_entry* entries;
+    size_t count;
+    members_seek_entry* seeks;
+    size_t seek_count;
+    uint64_t end;
+};
+
+static int members_grow(void** array, size_t count, size_t* capacity, size_t size) {
+    if (count < *capacity)
+        return 0;
+    size_t grown = *capacity == 0 ? 256 : *capacity * 2;
+    void* p = realloc(*array, grown * size);
+    if (p == NULL)
+        return -1;
+    *array = p;
+    *capacity = grown;
+    return 0;
+}
+
+members_index* members_load(const char* path) {
+    char line[PATH_MAX + 64];
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    members_index* index = calloc(1, sizeof(members_index));
+    if (index == NULL) {
+        fclose(f);
+        return NULL;
+    }
+
+    size_t capacity = 0;
+    size_t seek_capacity = 0;
+    int ended = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long a;
+        unsigned long long b;
+        int offset = -1;
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        if (sscanf(line, "entry %llu %llu %n", &a, &b, &offset) == 2 && offset >= 0) {
+            if (members_grow((void**)&index->entries, index->count, &capacity, sizeof(members_entry))) {
+                ret = -1;
+                break;
+            }
+            members_entry* e = &index->entries[index->count];
+            e->offset = a;
+            e->size = b;
+            if ((e->path = strdup(line + offset)) == NULL)
+                ret = -1;
+            else
+                index->count++;
+        } else if (sscanf(line, "seek %llu %llu", &a, &b) == 2) {
+            if (members_grow((void**)&index->seeks, index->seek_count, &seek_capacity, sizeof(members_seek_entry))) {
+                ret = -1;
+                break;
+            }
+            index->seeks[index->seek_count].offset = a;
+            index->seeks[index->seek_count].compressed_offset = b;
+            index->seek_count++;
+        } else if (sscanf(line, "volume %llu", &a) == 1) {
+            index->volume_size = a;
+        } else if (sscanf(line, "end %llu", &a) == 1) {
+            index->end = a;
+            ended = 1;
+        } else {
+            LOGE("Bad line in %s\n", path);
+            ret = -1;
+        }
+    }
+    if (ferror(f) || !ended || index->volume_size == 0)
+        ret = -1;
+    fclose(f);
+    if (ret) {
+        members_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+void members_free(members_index* index) {
+    if (index == NULL)
+        return;
+    size_t i;
+    for (i = 0; i < index->count; i++)
+        free(index->entries[i].path);
+    free(index->entries);
+    free(index->seeks);
+    free(index);
+}
+
+uint64_t members_volume_size(members_index* index) {
+    return index->volume_size;
+}
+
+int members_find(members_index* index, const char* path, uint64_t* start, uint64_t* end) {
+    size_t len = strlen(path);
+    size_t i;
+    for (i = 0; i < index->count; i++) {
+        const char* p = index->entries[i].path;
+        if (strncmp(p, path, len) == 0 && (p[len] == '\0' || (p[len] == '/' && p[len + 1] == '\0')))
+            break;
+    }
+    if (i == index->count || len == 0)
+        return -1;
+
+    const char* found = index->entries[i].path;
+    size_t found_len = strlen(found);
+    size_t j = i + 1;
+    // everything under a directory follows right after it
+    if (found[found_len - 1] == '/') {
+        while (j < index->count && (index->entries[j].path[0] == '\0' ||
+                strncmp(index->entries[j].path, found, found_len) == 0))
+            j++;
+    }
+    *start = index->entries[i].offset;
+    *end = j < index->count ? index->entries[j].offset : index->end;
+    return 0;
+}
+
+int members_seek_point(members_index* index, uint64_t offset, uint64_t* seek_offset, uint64_t* compressed_offset) {
+    int found = -1;
+    size_t i;
+    for (i = 0; i < index->seek_count && index->seeks[i].offset <= offset; i++) {
+        *seek_offset = index->seeks[i].offset;
+        *compressed_offset = index->seeks[i].compressed_offset;
+        found = 0;
+    }
+    return found;
+}
+
+static int members_compare(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+char** members_list(members_index* index, const char* dir) {
+    size_t len = strlen(dir);
+    size_t count = 0;
+    size_t capacity = 0;
+    char** names = NULL;
+    size_t i;
+
+    for (i = 0; i < index->count; i++) {
+        const char* p = index->entries[i].path;
+        if (p[0] == '\0' || strncmp(p, dir, len) != 0 || p[len] == '\0')
+            continue;
+        const char* slash = strchr(p + len, '/');
+        if (slash != NULL && slash[1] != '\0')
+            continue;
+        if (members_grow((void**)&names, count + 1, &capacity, sizeof(char*)) ||
+                (names[count] = strdup(p + len)) == NULL) {
+            break;
+        }
+        count++;
+    }
+    if (i < index->count) {
+        while (count > 0)
+            free(names[--count]);
+        free(names);
+        return NULL;
+    }
+    if (names == NULL && (names = malloc(sizeof(char*))) == NULL)
+        return NULL;
+    qsort(names, count, sizeof(char*), members_compare);
+    names[count] = NULL;
+    return names;
+}
@@ -0,0 +1,55 @@
+#ifndef NANDROID_MEMBERS_H
+#define NANDROID_MEMBERS_H
+
+#include <stdint.h>
+
+#include "nandroid_tar.h"
+
+// Where every entry of a tar backup starts in the archive, and the
+// points a compressed archive can be decompressed from, so single files
+// can be restored without reading the whole backup. One line each:
+//   volume <size of the volumes the archive is split into>
+//   seek <archive offset> <offset into the compressed stream>
+//   entry <archive offset> <size> <path>
+//   end <archive offset of the end of the entries>
+// An entry starts with its pax header, if it has one. Entries whose
+// path has a newline in it are listed with an empty path.
+
+typedef struct members_writer members_writer;
+
+// Returns NULL if path can't be written.
+members_writer* members_writer_open(const char* path, uint64_t volume_size);
+
+// Passes the tar stream on to next, listing each entry as it goes by.
+// Closing the sink closes next but not w.
+nandroid_sink* members_sink_open(nandroid_sink* next, members_writer* w);
+
+// A nandroid_seek_callback adding a seek point to the members_writer
+// given as cookie.
+void members_seek(void* cookie, uint64_t offset, uint64_t compressed_offset);
+
+// Removes the list again unless complete is set, or it couldn't be
+// written in full.
+int members_writer_close(members_writer* w, int complete);
+
+typedef struct members_index members_index;
+
+// Returns NULL if path can't be read.
+members_index* members_load(const char* path);
+void members_free(members_index* index);
+
+uint64_t members_volume_size(members_index* index);
+
+// Finds the part of the archive holding path, a file or a directory
+// along with everything under it. Returns -1 if it isn't in the archive.
+int members_find(members_index* index, const char* path, uint64_t* start, uint64_t* end);
+
+// The last seek point at or before offset. Returns -1 if there is none.
+int members_seek_point(members_index* index, uint64_t offset, uint64_t* seek_offset, uint64_t* compressed_offset);
+
+// The names of the entries right under dir, which is "" or ends in a
+// slash, sorted and with directories ending in a slash. The NULL
+// terminated array and its strings are malloced.
+char** members_list(members_index* index, const char* dir);
+
+#endif
@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "common.h"
+#include "nandroid_compress.h"
+#include "nandroid_stream.h"
+
+#define STREAM_MAGIC "NDMP"
+#define STREAM_HEADER_SIZE 16
+#define STREAM_FRAME_BEGIN 1
+#define STREAM_FRAME_DATA 2
+#define STREAM_FRAME_END 3
+// the begin frame carries a path sized name
+#define STREAM_MAX_PAYLOAD (NANDROID_STREAM_FRAME_SIZE + 4096)
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char* p, uint64_t v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+static uint64_t get_le64(const unsigned char* p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static int write_frame(nandroid_sink* next, int type, const unsigned char* payload, size_t len) {
+    unsigned char header[STREAM_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, STREAM_MAGIC, 4);
+    header[4] = type;
+    put_le32(header + 8, len);
+    put_le32(header + 12, crc32(crc32(0, NULL, 0), payload, len));
+    if (next->write(next, header, sizeof(header)))
+        return -1;
+    return len > 0 ? next->write(next, payload, len) : 0;
+}
+
+typedef struct {
+    nandroid_sink sink;
+    nandroid_sink* next;
+    unsigned char* buf;
+    size_t len;
+    // uncompressed bytes, counted by the stream_sink in front
+    uint64_t size;
+    int error;
+} frame_sink;
+
+static int frame_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    frame_sink* s = (frame_sink*)sink;
+    const unsigned char* p = data;
+    while (len > 0 && !s->error) {
+        size_t chunk = NANDROID_STREAM_FRAME_SIZE - s->len;
+        if (chunk > len)
+            chunk = len;
+        memcpy(s->buf + s->len, p, chunk);
+        s->len += chunk;
+        p += chunk;
+        len -= chunk;
+        if (s->len == NANDROID_STREAM_FRAME_SIZE) {
+            s->error = write_frame(s->next, STREAM_FRAME_DATA, s->buf, s->len);
+            s->len = 0;
+        }
+    }
+    return s->error;
+}
+
+static int frame_sink_close(nandroid_sink* sink) {
+    frame_sink* s = (frame_sink*)sink;
+    unsigned char size[8];
+    int ret = s->error;
+    if (ret == 0 && s->len > 0)
+        ret = write_frame(s->next, STREAM_FRAME_DATA, s->buf, s->len);
+    put_le64(size, s->size);
+    if (ret == 0)
+        ret = write_frame(s->next, STREAM_FRAME_END, size, sizeof(size));
+    if (s->next->close(s->next))
+        ret = -1;
+    free(s->buf);
+    free(s);
+    return ret;
+}
+
+// Counts what goes into the compressor for the end frame.
+typedef struct {
+    nandroid_sink sink;
+    nandroid_sink* next;
+    frame_sink* frames;
+} stream_sink;
+
+static int stream_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    stream_sink* s = (stream_sink*)sink;
+    s->frames->size += len;
+    return s->next->write(s->next, data, len);
+}
+
+static int stream_sink_close(nandroid_sink* sink) {
+    stream_sink* s = (stream_sink*)sink;
+    int ret = s->next->close(s->next);
+    free(s);
+    return ret;
+}
+
+nandroid_sink* stream_sink_open(nandroid_sink* next, const char* partition, int codec) {
+    if (next == NULL)
+        return NULL;
+    unsigned char begin[PATH_MAX + 1];
+    size_t name_len = strlen(partition);
+    frame_sink* f = calloc(1, sizeof(frame_sink));
+    stream_sink* s = calloc(1, sizeof(stream_sink));
+    if (f != NULL)
+        f->buf = malloc(NANDROID_STREAM_FRAME_SIZE);
+    if (f == NULL || f->buf == NULL || s == NULL || name_len >= PATH_MAX) {
+        next->close(next);
+        if (f != NULL)
+            free(f->buf);
+        free(f);
+        free(s);
+        return NULL;
+    }
+    f->sink.write = frame_sink_write;
+    f->sink.close = frame_sink_close;
+    f->next = next;
+    begin[0] = codec;
+    memcpy(begin + 1, partition, name_len);
+    f->error = write_frame(next, STREAM_FRAME_BEGIN, begin, name_len + 1);
+
+    s->sink.write = stream_sink_write;
+    s->sink.close = stream_sink_close;
+    s->frames = f;
+    s->next = &f->sink;
+    if (codec != NANDROID_CODEC_NONE)
+        s->next = compress_sink_open(&f->sink, codec, NULL, NULL);
+    if (s->next == NULL || f->error) {
+        if (s->next != NULL)
+            s->next->close(s->next);
+        free(s);
+        return NULL;
+    }
+    return &s->sink;
+}
+
+typedef struct {
+    int fd;
+    unsigned char header[STREAM_HEADER_SIZE];
+    int have_header;
+    unsigned char* payload;
+    size_t len;
+    size_t pos;
+    int type;
+    uint64_t frame;
+    int ended;
+} stream_reader;
+
+// Returns the number of bytes read, short only at the end of the stream.
+static ssize_t read_fully(int fd, void* buf, size_t len) {
+    char* p = buf;
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, p + total, len - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+// Returns 0 with the next frame in the reader, 1 at a clean end of the
+// stream and -1 on errors.
+static int read_frame(stream_reader* r) {
+    if (!r->have_header) {
+        ssize_t n = read_fully(r->fd, r->header, STREAM_HEADER_SIZE);
+        if (n == 0)
+            return 1;
+        if (n != STREAM_HEADER_SIZE) {
+            LOGE("Truncated stream after frame %llu\n", (unsigned long long)r->frame);
+            return -1;
+        }
+    }
+    r->have_header = 0;
+    r->frame++;
+    r->type = r->header[4];
+    r->len = get_le32(r->header + 8);
+    r->pos = 0;
+    if (memcmp(r->header, STREAM_MAGIC, 4) != 0 || r->len > STREAM_MAX_PAYLOAD) {
+        LOGE("Bad header on frame %llu\n", (unsigned long long)r->frame);
+        return -1;
+    }
+    if (read_fully(r->fd, r->payload, r->len) != (ssize_t)r->len) {
+        LOGE("Truncated stream in frame %llu\n", (unsigned long long)r->frame);
+        return -1;
+    }
+    if (crc32(crc32(0, NULL, 0), r->payload, r->len) != get_le32(r->header + 12)) {
+        LOGE("Checksum mismatch on frame %llu\n", (unsigned long long)r->frame);
+        return -1;
+    }
+    return 0;
+}
+
+// The data of the current partition, for decompress_stream.
+static ssize_t stream_read_data(void* cookie, void* buf, size_t len) {
+    stream_reader* r = (stream_reader*)cookie;
+    while (r->pos == r->len || r->type != STREAM_FRAME_DATA) {
+        if (r->ended)
+            return 0;
+        int ret = read_frame(r);
+        if (ret > 0)
+            LOGE("Stream ends inside frame %llu's partition\n", (unsigned long long)r->frame);
+        if (ret)
+            return -1;
+        if (r->type == STREAM_FRAME_END) {
+            r->ended = 1;
+            return 0;
+        }
+        if (r->type != STREAM_FRAME_DATA) {
+            LOGE("Unexpected frame %llu\n", (unsigned long long)r->frame);
+            return -1;
+        }
+    }
+    if (len > r->len - r->pos)
+        len = r->len - r->pos;
+    memcpy(buf, r->payload + r->pos, len);
+    r->pos += len;
+    return len;
+}
+
+typedef struct {
+    nandroid_sink sink;
+    nandroid_sink* next;
+    uint64_t size;
+} count_sink;
+
+static int count_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    count_sink* s = (count_sink*)sink;
+    s->size += len;
+    return s->next->write(s->next, data, len);
+}
+
+// Reads the partition whose begin frame was just read into out, or
+// past it if out is NULL.
+static int read_partition(stream_reader* r, int codec, nandroid_sink* out) {
+    count_sink counter;
+    unsigned char buf[4096];
+    int ret = 0;
+    memset(&counter, 0, sizeof(counter));
+    counter.sink.write = count_sink_write;
+    counter.next = out;
+    r->ended = 0;
+    r->len = r->pos = 0;
+    r->type = STREAM_FRAME_DATA;
+    if (out != NULL)
+        ret = decompress_stream(stream_read_data, r, codec, &counter.sink);
+    // whatever the codec left of the partition is still checked
+    ssize_t n;
+    while (ret == 0 && (n = stream_read_data(r, buf, sizeof(buf))) != 0) {
+        if (n < 0)
+            ret = -1;
+    }
+    if (ret == 0 && (r->len != 8 || (out != NULL && get_le64(r->payload) != counter.size))) {
+        LOGE("Size mismatch at frame %llu\n", (unsigned long long)r->frame);
+        ret = -1;
+    }
+    return ret;
+}
+
+static int copy_unframed(stream_reader* r, nandroid_sink* out, size_t peeked) {
+    if (out->write(out, r->header, peeked))
+        return -1;
+    ssize_t n;
+    while ((n = read(r->fd, r->payload, NANDROID_STREAM_FRAME_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || out->write(out, r->payload, n))
+            return -1;
+    }
+    return 0;
+}
+
+int stream_read(int fd, const char* partition, nandroid_sink* out) {
+    stream_reader r;
+    memset(&r, 0, sizeof(r));
+    r.fd = fd;
+    r.payload = malloc(STREAM_MAX_PAYLOAD + 1);
+    if (r.payload == NULL)
+        return -1;
+
+    int ret;
+    ssize_t n = read_fully(fd, r.header, STREAM_HEADER_SIZE);
+    if (n < 0) {
+        ret = -1;
+    } else if (n < STREAM_HEADER_SIZE || memcmp(r.header, STREAM_MAGIC, 4) != 0) {
+        ret = copy_unframed(&r, out, n);
+    } else {
+        int found = 0;
+        r.have_header = 1;
+        while ((ret = read_frame(&r)) == 0) {
+            if (r.type != STREAM_FRAME_BEGIN || r.len < 1) {
+                LOGE("Unexpected frame %llu\n", (unsigned long long)r.frame);
+                ret = -1;
+                break;
+            }
+            int codec = r.payload[0];
+            if (codec != NANDROID_CODEC_NONE && codec != NANDROID_CODEC_GZIP && codec != NANDROID_CODEC_LZ4) {
+                LOGE("Unknown codec in frame %llu\n", (unsigned long long)r.frame);
+                ret = -1;
+                break;
+            }
+            r.payload[r.len] = '\0';
+            int wanted = !found && strcmp((const char*)r.payload + 1, partition) == 0;
+            if (read_partition(&r, codec, wanted ? out : NULL)) {
+                ret = -1;
+                break;
+            }
+            found |= wanted;
+        }
+        if (ret > 0 && !found) {
+            LOGE("%s is not in the stream\n", partition);
+            ret = -1;
+        }
+        else if (ret > 0) {
+            ret = 0;
+        }
+    }
+    free(r.payload);
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef NANDROID_STREAM_H
+#define NANDROID_STREAM_H
+
+#include "nandroid_tar.h"
+
+// What nandroid dump writes for bu to hand to the host, and undump reads
+// back. The stream is a series of frames, each a 16 byte header
+//   "NDMP" <type> <3 reserved bytes> <le32 length> <le32 crc32 of payload>
+// followed by its payload. A partition starts with a begin frame holding
+// the codec byte and its name, has its possibly compressed data split
+// into data frames of at most NANDROID_STREAM_FRAME_SIZE bytes, and ends
+// with an end frame holding its le64 uncompressed size. Frames are
+// written whole, so a slow reader holds the writer back by no more than
+// one frame.
+#define NANDROID_STREAM_FRAME_SIZE (256 * 1024)
+
+// Frames partition into next, compressed with codec. Closing the sink
+// writes the end frame and closes next.
+nandroid_sink* stream_sink_open(nandroid_sink* next, const char* partition, int codec);
+
+// Reads a stream from fd, writing what it holds for partition into out,
+// which is not closed. Other partitions are skipped. Streams without
+// frames, as older recoveries dumped them, are copied to out as they
+// are. Returns non-zero if a frame is corrupt, the stream is truncated
+// or partition isn't in it.
+int stream_read(int fd, const char* partition, nandroid_sink* out);
+
+#endif
@@ -0,0 +1,662 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include <openssl/md5.h>
+
+#include "libcrecovery/common.h"
+
+#include "common.h"
+#include "nandroid_tar.h"
+
+#define TAR_BLOCK_SIZE 512
+// tar pads archives to a whole number of 20 block records
+#define TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE)
+#define TAR_BUFFER_SIZE (256 * 1024)
+#define TAR_LINK_BUCKETS 1024
+#define TAR_SELINUX_XATTR "security.selinux"
+
+static int write_fully(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+typedef struct {
+    nandroid_sink sink;
+    int fd;
+} fd_sink;
+
+static int fd_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    return write_fully(((fd_sink*)sink)->fd, data, len);
+}
+
+static int fd_sink_close(nandroid_sink* sink) {
+    free(sink);
+    return 0;
+}
+
+nandroid_sink* fd_sink_open(int fd) {
+    fd_sink* s = calloc(1, sizeof(fd_sink));
+    if (s == NULL)
+        return NULL;
+    s->sink.write = fd_sink_write;
+    s->sink.close = fd_sink_close;
+    s->fd = fd;
+    return &s->sink;
+}
+
+typedef struct {
+    nandroid_sink sink;
+    char prefix[PATH_MAX];
+    uint64_t volume_size;
+    int fd;
+    int volume;
+    // a volume is being written, or checked if it is being resumed
+    int active;
+    uint64_t written;
+    nandroid_digest_callback digest;
+    nandroid_resume_callback resume;
+    MD5_CTX md5;
+    // what the volume being resumed already holds
+    int resuming;
+    uint64_t resumed_size;
+    unsigned char resumed_md5[MD5_DIGEST_LENGTH];
+    int error;
+} volume_sink;
+
+static void volume_sink_path(volume_sink* s, char* path, size_t size) {
+    snprintf(path, size, "%s%c", s->prefix, 'a' + s->volume - 1);
+}
+
+static int volume_sink_finish(volume_sink* s) {
+    char path[PATH_MAX];
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    int ret = s->resuming ? 0 : close(s->fd);
+    s->fd = -1;
+    s->active = 0;
+    MD5_Final(md5, &s->md5);
+    volume_sink_path(s, path, sizeof(path));
+    if (s->resuming && (s->written != s->resumed_size || memcmp(md5, s->resumed_md5, MD5_DIGEST_LENGTH) != 0)) {
+        LOGE("%s differs from the interrupted backup\n", path);
+        ret = -1;
+    }
+    if (ret == 0 && s->digest != NULL)
+        s->digest(path, s->written, md5);
+    return ret;
+}
+
+static int volume_sink_next(volume_sink* s) {
+    char path[PATH_MAX];
+    if (s->active && volume_sink_finish(s))
+        return -1;
+    if (s->volume >= 26) {
+        LOGE("Too many backup volumes for %s\n", s->prefix);
+        return -1;
+    }
+    s->volume++;
+    volume_sink_path(s, path, sizeof(path));
+    s->written = 0;
+    MD5_Init(&s->md5);
+    s->resuming = s->resume != NULL && s->resume(path, &s->resumed_size, s->resumed_md5);
+    if (!s->resuming) {
+        s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (s->fd < 0) {
+            LOGE("Unable to create %s\n", path);
+            return -1;
+        }
+    }
+    s->active = 1;
+    return 0;
+}
+
+static int volume_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    volume_sink* s = (volume_sink*)sink;
+    const char* p = data;
+    if (s->error)
+        return -1;
+    while (len > 0) {
+        if ((!s->active || s->written == s->volume_size) && volume_sink_next(s))
+            break;
+        size_t chunk = len;
+        if (chunk > s->volume_size - s->written)
+            chunk = s->volume_size - s->written;
+        if (s->resuming) {
+            // a volume being resumed is only checked, not written again
+            if (s->written + chunk > s->resumed_size) {
+                LOGE("%s%c differs from the interrupted backup\n", s->prefix, 'a' + s->volume - 1);
+                break;
+            }
+        }
+        else if (write_fully(s->fd, p, chunk)) {
+            break;
+        }
+        if (s->digest != NULL || s->resuming)
+            MD5_Update(&s->md5, p, chunk);
+        s->written += chunk;
+        p += chunk;
+        len -= chunk;
+    }
+    if (len > 0)
+        s->error = -1;
+    return s->error;
+}
+
+static int volume_sink_close(nandroid_sink* sink) {
+    volume_sink* s = (volume_sink*)sink;
+    int ret = s->error;
+    // an empty archive still gets its first volume
+    if (!ret && !s->active)
+        ret = volume_sink_next(s);
+    // a failed volume gets no checksum
+    if (s->active) {
+        if (!ret)
+            ret = volume_sink_finish(s);
+        else if (s->fd >= 0)
+            close(s->fd);
+    }
+    free(s);
+    return ret;
+}
+
+nandroid_sink* volume_sink_open(const char* prefix, uint64_t volume_size, nandroid_digest_callback digest, nandroid_resume_callback resume) {
+    volume_sink* s = calloc(1, sizeof(volume_sink));
+    if (s == NULL)
+        return NULL;
+    s->sink.write = volume_sink_write;
+    s->sink.close = volume_sink_close;
+    strncpy(s->prefix, prefix, sizeof(s->prefix) - 2);
+    s->volume_size = volume_size;
+    s->digest = digest;
+    s->resume = resume;
+    s->fd = -1;
+    return &s->sink;
+}
+
+typedef struct {
+    nandroid_sink sink;
+    FILE* fp;
+} pipe_sink;
+
+static int pipe_sink_write(nandroid_sink* sink, const void* data, size_t len) {
+    return fwrite(data, 1, len, ((pipe_sink*)sink)->fp) == len ? 0 : -1;
+}
+
+static int pipe_sink_close(nandroid_sink* sink) {
+    int ret = __pclose(((pipe_sink*)sink)->fp);
+    free(sink);
+    return ret;
+}
+
+nandroid_sink* pipe_sink_open(const char* command) {
+    pipe_sink* s = calloc(1, sizeof(pipe_sink));
+    if (s == NULL)
+        return NULL;
+    s->fp = __popen(command, "w");
+    if (s->fp == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->sink.write = pipe_sink_write;
+    s->sink.close = pipe_sink_close;
+    return &s->sink;
+}
+
+// A file with other hard links, remembered so later links to the same
+// inode are archived as links rather than as copies.
+typedef struct tar_link {
+    struct tar_link* next;
+    dev_t dev;
+    ino_t ino;
+    char* path;
+} tar_link;
+
+typedef struct {
+    nandroid_sink* out;
+    const char** excludes;
+    int flags;
+    nandroid_file_callback callback;
+    nandroid_tar_filter filter;
+    void* cookie;
+    // archive name of the entry being written, and its path on disk
+    char path[PATH_MAX];
+    char full_path[PATH_MAX];
+    // output is gathered into whole blocks before going to the sink
+    char* buf;
+    size_t fill;
+    uint64_t total;
+    tar_link* links[TAR_LINK_BUCKETS];
+    int error;
+} tar_state;
+
+static int tar_flush(tar_state* t) {
+    if (t->fill > 0 && !t->error && t->out->write(t->out, t->buf, t->fill))
+        t->error = -1;
+    t->total += t->fill;
+    t->fill = 0;
+    return t->error;
+}
+
+static int tar_write(tar_state* t, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0 && !t->error) {
+        size_t chunk = TAR_BUFFER_SIZE - t->fill;
+        if (chunk > len)
+            chunk = len;
+        memcpy(t->buf + t->fill, p, chunk);
+        t->fill += chunk;
+        p += chunk;
+        len -= chunk;
+        if (t->fill == TAR_BUFFER_SIZE)
+            tar_flush(t);
+    }
+    return t->error;
+}
+
+// Zero fills up to the next block boundary.
+static int tar_pad(tar_state* t, uint64_t len) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    size_t pad = (TAR_BLOCK_SIZE - len % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    return tar_write(t, zeros, pad);
+}
+
+static void tar_octal(char* field, size_t size, uint64_t value) {
+    snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+}
+
+static size_t decimal_digits(size_t n) {
+    size_t digits = 1;
+    for (; n >= 10; n /= 10)
+        digits++;
+    return digits;
+}
+
+// Appends a "length key=value\n" record, where length counts itself.
+static int pax_append(char** records, size_t* len, const char* key, const char* value, size_t value_len) {
+    size_t base = strlen(key) + value_len + 3;
+    size_t record_len = base + decimal_digits(base);
+    // the length may gain a digit by counting its own digits
+    record_len = base + decimal_digits(record_len);
+    char* grown = realloc(*records, *len + record_len + 1);
+    if (grown == NULL)
+        return -1;
+    *records = grown;
+    int header = sprintf(*records + *len, "%zu %s=", record_len, key);
+    memcpy(*records + *len + header, value, value_len);
+    (*records)[*len + header + value_len] = '\n';
+    *len += record_len;
+    return 0;
+}
+
+// Fills a ustar header. Returns non-zero if something does not fit and
+// has to go in a pax header instead.
+static int tar_fill_header(char* header, const char* path, const struct stat* st, char type, const char* link, uint64_t size) {
+    int overflow = 0;
+    size_t len = strlen(path);
+    memset(header, 0, TAR_BLOCK_SIZE);
+    if (len <= 100) {
+        memcpy(header, path, len);
+    }
+    else {
+        // split at a slash into a prefix of up to 155 bytes and a name of
+        // up to 100
+        const char* slash;
+        for (slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+            size_t prefix_len = slash - path;
+            size_t name_len = len - prefix_len - 1;
+            if (prefix_len > 155)
+                slash = NULL;
+            if (slash == NULL || (prefix_len > 0 && name_len > 0 && name_len <= 100))
+                break;
+        }
+        if (slash != NULL) {
+            memcpy(header + 345, path, slash - path);
+            memcpy(header, slash + 1, len - (slash - path) - 1);
+        }
+        else {
+            memcpy(header, path, 100);
+            overflow = 1;
+        }
+    }
+
+    tar_octal(header + 100, 8, st->st_mode & 07777);
+    if (st->st_uid > 07777777 || st->st_gid > 07777777)
+        overflow = 1;
+    tar_octal(header + 108, 8, st->st_uid & 07777777);
+    tar_octal(header + 116, 8, st->st_gid & 07777777);
+    if (size > 077777777777ULL)
+        overflow = 1;
+    tar_octal(header + 124, 12, size > 077777777777ULL ? 0 : size);
+    tar_octal(header + 136, 12, st->st_mtime < 0 ? 0 : st->st_mtime);
+    header[156] = type;
+    if (link != NULL) {
+        size_t link_len = strlen(link);
+        memcpy(header + 157, link, link_len > 100 ? 100 : link_len);
+        if (link_len > 100)
+            overflow = 1;
+    }
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    if (type == '3' || type == '4') {
+        tar_octal(header + 329, 8, major(st->st_rdev));
+        tar_octal(header + 337, 8, minor(st->st_rdev));
+    }
+    return overflow;
+}
+
+static int tar_write_header(char* header, tar_state* t) {
+    unsigned int sum = 0;
+    int i;
+    memset(header + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += (unsigned char)header[i];
+    snprintf(header + 148, 8, "%06o", sum);
+    return tar_write(t, header, TAR_BLOCK_SIZE);
+}
+
+static int tar_write_entry_header(tar_state* t, const struct stat* st, char type, const char* link, uint64_t size) {
+    char header[TAR_BLOCK_SIZE];
+    char* records = NULL;
+    size_t records_len = 0;
+    int ret = 0;
+
+    int overflow = tar_fill_header(header, t->path, st, type, link, size);
+    if (overflow) {
+        char number[32];
+        ret |= pax_append(&records, &records_len, "path", t->path, strlen(t->path));
+        if (link != NULL)
+            ret |= pax_append(&records, &records_len, "linkpath", link, strlen(link));
+        sprintf(number, "%llu", (unsigned long long)size);
+        ret |= pax_append(&records, &records_len, "size", number, strlen(number));
+        sprintf(number, "%u", (unsigned int)st->st_uid);
+        ret |= pax_append(&records, &records_len, "uid", number, strlen(number));
+        sprintf(number, "%u", (unsigned int)st->st_gid);
+        ret |= pax_append(&records, &records_len, "gid", number, strlen(number));
+    }
+    if (t->flags & TAR_SELINUX) {
+        char label[256];
+        ssize_t label_len = lgetxattr(t->full_path, TAR_SELINUX_XATTR, label, sizeof(label));
+        if (label_len > 0)
+            ret |= pax_append(&records, &records_len, "SCHILY.xattr." TAR_SELINUX_XATTR, label, label_len);
+    }
+    if (ret) {
+        free(records);
+        LOGE("Out of memory archiving %s\n", t->path);
+        return t->error = -1;
+    }
+
+    if (records_len > 0) {
+        char pax_header[TAR_BLOCK_SIZE];
+        struct stat pax_st;
+        char pax_path[PATH_MAX];
+        const char* base = strrchr(t->path, '/');
+        memset(&pax_st, 0, sizeof(pax_st));
+        pax_st.st_mode = 0644;
+        pax_st.st_mtime = st->st_mtime;
+        snprintf(pax_path, sizeof(pax_path), "PaxHeaders/%.80s", base != NULL && base[1] != '\0' ? base + 1 : t->path);
+        tar_fill_header(pax_header, pax_path, &pax_st, 'x', NULL, records_len);
+        tar_write_header(pax_header, t);
+        tar_write(t, records, records_len);
+        tar_pad(t, records_len);
+        free(records);
+    }
+    return tar_write_header(header, t);
+}
+
+static tar_link** tar_link_bucket(tar_state* t, const struct stat* st) {
+    return &t->links[(st->st_ino ^ st->st_dev) % TAR_LINK_BUCKETS];
+}
+
+// Returns the path an inode was first archived under, or records this
+// one if it may be linked again later.
+static const char* tar_find_link(tar_state* t, const struct stat* st) {
+    if (st->st_nlink < 2)
+        return NULL;
+    tar_link** bucket = tar_link_bucket(t, st);
+    tar_link* link;
+    for (link = *bucket; link != NULL; link = link->next) {
+        if (link->ino == st->st_ino && link->dev == st->st_dev)
+            return link->path;
+    }
+    if ((link = malloc(sizeof(tar_link))) == NULL || (link->path = strdup(t->path)) == NULL) {
+        free(link);
+        return NULL;
+    }
+    link->dev = st->st_dev;
+    link->ino = st->st_ino;
+    link->next = *bucket;
+    *bucket = link;
+    return NULL;
+}
+
+static int tar_write_file(tar_state* t, int dirfd, const char* name, const struct stat* st) {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        // files are deleted from under us on a live /data
+        if (errno == ENOENT)
+            return 0;
+        LOGE("Unable to open %s\n", t->path);
+        return -1;
+    }
+    if (tar_write_entry_header(t, st, '0', NULL, st->st_size)) {
+        close(fd);
+        return -1;
+    }
+
+    // the header already promised st_size bytes, so a file that changes
+    // while it is read is cut off or zero filled to that size
+    uint64_t remaining = st->st_size;
+    while (remaining > 0 && !t->error) {
+        size_t space = TAR_BUFFER_SIZE - t->fill;
+        if (space > remaining)
+            space = remaining;
+        ssize_t bytes_read = read(fd, t->buf + t->fill, space);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0) {
+            LOGE("Error reading %s\n", t->path);
+            t->error = -1;
+            break;
+        }
+        if (bytes_read == 0) {
+            LOGW("%s shrank while being archived\n", t->path);
+            memset(t->buf + t->fill, 0, space);
+            bytes_read = space;
+        }
+        t->fill += bytes_read;
+        remaining -= bytes_read;
+        if (t->fill == TAR_BUFFER_SIZE)
+            tar_flush(t);
+    }
+    close(fd);
+    tar_pad(t, st->st_size);
+    return t->error;
+}
+
+static int tar_excluded(tar_state* t) {
+    const char** pattern;
+    for (pattern = t->excludes; pattern != NULL && *pattern != NULL; pattern++) {
+        if (fnmatch(*pattern, t->path, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int tar_write_tree(tar_state* t, int dirfd, const char* name);
+
+static int tar_write_dir(tar_state* t, int dirfd, const char* name, const struct stat* st, int archived) {
+    size_t len = strlen(t->path);
+    int ret = 0;
+    // directories are named with a trailing slash
+    if (len + 2 >= sizeof(t->path))
+        return -1;
+    strcat(t->path, "/");
+    if (archived)
+        ret = tar_write_entry_header(t, st, '5', NULL, 0);
+    t->path[len] = '\0';
+    if (ret)
+        return ret;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd >= 0)
+            close(fd);
+        LOGE("Unable to open directory %s\n", t->path);
+        return -1;
+    }
+
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL && !ret) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        ret = tar_write_tree(t, fd, de->d_name);
+    }
+    closedir(dir);
+    return ret;
+}
+
+static int tar_write_tree(tar_state* t, int dirfd, const char* name) {
+    size_t len = strlen(t->path);
+    size_t full_len = strlen(t->full_path);
+    if (len + strlen(name) + 2 >= sizeof(t->path) || full_len + strlen(name) + 2 >= sizeof(t->full_path)) {
+        LOGE("Path too long: %s/%s\n", t->path, name);
+        return -1;
+    }
+    if (len > 0)
+        strcat(t->path, "/");
+    strcat(t->path, name);
+    strcat(t->full_path, "/");
+    strcat(t->full_path, name);
+
+    int ret = 0;
+    struct stat st;
+    if (tar_excluded(t)) {
+        // skipped
+    }
+    else if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno != ENOENT) {
+            LOGE("Unable to stat %s\n", t->path);
+            ret = -1;
+        }
+    }
+    else {
+        const char* link;
+        int archived = t->filter == NULL ? 1 : t->filter(t->cookie, t->path, &st);
+        if (t->callback != NULL)
+            t->callback(t->path);
+        if (archived < 0) {
+            ret = -1;
+        }
+        else if (S_ISDIR(st.st_mode)) {
+            ret = tar_write_dir(t, dirfd, name, &st, archived);
+        }
+        else if (!archived) {
+            // unchanged, or otherwise left out by the filter
+        }
+        else if (S_ISREG(st.st_mode)) {
+            if ((link = tar_find_link(t, &st)) != NULL)
+                ret = tar_write_entry_header(t, &st, '1', link, 0);
+            else
+                ret = tar_write_file(t, dirfd, name, &st);
+        }
+        else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t target_len = readlinkat(dirfd, name, target, sizeof(target) - 1);
+            if (target_len < 0) {
+                LOGE("Unable to read link %s\n", t->path);
+                ret = -1;
+            }
+            else {
+                target[target_len] = '\0';
+                ret = tar_write_entry_header(t, &st, '2', target, 0);
+            }
+        }
+        else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+            ret = tar_write_entry_header(t, &st, S_ISCHR(st.st_mode) ? '3' : S_ISBLK(st.st_mode) ? '4' : '6', NULL, 0);
+        }
+        // sockets can not be archived, and are recreated by their owners
+    }
+
+    t->path[len] = '\0';
+    t->full_path[full_len] = '\0';
+    return ret;
+}
+
+int tar_create(nandroid_sink* out, const char* dir, const char* name, const char** excludes, int flags, nandroid_file_callback callback) {
+    return tar_create_filtered(out, dir, name, excludes, flags, callback, NULL, NULL);
+}
+
+int tar_create_filtered(nandroid_sink* out, const char* dir, const char* name, const char** excludes, int flags,
+        nandroid_file_callback callback, nandroid_tar_filter filter, void* cookie) {
+    tar_state* t = calloc(1, sizeof(tar_state));
+    if (t == NULL || (t->buf = malloc(TAR_BUFFER_SIZE)) == NULL) {
+        free(t);
+        return -1;
+    }
+    t->out = out;
+    t->excludes = excludes;
+    t->flags = flags;
+    t->callback = callback;
+    t->filter = filter;
+    t->cookie = cookie;
+    strncpy(t->full_path, strcmp(dir, "/") == 0 ? "" : dir, sizeof(t->full_path) - 1);
+
+    int ret;
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) {
+        LOGE("Unable to open %s\n", dir);
+        ret = -1;
+    }
+    else {
+        ret = tar_write_tree(t, dirfd, name);
+        close(dirfd);
+    }
+
+    // two zero blocks end the archive, padded out to a whole record
+    if (!ret) {
+        static const char zeros[TAR_BLOCK_SIZE];
+        uint64_t end;
+        tar_write(t, zeros, TAR_BLOCK_SIZE);
+        tar_write(t, zeros, TAR_BLOCK_SIZE);
+        end = t->total + t->fill;
+        while (end % TAR_RECORD_SIZE != 0) {
+            tar_write(t, zeros, TAR_BLOCK_SIZE);
+            end += TAR_BLOCK_SIZE;
+        }
+        ret = tar_flush(t);
+    }
+
+    int i;
+    for (i = 0; i < TAR_LINK_BUCKETS; i++) {
+        while (t->links[i] != NULL) {
+            tar_link* next = t->links[i]->next;
+            free(t->links[i]->path);
+            free(t->links[i]);
+            t->links[i] = next;
+        }
+    }
+    free(t->buf);
+    free(t);
+    return ret;
+}
@@ -0,0 +1,62 @@
+#ifndef NANDROID_TAR_H
+#define NANDROID_TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+// Backups are split into volumes of this size, as split -b used to do.
+#define NANDROID_VOLUME_SIZE 1000000000ULL
+
+// A destination for archive bytes. Sinks are chained, each one passing
+// what it is given on to the next after transforming or inspecting it.
+typedef struct nandroid_sink nandroid_sink;
+struct nandroid_sink {
+    int (*write)(nandroid_sink* sink, const void* data, size_t len);
+    // Flushes and frees the sink and the rest of the chain. Returns
+    // non-zero if anything along the way failed.
+    int (*close)(nandroid_sink* sink);
+};
+
+// Writes to fd, which is left open on close.
+nandroid_sink* fd_sink_open(int fd);
+
+// Called with the md5 of each volume once it is complete.
+typedef void (*nandroid_digest_callback)(const char* path, uint64_t size, const unsigned char* md5);
+
+// Asked before each volume is written. Returns 1, with the size and md5
+// of the volume, if an interrupted backup already wrote all of it.
+typedef int (*nandroid_resume_callback)(const char* path, uint64_t* size, unsigned char* md5);
+
+// Writes prefix followed by "a", "b", ... as files of at most
+// volume_size bytes each, the naming split -a 1 used. digest, if given,
+// gets the checksum of every volume computed as it is written. Volumes
+// resume says are complete are left alone, and fail the write if the
+// data meant for them turns out different.
+nandroid_sink* volume_sink_open(const char* prefix, uint64_t volume_size, nandroid_digest_callback digest, nandroid_resume_callback resume);
+
+// Feeds the standard input of a shell command.
+nandroid_sink* pipe_sink_open(const char* command);
+
+typedef void (*nandroid_file_callback)(const char* filename);
+
+// Also store the selinux label of every entry in a pax header.
+#define TAR_SELINUX 1
+
+// Archives dir/name with entry names relative to dir, like
+// "cd dir ; tar c name". Paths matching one of the NULL terminated
+// fnmatch patterns in excludes are skipped. callback, if given, is
+// called with each path as it is archived.
+int tar_create(nandroid_sink* out, const char* dir, const char* name, const char** excludes, int flags, nandroid_file_callback callback);
+
+// Decides whether an entry goes into the archive, returning 1 to store
+// it, 0 to leave it out and -1 to fail. Directories left out are still
+// descended into.
+typedef int (*nandroid_tar_filter)(void* cookie, const char* path, const struct stat* st);
+
+// tar_create, passing every entry past filter first.
+int tar_create_filtered(nandroid_sink* out, const char* dir, const char* name, const char** excludes, int flags,
+        nandroid_file_callback callback, nandroid_tar_filter filter, void* cookie);
+
+#endif
@@ -0,0 +1,111 @@
+#!/bin/bash
+#
+# A test for restoring chains of incremental nandroid backups. Boot the
+# device into this recovery and connect it over adb first; the backups
+# go to its /sdcard and /cache is changed and restored along the way.
+#
+# TODO: find some way to get this run regularly along with the rest of
+# the tests.
+
+ADB="adb -d "
+
+BACKUP_DIR=/sdcard/clockworkmod/backup
+FORMAT_FILE=/sdcard/clockworkmod/.default_backup_format
+WORK_DIR=/cache/nandroid_test
+
+# ------------------------
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+testname() {
+  echo
+  echo "::: testing $1 :::"
+  testname="$1"
+}
+
+fail() {
+  echo
+  echo FAIL: $testname
+  echo
+  cleanup
+  exit 1
+}
+
+cleanup() {
+  run_command rm -r $WORK_DIR
+  [ "$first" == "" ] || run_command rm -r $BACKUP_DIR/$first
+  [ "$second" == "" ] || run_command rm -r $BACKUP_DIR/$second
+  if [ "$old_format" == "" ]; then
+    run_command rm $FORMAT_FILE
+  else
+    run_command "echo $old_format > $FORMAT_FILE"
+  fi
+}
+
+# back up and print the name of the new backup
+backup() {
+  # the backups are named after the second they were started in
+  sleep 1
+  run_command nandroid backup > /dev/null || return 1
+  $ADB shell ls -t $BACKUP_DIR | head -n 1 | tr -d '\r'
+}
+
+# check a file under WORK_DIR holds what it should
+expect_file() {
+  [ "$($ADB shell cat $WORK_DIR/$1 | tr -d '\r')" == "$2" ]
+}
+
+run_command mount /cache
+run_command mount /sdcard
+old_format=$($ADB shell cat $FORMAT_FILE 2>/dev/null | tr -d '\r')
+run_command "echo inc > $FORMAT_FILE" || exit 1
+
+testname "full backup at the start of the chain"
+run_command mkdir -p $WORK_DIR || fail
+run_command "echo one > $WORK_DIR/kept" || fail
+run_command "echo one > $WORK_DIR/changed" || fail
+run_command "echo one > $WORK_DIR/deleted" || fail
+first=$(backup) || fail
+[ "$first" != "" ] || fail
+
+testname "incremental backup on top of it"
+run_command "echo two > $WORK_DIR/changed" || fail
+run_command "echo two > $WORK_DIR/added" || fail
+run_command rm $WORK_DIR/deleted || fail
+second=$(backup) || fail
+[ "$second" != "" -a "$second" != "$first" ] || fail
+run_command ls $BACKUP_DIR/$second/cache.*.inc.a || fail
+run_command ls $BACKUP_DIR/$second/cache.*.del || fail
+
+testname "restore of the two link chain"
+run_command rm -r $WORK_DIR || fail
+run_command "echo three > /cache/nandroid_test_stray" || fail
+run_command nandroid restore $BACKUP_DIR/$second || fail
+run_command mount /cache
+expect_file kept one || fail
+expect_file changed two || fail
+expect_file added two || fail
+run_command ls $WORK_DIR/deleted && fail
+run_command ls /cache/nandroid_test_stray && fail
+
+testname "restore of the full backup it is based on"
+run_command nandroid restore $BACKUP_DIR/$first || fail
+run_command mount /cache
+expect_file changed one || fail
+expect_file deleted one || fail
+run_command ls $WORK_DIR/added && fail
+
+# --------------- cleanup ----------------------
+
+cleanup
+
+echo
+echo PASS
+echo
@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "nandroid_throttle.h"
+
+// from linux/ioprio.h, which bionic doesn't ship
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_WHO_PROCESS 1
+
+// how often the frame latency is looked at, in seconds
+#define THROTTLE_INTERVAL 0.25
+// the limit never goes below this, so a stuck UI can't stall the backup
+#define THROTTLE_MIN_RATE (1024.0 * 1024)
+// and comes back up by this much every interval the UI keeps up
+#define THROTTLE_STEP (2 * 1024.0 * 1024)
+
+int nandroid_io_begin(int role) {
+    int previous = syscall(__NR_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    // both stay below the UI, which runs at the default of 4. Readers
+    // get the lowest best effort priority, so the writers draining what
+    // they read go first instead of piling up dirty pages. The idle
+    // class would starve a restore that syncs while anything else reads.
+    int prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, role == NANDROID_IO_READER ? 7 : 5);
+    if (syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio))
+        LOGW("Unable to lower the io priority\n");
+    return previous;
+}
+
+void nandroid_io_end(int previous) {
+    if (previous >= 0)
+        syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, previous);
+}
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+// bytes a second, 0 when unlimited
+static double throttle_rate = 0;
+static double throttle_bandwidth = 0;
+static int throttle_budget = 0;
+// when the io handed out so far is due to be done
+static double throttle_next = 0;
+static double throttle_checked = 0;
+static uint64_t throttle_bytes = 0;
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void nandroid_throttle_init(uint64_t bandwidth, int latency_budget) {
+    pthread_mutex_lock(&throttle_lock);
+    throttle_bandwidth = bandwidth;
+    throttle_rate = bandwidth;
+    throttle_budget = latency_budget;
+    throttle_next = 0;
+    throttle_checked = now();
+    throttle_bytes = 0;
+    pthread_mutex_unlock(&throttle_lock);
+}
+
+// Halves the limit while frames are late and raises it again step by
+// step once they aren't, dropping it without a configured bandwidth
+// once it no longer holds anything back.
+static void throttle_adapt(double t) {
+    double throughput = throttle_bytes / (t - throttle_checked);
+    if (ui_get_frame_latency() > throttle_budget) {
+        double rate = throttle_rate > 0 && throttle_rate < throughput ? throttle_rate : throughput;
+        throttle_rate = rate / 2 > THROTTLE_MIN_RATE ? rate / 2 : THROTTLE_MIN_RATE;
+    } else if (throttle_bandwidth == 0 && throughput < throttle_rate / 2) {
+        throttle_rate = 0;
+    } else if (throttle_rate > 0) {
+        throttle_rate += THROTTLE_STEP;
+        if (throttle_bandwidth > 0 && throttle_rate > throttle_bandwidth)
+            throttle_rate = throttle_bandwidth;
+    }
+    throttle_checked = t;
+    throttle_bytes = 0;
+}
+
+void nandroid_throttle(size_t len) {
+    double delay = 0;
+    pthread_mutex_lock(&throttle_lock);
+    double t = now();
+    throttle_bytes += len;
+    if (throttle_budget > 0 && t - throttle_checked >= THROTTLE_INTERVAL)
+        throttle_adapt(t);
+    if (throttle_rate > 0) {
+        // unused bandwidth doesn't carry over into a burst later
+        if (throttle_next < t)
+            throttle_next = t;
+        throttle_next += len / throttle_rate;
+        delay = throttle_next - t;
+    }
+    pthread_mutex_unlock(&throttle_lock);
+    if (delay > 0.001)
+        usleep((useconds_t)(delay * 1000000));
+}
@@ -0,0 +1,30 @@
+#ifndef NANDROID_THROTTLE_H
+#define NANDROID_THROTTLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Keeps backups and restores from starving the UI and everything else
+// on the same flash: io priorities for the threads doing the work, and
+// a bandwidth limit shared by all of them that backs off while UI
+// frames are late.
+
+// Threads reading backups or partitions, and those writing them back.
+#define NANDROID_IO_READER 0
+#define NANDROID_IO_WRITER 1
+
+// Sets the io priority of the calling thread, which the threads and
+// processes it starts inherit. Returns the previous one for
+// nandroid_io_end.
+int nandroid_io_begin(int role);
+void nandroid_io_end(int previous);
+
+// Limits all nandroid io to bandwidth bytes a second, or nothing if 0,
+// and lowers the limit while frames are later than latency_budget ms,
+// or never if that is 0.
+void nandroid_throttle_init(uint64_t bandwidth, int latency_budget);
+
+// Accounts for len bytes of io, sleeping for as long as the limit asks.
+void nandroid_throttle(size_t len);
+
+#endif
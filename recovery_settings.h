@@ -10,3 +10,5 @@
 // nandroid settings
 #define NANDROID_HIDE_PROGRESS_FILE  "clockworkmod/.hidenandroidprogress"
 #define NANDROID_BACKUP_FORMAT_FILE  "clockworkmod/.default_backup_format"
+#define NANDROID_VERIFY_FIRST_FILE   "clockworkmod/.nandroid_verify_first"
+#define NANDROID_SPARSE_IMAGES_FILE  "clockworkmod/.nandroid_sparse_images"
@@ -360,10 +360,19 @@ static void update_progress_locked(void)
     gr_flip();
 }
 
+// How late frames are, in ms, smoothed over the last few. Background work
+// like nandroid backs off when it grows.
+static volatile int gFrameLatency = 0;
+
+int ui_get_frame_latency() {
+    return gFrameLatency;
+}
+
 // Keeps the progress bar updated, even when the process is otherwise busy.
 static void *progress_thread(void *cookie)
 {
     double interval = 1.0 / ui_parameters.update_fps;
+    double wake = 0;
     for (;;) {
         double start = now();
         pthread_mutex_lock(&gUpdateMutex);
@@ -402,9 +411,13 @@ static void *progress_thread(void *cookie)
 
         pthread_mutex_unlock(&gUpdateMutex);
         double end = now();
+        // oversleeping, waiting for the lock and drawing all delay the frame
+        double late = end - (wake > 0 && start > wake ? wake : start);
+        gFrameLatency = (gFrameLatency * 3 + (int)(late * 1000)) / 4;
         // minimum of 20ms delay between frames
         double delay = interval - (end-start);
         if (delay < 0.02) delay = 0.02;
+        wake = end + delay;
         usleep((long)(delay * 1000000));
     }
     return NULL;